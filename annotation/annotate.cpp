@@ -0,0 +1,272 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <unordered_map>
+#include <chrono>
+#include <charconv>
+#include <cstdint>
+#include "../common/gzip_input.hpp"
+
+// print usage
+void usage(){
+    std::cout << "USAGE: annotate [--type=TYPE[,TYPE...]] [--min-len L] <gff3-file> <matches-file> <output-file>\n"
+              << "It finds the features of <gff3-file> (genes by default) that contain each match written by match,\n"
+              << "and writes one line per (match, feature) pair.\n"
+              << "\n"
+              << "<gff3-file> is the annotation of the genome the fragments were matched against (genomic.gff),\n"
+              << "its seqids being the chronosome names. It may be gzip compressed (.gff.gz).\n"
+              << "\n"
+              << "<matches-file> is the output of match, one line per match:\n"
+              << "  NUM,MATCH,CHRONOSOME,START,END[,...]\n"
+              << "START is 0-based and END is one past the match, as match writes them. --top-k lines work as\n"
+              << "well and give every place of the matches. Fragments without a match are skipped.\n"
+              << "\n"
+              << "--type picks the feature types (column 3) to annotate with, * for all of them (gene).\n"
+              << "--min-len L skips the matches shorter than L letters (0).\n"
+              << "\n"
+              << "Each line of <output-file> has the columns of genome_comparator.ipynb's fragment annotations:\n"
+              << "  seq_id,source,type,start,end,score,strand,phase,attributes,fragment,lengths,nonmodel_start,nonmodel_end\n"
+              << "the nine GFF3 columns of the feature as they are in the file, the match, its length and its\n"
+              << "START and END. The lines follow the matches, and the features of a match are in file order.\n"
+              << "A feature contains a match if it covers every letter of it, i.e. start <= START + 1 and END <= end\n"
+              << "(GFF3 counts from 1 and includes the end).\n";
+}
+
+/**
+ * A feature of the GFF3 file: its coordinates and the line to write back out
+ */
+struct Feature{
+    long long start, end;   // 1-based, inclusive
+    size_t order;           // place in the file
+    std::string line;       // the nine columns, tab separated
+};
+
+/**
+ * A match read from the output of match
+ */
+struct Match{
+    long long start, end;   // 0-based, end exclusive
+    std::string fragment;
+};
+
+/**
+ * split a line at a separator
+ * input : the line and the separator
+ * output: the fields, pointing into the line
+ */
+std::vector<std::string_view> split(std::string_view line, char separator){
+    std::vector<std::string_view> fields;
+    while(true){
+        size_t at = line.find(separator);
+        fields.push_back(line.substr(0, at));
+        if (at == std::string_view::npos){
+            return fields;
+        }
+        line.remove_prefix(at + 1);
+    }
+}
+
+// read a whole number, false if the text is not one
+bool number(std::string_view text, long long& value){
+    auto [end, problem] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return problem == std::errc() && end == text.data() + text.size();
+}
+
+/**
+ * write a csv field the way pandas does: quoted only if it has to be
+ */
+void writeField(std::ostream& out, std::string_view field){
+    if (field.find_first_of(",\"\r\n") == std::string_view::npos){
+        out << field;
+        return;
+    }
+    out << '"';
+    for (char ch : field){
+        if (ch == '"'){
+            out << '"';
+        }
+        out << ch;
+    }
+    out << '"';
+}
+
+int main(int argc, char* argv[]){
+    // handle command line input
+    std::vector<std::string> args;
+    std::vector<std::string> types{"gene"};
+    long long min_len = 0;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg.starts_with("--type")){
+            std::string list = arg.size() > 6 && arg[6] == '=' ? arg.substr(7) : (i + 1 < argc ? argv[++i] : "");
+            types.clear();
+            for (auto type : split(list, ',')){
+                if (!type.empty()){
+                    types.emplace_back(type);
+                }
+            }
+            if (types.empty()){
+                usage();
+                return -1;
+            }
+        }else if (arg.starts_with("--min-len")){
+            std::string num = arg.size() > 9 && arg[9] == '=' ? arg.substr(10) : (i + 1 < argc ? argv[++i] : "");
+            if (!number(num, min_len) || min_len < 0){
+                usage();
+                return -1;
+            }
+        }else{
+            args.push_back(arg);
+        }
+    }
+    if (args.size() != 3){
+        usage();
+        return -1;
+    }
+    std::string gff_file     = args[0];
+    std::string matches_file = args[1];
+    std::string output_file  = args[2];
+    bool any_type = std::ranges::find(types, "*") != types.end();
+
+    // open all the files needed and verify whether they are successful
+    gzip_input::File gff{gff_file};
+    std::ifstream matches{matches_file};
+    if (!gff){
+        std::cerr << "Failed to open input file " << gff_file << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    if (!matches){
+        std::cerr << "Failed to open input file " << matches_file << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    std::ofstream outfile{output_file};
+    if (!outfile){
+        std::cerr << "Failed to create output file (maybe it already exists) " << output_file << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    auto t1 = std::chrono::high_resolution_clock::now();
+
+    // the features of every seqid
+    std::unordered_map<std::string, int> seqids;
+    std::vector<std::vector<Feature>> features;
+    std::string line;
+    size_t count = 0, kept = 0;
+    for (size_t line_number = 1; std::getline(gff, line); ++line_number){
+        if (!line.empty() && line.back() == '\r'){
+            line.pop_back();
+        }
+        if (line.starts_with("##FASTA")){ // the sequences may follow the annotation
+            break;
+        }
+        if (line.empty() || line[0] == '#'){
+            continue;
+        }
+        auto columns = split(line, '\t');
+        long long start, end;
+        if (columns.size() != 9 || !number(columns[3], start) || !number(columns[4], end)){
+            std::cerr << "Failed to read line " << line_number << " of " << gff_file << " (not 9 tab separated GFF3 columns)\n";
+            std::cerr << "Exiting..." << '\n';
+            return -1;
+        }
+        ++count;
+        if (!any_type && std::ranges::find(types, columns[2]) == types.end()){
+            continue;
+        }
+        auto [seqid, added] = seqids.try_emplace(std::string(columns[0]), int(features.size()));
+        if (added){
+            features.emplace_back();
+        }
+        features[size_t(seqid->second)].push_back({start, end, kept++, line});
+    }
+    std::cout << "Read " << kept << " of the " << count << " features in " << gff_file << '\n';
+
+    // the matches, grouped by the seqid they are on
+    std::vector<Match> found;
+    std::vector<std::vector<size_t>> on(features.size());
+    for (size_t line_number = 1; std::getline(matches, line); ++line_number){
+        if (!line.empty() && line.back() == '\r'){
+            line.pop_back();
+        }
+        auto columns = split(line, ',');
+        long long start, end;
+        if (columns.size() < 5 || columns[2].empty()){ // no match
+            continue;
+        }
+        if (!number(columns[3], start) || !number(columns[4], end) || start < 0 || end < start){
+            if (line_number == 1){ // a header line
+                continue;
+            }
+            std::cerr << "Failed to read line " << line_number << " of " << matches_file << " (expected NUM,MATCH,CHRONOSOME,START,END)\n";
+            std::cerr << "Exiting..." << '\n';
+            return -1;
+        }
+        if (end - start < min_len){
+            continue;
+        }
+        auto seqid = seqids.find(std::string(columns[2]));
+        if (seqid != seqids.end()){
+            on[size_t(seqid->second)].push_back(found.size());
+        }
+        found.push_back({start, end, std::string(columns[1])});
+    }
+
+    // one sweep per seqid. The features are sorted by start and the matches
+    // by START; a feature joins the active ones once it starts at or before
+    // the first letter of the match, and leaves once it ends before it, since
+    // every later match starts there or further on. So only the features over
+    // the first letter of a match are ever looked at for it.
+    std::vector<std::pair<size_t, size_t>> hits; // (match, feature order)
+    std::vector<const Feature*> by_order(kept);
+    for (size_t s = 0; s < features.size(); ++s){
+        auto& list = features[s];
+        std::ranges::sort(list, {}, &Feature::start);
+        std::ranges::sort(on[s], {}, [&](size_t m){ return found[m].start; });
+        std::vector<const Feature*> active;
+        size_t next = 0;
+        for (size_t m : on[s]){
+            long long first = found[m].start + 1, last = found[m].end; // the match in GFF3 coordinates
+            for (; next < list.size() && list[next].start <= first; ++next){
+                active.push_back(&list[next]);
+            }
+            std::erase_if(active, [&](const Feature* feature){ return feature->end < first; });
+            for (const Feature* feature : active){
+                if (feature->end >= last){
+                    hits.emplace_back(m, feature->order);
+                }
+            }
+        }
+    }
+    for (const auto& list : features){
+        for (const auto& feature : list){
+            by_order[feature.order] = &feature;
+        }
+    }
+    std::ranges::sort(hits);
+
+    // write the annotations in the order of the matches
+    outfile << "seq_id,source,type,start,end,score,strand,phase,attributes,fragment,lengths,nonmodel_start,nonmodel_end\n";
+    for (const auto& [m, order] : hits){
+        for (auto column : split(by_order[order]->line, '\t')){
+            writeField(outfile, column);
+            outfile << ',';
+        }
+        const Match& match = found[m];
+        outfile << match.fragment << ',' << match.end - match.start << ',' << match.start << ',' << match.end << '\n';
+    }
+    outfile.close();
+    if (!outfile){
+        std::cerr << "Failed to write " << output_file << '\n';
+        return -1;
+    }
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::cout << "Done! " << hits.size() << " annotations of " << found.size() << " matches are in " << output_file << '\n';
+    std::cout << "Total time taken = " << std::chrono::duration_cast<std::chrono::milliseconds>(t2-t1).count() << '\n';
+    return 0;
+}
@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include "../common/gzip_input.hpp"
+#include "run.hpp"
+#include "synthetic.hpp"
+
+// print usage
+void usage(){
+    std::cout << "USAGE: bench [--match PATH] [--digest PATH] [--engines sam,fm,stream] [--digest-engines shift-and,aho-corasick]\n"
+              << "             [--threads 1,2,4] [--whole-genome] [--enzymes E1+E2] [--repeat R] [--format json|csv]\n"
+              << "             [--output FILE] [--keep] [--dir DIR]\n"
+              << "             [--genome FILE --fragments FILE | --length N --chromosomes C --gc F --repeats F\n"
+              << "              --repeat-length L --count K --seed S]\n"
+              << "\n"
+              << "Times match (../matching/match) and digestFragment (../fragments/digestFragment) on a synthetic\n"
+              << "genome (see generate; 20000000 bases and 10000 fragments by default) or on the files given,\n"
+              << "for every engine and thread count, and writes the results as JSON (or CSV) to stdout or FILE.\n"
+              << "\n"
+              << "Each match configuration is run twice: with one fragment, which is the time to read the genome\n"
+              << "and build the automaton or FM-index (setup_seconds, build_bases_per_second), and with all of\n"
+              << "them; the difference is the query time (query_seconds, fragments_per_second). For --engine\n"
+              << "stream the automaton is over the fragments, so its setup is mostly streaming the genome.\n"
+              << "peak_rss_kb is the largest resident set of the full run, as the kernel counted it.\n"
+              << "With --repeat R every run is repeated R times and the fastest kept.\n"
+              << "The data is made in DIR (a temporary directory by default) and removed afterwards unless --keep.\n";
+}
+
+std::vector<std::string> split(const std::string& list, char by){
+    std::vector<std::string> parts;
+    std::stringstream in{list};
+    for (std::string part; std::getline(in, part, by);){
+        if (!part.empty()){
+            parts.push_back(part);
+        }
+    }
+    return parts;
+}
+
+// one line of the results, as (name, JSON value) pairs
+using Row = std::vector<std::pair<std::string, std::string>>;
+
+std::string jsonText(const std::string& value){
+    return "\"" + value + "\"";
+}
+
+std::string number(double value){
+    std::ostringstream out;
+    out << std::setprecision(6) << value;
+    return out.str();
+}
+
+void writeJson(std::ostream& out, const Row& genome, const Row& fragments, const std::vector<Row>& rows){
+    auto object = [&](const Row& row){
+        out << '{';
+        for (size_t i = 0; i < row.size(); ++i){
+            out << (i ? ", " : "") << jsonText(row[i].first) << ": " << row[i].second;
+        }
+        out << '}';
+    };
+    out << "{\n  \"genome\": ";
+    object(genome);
+    out << ",\n  \"fragments\": ";
+    object(fragments);
+    out << ",\n  \"runs\": [";
+    for (size_t i = 0; i < rows.size(); ++i){
+        out << (i ? ",\n    " : "\n    ");
+        object(rows[i]);
+    }
+    out << "\n  ]\n}\n";
+}
+
+void writeCsv(std::ostream& out, const std::vector<Row>& rows){
+    static const std::vector<std::string> columns = {
+        "tool", "engine", "threads", "whole_genome", "status", "seconds", "setup_seconds", "build_bases_per_second",
+        "query_seconds", "fragments_per_second", "bases_per_second", "peak_rss_kb"};
+    for (size_t c = 0; c < columns.size(); ++c){
+        out << (c ? "," : "") << columns[c];
+    }
+    out << '\n';
+    for (const auto& row : rows){
+        for (size_t c = 0; c < columns.size(); ++c){
+            auto it = std::ranges::find_if(row, [&](const auto& field){ return field.first == columns[c]; });
+            std::string value = it == row.end() ? "" : it->second;
+            value.erase(std::remove(value.begin(), value.end(), '"'), value.end());
+            out << (c ? "," : "") << value;
+        }
+        out << '\n';
+    }
+}
+
+// the fastest of repeat runs, with the largest peak RSS of them
+run::Result fastest(const std::vector<std::string>& args, int repeat){
+    run::Result best;
+    for (int r = 0; r < repeat; ++r){
+        auto result = run::command(args);
+        if (result.status != 0){
+            return result;
+        }
+        long peak = std::max(best.peakKb, result.peakKb);
+        if (r == 0 || result.seconds < best.seconds){
+            best = result;
+        }
+        best.peakKb = peak;
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]){
+    // handle command line input
+    std::string match = "../matching/match", digest = "../fragments/digestFragment";
+    std::vector<std::string> engines = {"sam", "fm", "stream"}, digest_engines = {"shift-and", "aho-corasick"};
+    std::vector<int> thread_counts = {1, 2, 4};
+    std::string enzymes = "EcoRI+BamHI+HinFI";
+    std::string format = "json", output_file, dir, genome_file, fragments_file;
+    bool whole_genome = false, keep = false;
+    int repeat = 1;
+    synthetic::GenomeOptions genome_options;
+    genome_options.length = 20000000;
+    synthetic::FragmentOptions fragment_options;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg == "--whole-genome"){
+            whole_genome = true;
+            continue;
+        }
+        if (arg == "--keep"){
+            keep = true;
+            continue;
+        }
+        auto name = arg.substr(0, arg.find('='));
+        std::string value = arg.size() > name.size() ? arg.substr(name.size() + 1) : (i + 1 < argc ? argv[++i] : "");
+        double num = std::atof(value.c_str());
+        if (name == "--match" && !value.empty()){
+            match = value;
+        }else if (name == "--digest" && !value.empty()){
+            digest = value;
+        }else if (name == "--engines"){
+            engines = split(value, ',');
+        }else if (name == "--digest-engines"){
+            digest_engines = split(value, ',');
+        }else if (name == "--threads" && !value.empty()){
+            thread_counts.clear();
+            for (const auto& count : split(value, ',')){
+                thread_counts.push_back(std::max(1, std::atoi(count.c_str())));
+            }
+        }else if (name == "--enzymes" && !value.empty()){
+            enzymes = value;
+        }else if (name == "--repeat" && num >= 1){
+            repeat = int(num);
+        }else if (name == "--format" && (value == "json" || value == "csv")){
+            format = value;
+        }else if (name == "--output" && !value.empty()){
+            output_file = value;
+        }else if (name == "--dir" && !value.empty()){
+            dir = value;
+        }else if (name == "--genome" && !value.empty()){
+            genome_file = value;
+        }else if (name == "--fragments" && !value.empty()){
+            fragments_file = value;
+        }else if (name == "--length" && num >= 1){
+            genome_options.length = size_t(num);
+        }else if (name == "--chromosomes" && num >= 1){
+            genome_options.chromosomes = int(num);
+        }else if (name == "--gc" && num >= 0 && num <= 1){
+            genome_options.gc = num;
+        }else if (name == "--repeats" && num >= 0 && num < 1){
+            genome_options.repeats = num;
+        }else if (name == "--repeat-length" && num >= 1){
+            genome_options.repeatLength = size_t(num);
+        }else if (name == "--count" && num >= 1){
+            fragment_options.count = size_t(num);
+        }else if (name == "--seed"){
+            genome_options.seed = std::strtoull(value.c_str(), nullptr, 10);
+            fragment_options.seed = genome_options.seed + 1;
+        }else{
+            usage();
+            return -1;
+        }
+    }
+    if (genome_file.empty() != fragments_file.empty()){
+        usage();
+        return -1;
+    }
+    match = std::filesystem::weakly_canonical(match).string();
+    digest = std::filesystem::weakly_canonical(digest).string();
+
+    // make (or look over) the genome and the fragments
+    bool made_dir = dir.empty();
+    if (made_dir){
+        dir = (std::filesystem::temp_directory_path() / ("match-bench-" + std::to_string(getpid()))).string();
+    }
+    std::filesystem::create_directories(dir);
+    Row genome_row, fragments_row;
+    size_t bases = 0, fragment_count = 0, fragment_bases = 0;
+    if (genome_file.empty()){
+        std::cerr << "making a genome of " << genome_options.length << " bases and " << fragment_options.count << " fragments in " << dir << '\n';
+        genome_file = dir + "/genome.fa";
+        fragments_file = dir + "/fragments.csv";
+        auto chroms = synthetic::makeGenome(genome_options);
+        if (!synthetic::writeGenome(genome_file, chroms, genome_options.lineWidth, false)
+            || !synthetic::writeFragments(fragments_file, synthetic::makeFragments(chroms, fragment_options))){
+            std::cerr << "Failed to write the data to " << dir << '\n';
+            return -1;
+        }
+        genome_row = {{"synthetic", "true"}, {"gc", number(genome_options.gc)}, {"repeats", number(genome_options.repeats)},
+                      {"repeat_length", std::to_string(genome_options.repeatLength)}, {"seed", std::to_string(genome_options.seed)}};
+    }else{
+        genome_row = {{"synthetic", "false"}};
+    }
+    gzip_input::File genome{genome_file};
+    size_t chromosomes = 0;
+    for (std::string line; std::getline(genome, line);){
+        if (!line.empty() && line[0] == '>'){
+            ++chromosomes;
+        }else{
+            bases += size_t(std::ranges::count_if(line, [](char c){ return std::isalpha(static_cast<unsigned char>(c)); }));
+        }
+    }
+    genome_row.insert(genome_row.begin(), {{"file", jsonText(genome_file)}, {"bases", std::to_string(bases)},
+                                           {"chromosomes", std::to_string(chromosomes)}});
+    std::ifstream fragments{fragments_file};
+    std::string first;
+    for (std::string line; std::getline(fragments, line);){
+        if (fragment_count++ == 0){
+            first = line;
+        }
+        auto comma = line.find(',');
+        if (comma != std::string::npos){
+            fragment_bases += std::min(line.find(',', comma + 1), line.size()) - comma - 1;
+        }
+    }
+    fragments_row = {{"file", jsonText(fragments_file)}, {"count", std::to_string(fragment_count)}, {"bases", std::to_string(fragment_bases)}};
+    if (bases == 0 || fragment_count == 0){
+        std::cerr << "Failed to read the genome or the fragments\n";
+        return -1;
+    }
+    std::string one_file = dir + "/one.csv", out_file = dir + "/out.csv";
+    std::ofstream{one_file} << first << '\n';
+
+    std::vector<Row> rows;
+    for (const auto& engine : engines){
+        for (int threads : thread_counts){
+            std::vector<std::string> args = {match, "--engine=" + engine, "--threads", std::to_string(threads)};
+            if (whole_genome){
+                args.push_back("--whole-genome");
+            }
+            auto with = [&](const std::string& file){
+                auto all = args;
+                all.insert(all.end(), {genome_file, file, out_file});
+                return all;
+            };
+            std::cerr << "match --engine=" << engine << " --threads " << threads << (whole_genome ? " --whole-genome" : "") << '\n';
+            auto setup = fastest(with(one_file), repeat);
+            auto full = setup.status == 0 ? fastest(with(fragments_file), repeat) : setup;
+            double query = std::max(0.0, full.seconds - setup.seconds);
+            Row row = {{"tool", jsonText("match")}, {"engine", jsonText(engine)}, {"threads", std::to_string(threads)},
+                       {"whole_genome", whole_genome ? "true" : "false"}, {"status", std::to_string(full.status)}};
+            if (full.status == 0){
+                row.insert(row.end(), {{"seconds", number(full.seconds)}, {"setup_seconds", number(setup.seconds)},
+                                       {"build_bases_per_second", number(double(bases) / setup.seconds)},
+                                       {"query_seconds", number(query)},
+                                       {"fragments_per_second", number(query > 0 ? double(fragment_count) / query : 0)},
+                                       {"peak_rss_kb", std::to_string(full.peakKb)}});
+            }
+            rows.push_back(std::move(row));
+        }
+    }
+    for (const auto& engine : digest_engines){
+        for (int threads : thread_counts){
+            std::vector<std::string> args = {digest, "--engine=" + engine};
+            if (threads > 1){
+                args.insert(args.end(), {"--threads", std::to_string(threads)});
+            }
+            args.insert(args.end(), {genome_file, enzymes, out_file});
+            std::cerr << "digestFragment --engine=" << engine << " --threads " << threads << '\n';
+            auto result = fastest(args, repeat);
+            Row row = {{"tool", jsonText("digestFragment")}, {"engine", jsonText(engine)}, {"threads", std::to_string(threads)},
+                       {"enzymes", jsonText(enzymes)}, {"status", std::to_string(result.status)}};
+            if (result.status == 0){
+                row.insert(row.end(), {{"seconds", number(result.seconds)},
+                                       {"bases_per_second", number(double(bases) / result.seconds)},
+                                       {"peak_rss_kb", std::to_string(result.peakKb)}});
+            }
+            rows.push_back(std::move(row));
+        }
+    }
+    if (!keep){
+        std::filesystem::remove(one_file);
+        std::filesystem::remove(out_file);
+        if (made_dir){
+            std::filesystem::remove_all(dir);
+        }
+    }
+
+    // write the results
+    std::ofstream file;
+    if (!output_file.empty()){
+        file.open(output_file);
+        if (!file){
+            std::cerr << "Failed to create output file " << output_file << '\n';
+            return -1;
+        }
+    }
+    std::ostream& out = output_file.empty() ? std::cout : file;
+    if (format == "csv"){
+        writeCsv(out, rows);
+    }else{
+        writeJson(out, genome_row, fragments_row, rows);
+    }
+    return 0;
+}
@@ -0,0 +1,796 @@
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "run.hpp"
+#include "synthetic.hpp"
+
+// print usage
+void usage(){
+    std::cout << "USAGE: differential [--rounds N] [--seed S] [--match PATH] [--digest PATH] [--shatter PATH] [--dir DIR] [--keep]\n"
+              << "\n"
+              << "Checks match (../matching/match) and digestFragment (../fragments/digestFragment) against\n"
+              << "brute force on N (20) small random genomes, written plain, gzip or BGZF, with random line\n"
+              << "widths, CR LF line breaks, soft-masking, IUPAC codes and repeats:\n"
+              << "  every match engine, per chronosome and --whole-genome, with and without --both-strands,\n"
+              << "  on a random number of threads, against the longest match found with the quadratic table;\n"
+              << "  a reference index, --window, match serve and a fragment index from digestFragment against\n"
+              << "  the same runs without them;\n"
+              << "  --top-k and --min-len against every maximal match looked up by hand;\n"
+              << "  --mismatches K against the longest stretches with up to K letters different, slid along\n"
+              << "  every diagonal;\n"
+              << "  every digestFragment engine, streamed, --mmap and --threads, against cutting at every\n"
+              << "  place a recognition site matches, also with sequence before the first header and with a\n"
+              << "  chronosome of several MB on one line;\n"
+              << "  shatter (../shatter/shatter) against digestFragment and then match.\n"
+              << "It stops at the first difference, says what it was and keeps the files of that round in DIR\n"
+              << "(a temporary directory by default); it exits with 1 then, and with 0 if every round passed.\n";
+}
+
+std::string match_exe = "../matching/match", digest_exe = "../fragments/digestFragment", shatter_exe = "../shatter/shatter";
+std::string failure; // what went wrong, empty while all is well
+std::string log_file = "/dev/null"; // the stderr of the last tool run
+
+bool fail(const std::string& what){
+    if (failure.empty()){
+        failure = what;
+    }
+    return false;
+}
+
+std::string commandLine(const std::vector<std::string>& args){
+    std::string line;
+    for (const auto& arg : args){
+        line += (line.empty() ? "" : " ") + arg;
+    }
+    return line;
+}
+
+// run a tool that has to succeed
+bool runs(const std::vector<std::string>& args, const std::string& out = "/dev/null", const std::string& in = "/dev/null"){
+    auto result = run::command(args, in, out, log_file);
+    if (result.status != 0){
+        return fail(commandLine(args) + " exited with " + std::to_string(result.status) + " (see " + log_file + ")");
+    }
+    return true;
+}
+
+std::vector<std::string> readLines(const std::string& file_name){
+    std::ifstream file{file_name};
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(file, line);){
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+// the fields of a CSV line, empty ones included
+std::vector<std::string> fields(const std::string& line){
+    std::vector<std::string> parts{""};
+    for (char c : line){
+        if (c == ','){
+            parts.emplace_back();
+        }else{
+            parts.back() += c;
+        }
+    }
+    return parts;
+}
+
+struct Round{
+    std::string dir;
+    std::string genome_file;
+    std::string fragments_file;
+    std::vector<std::string> names;
+    std::vector<std::string> chroms;        // upper case, as the tools see them
+    std::vector<std::string> fragments;
+    std::mt19937_64 rng;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// match
+
+// the longest match of q ending at each of its letters in t, from the quadratic table
+std::vector<int> longestEnding(const std::string& q, const std::string& t){
+    std::vector<int> longest(q.size()), previous(t.size() + 1), current(t.size() + 1);
+    for (size_t i = 0; i < q.size(); ++i){
+        for (size_t j = 0; j < t.size(); ++j){
+            current[j + 1] = q[i] == t[j] ? previous[j] + 1 : 0;
+            longest[i] = std::max(longest[i], current[j + 1]);
+        }
+        std::swap(previous, current);
+    }
+    return longest;
+}
+
+// the same with up to k letters different, sliding a window along every diagonal
+std::vector<int> longestEnding(const std::string& q, const std::string& t, int k){
+    std::vector<int> longest(q.size());
+    for (long shift = 1 - long(q.size()); shift < long(t.size()); ++shift){ // q[i] lies against t[i + shift]
+        long first = std::max(0L, -shift), last = std::min(long(q.size()), long(t.size()) - shift);
+        int different = 0;
+        for (long i = first, from = first; i < last; ++i){
+            different += q[size_t(i)] != t[size_t(i + shift)];
+            for (; different > k; ++from){
+                different -= q[size_t(from)] != t[size_t(from + shift)];
+            }
+            longest[size_t(i)] = std::max(longest[size_t(i)], int(i - from + 1));
+        }
+    }
+    return longest;
+}
+
+struct Expected{
+    std::string match;
+    int chrom = -1;         // the chronosome it has to be in (per chronosome only)
+    bool reverse = false;
+};
+
+/**
+ * what match has to report for one fragment: the earliest-ending longest match of each unit
+ * (a chronosome or the whole genome, forward then reverse complement), a later unit's only if
+ * it is strictly longer
+ * input : ends[strand][chrom] from longestEnding, the fragment and its reverse complement
+ */
+Expected expect(const std::vector<std::vector<std::vector<int>>>& ends, const std::vector<std::string>& queries,
+                bool whole, bool both){
+    Expected best;
+    auto consider = [&](const std::vector<int>& longest, int strand, int chrom){
+        auto most = std::ranges::max_element(longest);
+        if (most != longest.end() && size_t(*most) > best.match.size()){
+            size_t end = size_t(most - longest.begin()) + 1;
+            best = {queries[size_t(strand)].substr(end - size_t(*most), size_t(*most)), chrom, strand == 1};
+        }
+    };
+    int strands = both ? 2 : 1;
+    if (whole){
+        for (int s = 0; s < strands; ++s){
+            std::vector<int> longest(queries[size_t(s)].size());
+            for (const auto& in_chrom : ends[size_t(s)]){
+                for (size_t i = 0; i < longest.size(); ++i){
+                    longest[i] = std::max(longest[i], in_chrom[i]);
+                }
+            }
+            consider(longest, s, -1);
+        }
+    }else{
+        for (size_t c = 0; c < ends[0].size(); ++c){
+            for (int s = 0; s < strands; ++s){
+                consider(ends[size_t(s)][c], s, int(c));
+            }
+        }
+    }
+    return best;
+}
+
+/**
+ * check an output file of match against the expected matches
+ * input : first_place if START has to be the first place the match occurs (the suffix automaton),
+ *         and how many letters the genome may have different (--mismatches)
+ */
+bool checkMatches(const Round& round, const std::string& out_file, const std::vector<Expected>& expected,
+                  bool whole, bool both, bool first_place, const std::string& what, int mismatches = 0){
+    auto lines = readLines(out_file);
+    if (lines.size() != expected.size()){
+        return fail(what + ": " + std::to_string(lines.size()) + " lines for " + std::to_string(expected.size()) + " fragments");
+    }
+    for (size_t k = 0; k < lines.size(); ++k){
+        auto wrong = [&](const std::string& why){
+            return fail(what + ": " + why + "\n  fragment " + std::to_string(k + 1) + " " + round.fragments[k]
+                        + "\n  expected " + (expected[k].match.empty() ? "no match" : expected[k].match)
+                        + (both ? (expected[k].reverse ? " on -" : " on +") : "")
+                        + (expected[k].chrom >= 0 ? " in " + round.names[size_t(expected[k].chrom)] : "")
+                        + "\n  got      " + lines[k]);
+        };
+        auto f = fields(lines[k]);
+        if (f[0] != std::to_string(k + 1)){
+            return wrong("the lines are out of order");
+        }
+        if (f[1] != expected[k].match){
+            return wrong("not the expected match");
+        }
+        if (f[1].empty()){
+            if (lines[k] != f[0] + (both ? ",,,," : ",,,")){
+                return wrong("a line without a match should be NUM,,,");
+            }
+            continue;
+        }
+        if (f.size() != (both ? 6u : 5u) || (both && f[5] != (expected[k].reverse ? "-" : "+"))){
+            return wrong("the wrong columns or strand");
+        }
+        auto chrom = std::ranges::find(round.names, f[2]) - round.names.begin();
+        if (size_t(chrom) == round.names.size()){
+            return wrong("no such chronosome");
+        }
+        if (expected[k].chrom >= 0 && chrom != expected[k].chrom){
+            return wrong("the match is from the wrong chronosome");
+        }
+        const std::string& s = round.chroms[size_t(chrom)];
+        size_t start = std::strtoull(f[3].c_str(), nullptr, 10), end = std::strtoull(f[4].c_str(), nullptr, 10);
+        if (end < start || end > s.size() || end - start != f[1].size()
+            || std::inner_product(f[1].begin(), f[1].end(), s.begin() + long(start), 0, std::plus<>{}, std::not_equal_to<>{}) > mismatches){
+            return wrong("START and END do not hold MATCH");
+        }
+        if (first_place){
+            size_t first_chrom = size_t(chrom);
+            if (whole){
+                first_chrom = size_t(std::ranges::find_if(round.chroms, [&](const auto& c){
+                    return c.find(f[1]) != std::string::npos;
+                }) - round.chroms.begin());
+            }
+            if (size_t(chrom) != first_chrom || s.find(f[1]) != start){
+                return wrong("not the first place the match occurs");
+            }
+        }
+    }
+    return true;
+}
+
+// the lines of the answers of match serve, put back in the order of the batches
+bool servedLines(const std::string& out_file, size_t batches, std::vector<std::string>& lines){
+    auto answer = readLines(out_file);
+    std::map<size_t, std::vector<std::string>> by_id;
+    for (size_t at = 0; at < answer.size();){
+        std::istringstream head{answer[at++]};
+        std::string word;
+        size_t id = 0, count = 0;
+        if (!(head >> word >> id >> count) || word != "RESULT" || at + count > answer.size()){
+            return fail("match serve answered " + answer[at - 1]);
+        }
+        by_id[id].assign(answer.begin() + long(at), answer.begin() + long(at + count));
+        at += count;
+    }
+    if (by_id.size() != batches){
+        return fail("match serve answered " + std::to_string(by_id.size()) + " of " + std::to_string(batches) + " batches");
+    }
+    for (auto& [_, batch] : by_id){
+        lines.insert(lines.end(), batch.begin(), batch.end());
+    }
+    return true;
+}
+
+bool sameLines(const std::string& a, const std::string& b, const std::string& what){
+    auto x = readLines(a), y = readLines(b);
+    if (x == y){
+        return true;
+    }
+    size_t k = 0;
+    while(k < x.size() && k < y.size() && x[k] == y[k]){
+        ++k;
+    }
+    return fail(what + ": " + a + " and " + b + " differ at line " + std::to_string(k + 1) + "\n  "
+                + (k < x.size() ? x[k] : "(end)") + "\n  " + (k < y.size() ? y[k] : "(end)"));
+}
+
+/**
+ * --top-k and --min-len: every maximal match (the longest match ending at a letter, not
+ * extended by the next one) of the fragment and, with both strands, of its reverse complement,
+ * longest first, the same letters only once, then every place each of them occurs
+ */
+std::set<std::string> expectListing(const Round& round, const std::vector<std::vector<std::vector<int>>>& ends,
+                                    const std::vector<std::string>& queries, size_t number, int top_k, int min_len, bool both){
+    struct Candidate{ int length; int strand; std::string letters; };
+    std::vector<Candidate> candidates;
+    for (int s = 0; s < (both ? 2 : 1); ++s){
+        const auto& q = queries[size_t(s)];
+        std::vector<int> longest(q.size());
+        for (const auto& in_chrom : ends[size_t(s)]){
+            for (size_t i = 0; i < q.size(); ++i){
+                longest[i] = std::max(longest[i], in_chrom[i]);
+            }
+        }
+        for (size_t j = 0; j < q.size(); ++j){
+            if (longest[j] > 0 && (j + 1 == q.size() || longest[j + 1] != longest[j] + 1)){
+                candidates.push_back({longest[j], s, q.substr(j + 1 - size_t(longest[j]), size_t(longest[j]))});
+            }
+        }
+    }
+    std::ranges::stable_sort(candidates, [](const auto& a, const auto& b){ return a.length > b.length; });
+    std::vector<Candidate> chosen;
+    for (const auto& c : candidates){
+        if (c.length < min_len || (top_k > 0 && int(chosen.size()) == top_k)){
+            break;
+        }
+        if (std::ranges::none_of(chosen, [&](const auto& x){ return x.letters == c.letters; })){
+            chosen.push_back(c);
+        }
+    }
+    std::set<std::string> lines;
+    for (size_t rank = 0; rank < chosen.size(); ++rank){
+        const auto& m = chosen[rank];
+        std::vector<std::pair<size_t, size_t>> places;
+        for (size_t c = 0; c < round.chroms.size(); ++c){
+            for (size_t at = round.chroms[c].find(m.letters); at != std::string::npos; at = round.chroms[c].find(m.letters, at + 1)){
+                places.emplace_back(c, at);
+            }
+        }
+        for (auto [c, at] : places){
+            lines.insert(std::to_string(number) + "," + m.letters + "," + round.names[c] + "," + std::to_string(at) + ","
+                         + std::to_string(at + m.letters.size()) + "," + std::to_string(rank + 1) + ","
+                         + std::to_string(places.size()) + (both ? (m.strand ? ",-" : ",+") : ""));
+        }
+    }
+    return lines;
+}
+
+bool checkMatch(Round& round){
+    // the brute force is done once per fragment, every configuration is read off it
+    std::vector<std::vector<std::vector<std::vector<int>>>> ends;
+    std::vector<std::vector<std::string>> queries;
+    for (const auto& f : round.fragments){
+        queries.push_back({f, synthetic::reverseComplement(f)});
+        ends.emplace_back(2);
+        for (int s = 0; s < 2; ++s){
+            for (const auto& chrom : round.chroms){
+                ends.back()[size_t(s)].push_back(longestEnding(queries.back()[size_t(s)], chrom));
+            }
+        }
+    }
+    auto threads = [&]{ return std::to_string(1 + round.rng() % 4); };
+    const std::string out = round.dir + "/match.csv", other = round.dir + "/other.csv";
+    for (std::string engine : {"sam", "fm", "stream"}){
+        for (bool whole : {false, true}){
+            for (bool both : {false, true}){
+                if (engine == "stream" && !whole){ // chosen like --whole-genome anyway
+                    continue;
+                }
+                std::vector<Expected> expected;
+                for (size_t k = 0; k < round.fragments.size(); ++k){
+                    expected.push_back(expect(ends[k], queries[k], whole, both));
+                }
+                std::vector<std::string> args = {match_exe, "--engine=" + engine, "--threads", threads()};
+                if (whole && engine != "stream"){
+                    args.push_back("--whole-genome");
+                }
+                if (both){
+                    args.push_back("--both-strands");
+                }
+                auto direct = args;
+                direct.insert(direct.end(), {round.genome_file, round.fragments_file, out});
+                if (!runs(direct) || !checkMatches(round, out, expected, whole, both, engine == "sam", commandLine(direct))){
+                    return false;
+                }
+                if (engine == "sam"){ // a reference index has to give the same lines
+                    std::string index_file = round.dir + "/genome.sami";
+                    std::vector<std::string> build = {match_exe, "index", round.genome_file, index_file};
+                    if (whole){
+                        build.insert(build.begin() + 2, "--whole-genome");
+                    }
+                    auto indexed = args;
+                    indexed.insert(indexed.end(), {index_file, round.fragments_file, other});
+                    if (!runs(build) || !runs(indexed) || !sameLines(out, other, commandLine(indexed))){
+                        return false;
+                    }
+                    // and so do windows of the genome, of any size
+                    size_t letters = 0;
+                    for (const auto& chrom : round.chroms){
+                        letters += chrom.size();
+                    }
+                    auto windowed = args;
+                    windowed.insert(windowed.end(), {"--window", std::to_string(1 + round.rng() % std::max<size_t>(letters, 1)),
+                                                     round.genome_file, round.fragments_file, other});
+                    if (!runs(windowed) || !sameLines(out, other, commandLine(windowed))){
+                        return false;
+                    }
+                }
+                if (whole && engine != "stream"){ // so does match serve, two batches over stdin
+                    std::string request = round.dir + "/request.txt";
+                    std::ofstream file{request};
+                    size_t half = round.fragments.size() / 2;
+                    file << "BATCH 1 " << half << '\n';
+                    for (size_t k = 0; k < round.fragments.size(); ++k){
+                        if (k == half){
+                            file << "BATCH 2 " << round.fragments.size() - half << '\n';
+                        }
+                        file << k + 1 << ',' << round.fragments[k] << '\n';
+                    }
+                    file << "QUIT\n";
+                    file.close();
+                    std::vector<std::string> serve = {match_exe, "serve", "--engine=" + engine, "--threads", threads()};
+                    if (both){
+                        serve.push_back("--both-strands");
+                    }
+                    serve.push_back(round.genome_file);
+                    std::vector<std::string> served;
+                    if (!runs(serve, other, request) || !servedLines(other, 2, served)){
+                        return false;
+                    }
+                    std::ofstream lines{other};
+                    for (const auto& line : served){
+                        lines << line << '\n';
+                    }
+                    lines.close();
+                    if (!sameLines(out, other, commandLine(serve))){
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    // every place of the maximal matches
+    for (std::string engine : {"sam", "fm"}){
+        int top_k = int(round.rng() % 4), min_len = int(1 + round.rng() % 12);
+        bool both = round.rng() % 2;
+        std::vector<std::string> args = {match_exe, "--engine=" + engine, "--threads", threads(), "--min-len", std::to_string(min_len)};
+        if (top_k > 0){
+            args.insert(args.end(), {"--top-k", std::to_string(top_k)});
+        }
+        if (both){
+            args.push_back("--both-strands");
+        }
+        args.insert(args.end(), {round.genome_file, round.fragments_file, out});
+        if (!runs(args)){
+            return false;
+        }
+        std::set<std::string> expected, got;
+        for (size_t k = 0; k < round.fragments.size(); ++k){
+            expected.merge(expectListing(round, ends[k], queries[k], k + 1, top_k, min_len, both));
+        }
+        for (const auto& line : readLines(out)){
+            got.insert(line);
+        }
+        if (got != expected){
+            std::vector<std::string> missing, extra;
+            std::ranges::set_difference(expected, got, std::back_inserter(missing));
+            std::ranges::set_difference(got, expected, std::back_inserter(extra));
+            return fail(commandLine(args) + ": " + std::to_string(missing.size()) + " lines missing"
+                        + (missing.empty() ? "" : " (" + missing[0] + ")") + ", " + std::to_string(extra.size())
+                        + " lines too many" + (extra.empty() ? "" : " (" + extra[0] + ")"));
+        }
+    }
+
+    // the longest stretches with up to K letters different
+    int mismatches = int(1 + round.rng() % 3);
+    for (size_t k = 0; k < round.fragments.size(); ++k){
+        for (int s = 0; s < 2; ++s){
+            for (size_t c = 0; c < round.chroms.size(); ++c){
+                ends[k][size_t(s)][c] = longestEnding(queries[k][size_t(s)], round.chroms[c], mismatches);
+            }
+        }
+    }
+    for (std::string engine : {"sam", "fm"}){
+        bool whole = round.rng() % 2, both = round.rng() % 2;
+        std::vector<Expected> expected;
+        for (size_t k = 0; k < round.fragments.size(); ++k){
+            expected.push_back(expect(ends[k], queries[k], whole, both));
+        }
+        std::vector<std::string> args = {match_exe, "--engine=" + engine, "--threads", threads(), "--mismatches", std::to_string(mismatches)};
+        if (whole){
+            args.push_back("--whole-genome");
+        }
+        if (both){
+            args.push_back("--both-strands");
+        }
+        args.insert(args.end(), {round.genome_file, round.fragments_file, out});
+        if (!runs(args) || !checkMatches(round, out, expected, whole, both, false, commandLine(args), mismatches)){
+            return false;
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// digestFragment
+
+struct Enzyme{
+    std::string name;
+    std::string site;
+    size_t cut;
+};
+
+// the enzymes digestFragment knows, read off its usage (NAME SITE with | at the cut)
+std::vector<Enzyme> knownEnzymes(const std::string& dir){
+    std::string usage_file = dir + "/usage.txt";
+    run::command({digest_exe}, "/dev/null", usage_file);
+    std::vector<Enzyme> enzymes;
+    bool table = false;
+    for (const auto& line : readLines(usage_file)){
+        if (line.starts_with("Character |")){
+            table = true;
+            continue;
+        }
+        std::istringstream in{line};
+        std::string name, site;
+        if (table && in >> name >> site && site.find('|') != std::string::npos){
+            size_t cut = site.find('|');
+            enzymes.push_back({name, site.erase(cut, 1), cut});
+        }else if (table && !enzymes.empty()){
+            break;
+        }
+    }
+    std::filesystem::remove(usage_file);
+    return enzymes;
+}
+
+// whether a letter of a recognition site matches a base of the genome (an N in a site matches N too)
+bool siteMatches(char code, char base){
+    static const std::map<char, std::string> bases = {
+        {'R', "AG"}, {'Y', "CT"}, {'S', "CG"}, {'W', "AT"}, {'K', "GT"}, {'M', "AC"},
+        {'B', "CGT"}, {'D', "AGT"}, {'H', "ACT"}, {'V', "ACG"}, {'N', "ACGT"}};
+    auto it = bases.find(code);
+    return code == base || (it != bases.end() && it->second.find(base) != std::string::npos);
+}
+
+// cut every chronosome wherever a site matches; a place cut by several enzymes goes to the first one given
+std::vector<std::string> expectDigest(const std::vector<std::string>& chroms, const std::vector<Enzyme>& chosen){
+    std::vector<std::string> lines;
+    for (const auto& s : chroms){
+        std::map<size_t, size_t> cuts; // place -> enzyme
+        for (size_t at = 0; at < s.size(); ++at){
+            for (size_t e = 0; e < chosen.size(); ++e){
+                const auto& site = chosen[e].site;
+                bool found = at + site.size() <= s.size();
+                for (size_t i = 0; found && i < site.size(); ++i){
+                    found = siteMatches(site[i], s[at + i]);
+                }
+                if (found && (!cuts.count(at + chosen[e].cut) || cuts[at + chosen[e].cut] > e)){
+                    cuts[at + chosen[e].cut] = e;
+                }
+            }
+        }
+        size_t from = 0, number = 0;
+        std::string left = "-";
+        for (auto [place, e] : cuts){
+            lines.push_back(std::to_string(++number) + "," + s.substr(from, place - from) + "," + left + "," + chosen[e].name);
+            from = place;
+            left = chosen[e].name;
+        }
+        lines.push_back(std::to_string(++number) + "," + s.substr(from) + "," + left + ",-");
+    }
+    return lines;
+}
+
+bool checkDigest(Round& round, const std::vector<Enzyme>& enzymes){
+    std::vector<Enzyme> chosen;
+    size_t count = 1 + round.rng() % 4;
+    while(chosen.size() < count){
+        const auto& e = enzymes[round.rng() % enzymes.size()];
+        if (std::ranges::none_of(chosen, [&](const auto& x){ return x.name == e.name; })){
+            chosen.push_back(e);
+        }
+    }
+    std::string names;
+    for (const auto& e : chosen){
+        names += (names.empty() ? "" : "+") + e.name;
+    }
+    const std::string out = round.dir + "/digest.csv";
+    // every engine and mode on one genome file, against what cutting by hand gives
+    auto digests = [&](const std::string& genome_file, const std::vector<std::string>& chroms,
+                       const std::vector<std::vector<std::string>>& modes){
+        auto expected = expectDigest(chroms, chosen);
+        for (std::string engine : {"shift-and", "aho-corasick"}){
+            for (const auto& mode : modes){
+                std::vector<std::string> args = {digest_exe, "--engine=" + engine};
+                args.insert(args.end(), mode.begin(), mode.end());
+                args.insert(args.end(), {genome_file, names, out});
+                if (!runs(args)){
+                    return false;
+                }
+                auto got = readLines(out);
+                if (got != expected){
+                    size_t k = 0;
+                    while(k < got.size() && k < expected.size() && got[k] == expected[k]){
+                        ++k;
+                    }
+                    return fail(commandLine(args) + ": line " + std::to_string(k + 1) + "\n  expected "
+                                + (k < expected.size() ? expected[k] : "(end)") + "\n  got      " + (k < got.size() ? got[k] : "(end)"));
+                }
+            }
+        }
+        return true;
+    };
+    const std::vector<std::vector<std::string>> modes = {{}, {"--mmap"}, {"--threads", "3"}};
+    if (!digests(round.genome_file, round.chroms, modes)){
+        return false;
+    }
+
+    // sequence before the first header is numbered like a header of its own
+    std::vector<synthetic::Chromosome> genome;
+    for (size_t c = 0; c < round.chroms.size(); ++c){
+        genome.push_back({round.names[c], round.chroms[c]});
+    }
+    std::string text = synthetic::fastaText(genome, 1 + round.rng() % 80, round.rng() % 2);
+    std::string headless = round.dir + "/headless.fa";
+    std::ofstream{headless, std::ios::binary} << text.substr(text.find('\n') + 1);
+    if (!round.chroms[0].empty() && !digests(headless, round.chroms, modes)){ // (an empty one is no fragment at all)
+        return false;
+    }
+
+    // a chronosome on one line, longer than the 4 MiB pieces --threads splits a header into
+    std::string bases;
+    for (size_t n = round.rng() % 1000; n > 0; --n){ // so the pieces end somewhere else every round
+        bases += "ACGT"[round.rng() % 4];
+    }
+    while(bases.size() < (9 << 20)){
+        bases += "ACGT"[round.rng() % 4];
+        for (const auto& chrom : round.chroms){
+            bases += chrom;
+        }
+    }
+    std::vector<synthetic::Chromosome> long_line = {{"long", bases}, genome[0]};
+    std::string one_line = round.dir + "/one-line.fa";
+    if (!synthetic::writeGenome(one_line, long_line, bases.size(), round.rng() % 2)){
+        return fail("failed to write " + one_line);
+    }
+    if (!digests(one_line, {bases, round.chroms[0]}, {{"--threads", "3"}})){
+        return false;
+    }
+
+    // the fragments of a digest, as a csv and as a fragment index, have to match the same
+    std::string csv = round.dir + "/fragments.csv.digest", index = round.dir + "/fragments.fi";
+    std::string from_csv = round.dir + "/match.csv", from_index = round.dir + "/other.csv";
+    std::vector<std::string> args = {match_exe, "--threads", std::to_string(1 + round.rng() % 4), round.genome_file};
+    auto with = [&](const std::string& fragments, const std::string& result){
+        auto all = args;
+        all.insert(all.end(), {fragments, result});
+        return all;
+    };
+    return runs({digest_exe, round.genome_file, names, csv}) && runs({digest_exe, "--format=index", "--packed", round.genome_file, names, index})
+        && runs(with(csv, from_csv)) && runs(with(index, from_index))
+        && sameLines(from_csv, from_index, commandLine(with(index, from_index)));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// shatter
+
+/**
+ * shatter against digestFragment and then match --whole-genome (or match with a reference
+ * index), digesting a query genome made of the fragments, a few to a chronosome
+ */
+bool checkShatter(Round& round, const std::vector<Enzyme>& enzymes){
+    std::vector<synthetic::Chromosome> query;
+    for (size_t k = 0; k < round.fragments.size(); ++k){
+        if (k % 5 == 0){
+            query.push_back({"query" + std::to_string(query.size() + 1), ""});
+        }
+        query.back().bases += round.fragments[k];
+    }
+    std::string query_file = round.dir + (round.rng() % 2 ? "/query.fa" : "/query.fa.gz");
+    if (!synthetic::writeGenome(query_file, query, 60, false, query_file.ends_with(".gz") ? "gzip" : "plain")){
+        return fail("failed to write " + query_file);
+    }
+    std::string names;
+    for (size_t count = 1 + round.rng() % 2; count > 0; --count){
+        names += (names.empty() ? "" : "+") + enzymes[round.rng() % enzymes.size()].name;
+    }
+    std::string csv = round.dir + "/query.csv", index_file = round.dir + "/genome.sami";
+    std::string out = round.dir + "/match.csv", other = round.dir + "/other.csv";
+    if (!runs({digest_exe, query_file, names, csv}) || !runs({match_exe, "index", round.genome_file, index_file})){
+        return false;
+    }
+    for (std::string engine : {"sam", "fm", "index"}){
+        bool both = round.rng() % 2;
+        std::string reference = engine == "index" ? index_file : round.genome_file;
+        std::vector<std::string> match = {match_exe, "--threads", std::to_string(1 + round.rng() % 4)};
+        std::vector<std::string> shatter = {shatter_exe, "--threads", std::to_string(1 + round.rng() % 4),
+                                            "--batch", std::to_string(1 + round.rng() % 300)};
+        if (engine != "index"){
+            match.insert(match.end(), {"--whole-genome", "--engine=" + engine});
+            shatter.push_back("--engine=" + engine);
+        }
+        if (both){
+            match.push_back("--both-strands");
+            shatter.push_back("--both-strands");
+        }
+        match.insert(match.end(), {reference, csv, out});
+        shatter.insert(shatter.end(), {reference, query_file, names, other});
+        if (!runs(match) || !runs(shatter) || !sameLines(out, other, commandLine(shatter))){
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]){
+    // handle command line input
+    int rounds = 20;
+    uint64_t seed = 1;
+    std::string dir;
+    bool keep = false;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg == "--keep"){
+            keep = true;
+            continue;
+        }
+        auto name = arg.substr(0, arg.find('='));
+        std::string value = arg.size() > name.size() ? arg.substr(name.size() + 1) : (i + 1 < argc ? argv[++i] : "");
+        if (name == "--rounds" && std::atoi(value.c_str()) >= 1){
+            rounds = std::atoi(value.c_str());
+        }else if (name == "--seed" && !value.empty()){
+            seed = std::strtoull(value.c_str(), nullptr, 10);
+        }else if (name == "--match" && !value.empty()){
+            match_exe = value;
+        }else if (name == "--digest" && !value.empty()){
+            digest_exe = value;
+        }else if (name == "--shatter" && !value.empty()){
+            shatter_exe = value;
+        }else if (name == "--dir" && !value.empty()){
+            dir = value;
+        }else{
+            usage();
+            return -1;
+        }
+    }
+    match_exe = std::filesystem::weakly_canonical(match_exe).string();
+    digest_exe = std::filesystem::weakly_canonical(digest_exe).string();
+    shatter_exe = std::filesystem::weakly_canonical(shatter_exe).string();
+    if (dir.empty()){
+        dir = (std::filesystem::temp_directory_path() / ("match-differential-" + std::to_string(getpid()))).string();
+    }
+    std::filesystem::create_directories(dir);
+    auto enzymes = knownEnzymes(dir);
+    if (enzymes.empty()){
+        std::cerr << "Failed to read the enzymes off " << digest_exe << '\n';
+        return -1;
+    }
+
+    for (int r = 0; r < rounds; ++r){
+        Round round{dir + "/round-" + std::to_string(r), "", "", {}, {}, {}, std::mt19937_64{seed + uint64_t(r)}};
+        std::filesystem::create_directories(round.dir);
+        log_file = round.dir + "/stderr.txt";
+        std::uniform_real_distribution<double> unit{0.0, 1.0};
+        synthetic::GenomeOptions genome;
+        genome.length = 200 + round.rng() % 6000;
+        genome.chromosomes = int(1 + round.rng() % 4);
+        genome.gc = 0.2 + 0.6 * unit(round.rng);
+        genome.repeats = 0.6 * unit(round.rng);
+        genome.repeatLength = 5 + round.rng() % 200;
+        genome.lowercase = round.rng() % 2 ? 0.2 : 0.0;
+        genome.iupac = round.rng() % 3 ? 0.0 : 0.02;
+        genome.lineWidth = round.rng() % 4 ? 60 + round.rng() % 20 : 1 + round.rng() % 10;
+        genome.crlf = round.rng() % 4 == 0;
+        genome.seed = round.rng();
+        std::string format = std::vector<std::string>{"plain", "gzip", "bgzf"}[round.rng() % 3];
+        round.genome_file = round.dir + (format == "plain" ? "/genome.fa" : "/genome.fa.gz");
+        auto chroms = synthetic::makeGenome(genome);
+        synthetic::FragmentOptions fragments;
+        fragments.count = 20 + round.rng() % 100;
+        fragments.minLength = 1;
+        fragments.maxLength = 10 + round.rng() % 60;
+        fragments.mutations = 0.05;
+        fragments.reverse = 0.3;
+        fragments.random = 0.1;
+        fragments.iupac = true;
+        fragments.seed = round.rng();
+        round.fragments = synthetic::makeFragments(chroms, fragments);
+        round.fragments_file = round.dir + "/fragments.csv";
+        std::cerr << "round " << r + 1 << " of " << rounds << ": " << genome.length << " bases in " << genome.chromosomes
+                  << " chronosomes (" << format << (genome.crlf ? ", CR LF" : "") << "), " << fragments.count << " fragments\n";
+        if (!synthetic::writeGenome(round.genome_file, chroms, genome.lineWidth, genome.crlf, format)
+            || !synthetic::writeFragments(round.fragments_file, round.fragments)){
+            std::cerr << "Failed to write to " << round.dir << '\n';
+            return -1;
+        }
+        for (auto& chrom : chroms){
+            std::ranges::transform(chrom.bases, chrom.bases.begin(), [](char c){ return char(std::toupper(c)); });
+            round.names.push_back(chrom.name);
+            round.chroms.push_back(chrom.bases);
+        }
+        if (!checkMatch(round) || !checkDigest(round, enzymes) || !checkShatter(round, enzymes)){
+            std::cerr << "FAILED in round " << r + 1 << " (--seed " << seed + uint64_t(r) << " --rounds 1 repeats it)\n"
+                      << failure << '\n'
+                      << "the files are kept in " << round.dir << '\n';
+            return 1;
+        }
+        if (!keep){
+            std::filesystem::remove_all(round.dir);
+        }
+    }
+    if (!keep){
+        std::filesystem::remove_all(dir);
+    }
+    std::cerr << "all " << rounds << " rounds match the brute force\n";
+    return 0;
+}
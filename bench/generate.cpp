@@ -0,0 +1,123 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "synthetic.hpp"
+
+// print usage
+void usage(){
+    std::cout << "USAGE: generate genome [--length N] [--chromosomes C] [--gc F] [--repeats F] [--repeat-length L]\n"
+              << "                       [--lowercase F] [--iupac F] [--line W] [--crlf] [--format plain|gzip|bgzf]\n"
+              << "                       [--seed S] <genome-file>\n"
+              << "       generate fragments [--count K] [--min-len A] [--max-len B] [--mutations F] [--reverse F]\n"
+              << "                          [--random F] [--iupac] [--seed S] <genome-file> <fragments-file>\n"
+              << "\n"
+              << "generate genome writes a synthetic FASTA genome of N bases (1000000) over C chronosomes (4)\n"
+              << "with a share F of G and C (0.41). --repeats F makes that share of the bases (0.1) copies of\n"
+              << "earlier stretches, L bases long on average (300), half of them reverse complemented and with\n"
+              << "2% point mutations. --lowercase F soft-masks about that share of the bases in runs of 200,\n"
+              << "--iupac F puts in runs of N and single IUPAC codes. --line W wraps the sequence every W letters\n"
+              << "(60), --crlf ends the lines with CR LF and --format compresses the file with gzip or as BGZF.\n"
+              << "\n"
+              << "generate fragments cuts K fragments (10000) of A to B letters (20 to 200) out of <genome-file>\n"
+              << "(plain FASTA), in the NUM,FRAGMENT format match reads. Every base is substituted with the\n"
+              << "chance --mutations (0.01), a fragment is reverse complemented with the chance --reverse (0)\n"
+              << "and is random sequence instead with the chance --random (0.05), with IUPAC codes if --iupac.\n";
+}
+
+int main(int argc, char* argv[]){
+    if (argc < 2){
+        usage();
+        return -1;
+    }
+    std::string mode = argv[1];
+    synthetic::GenomeOptions genome;
+    synthetic::FragmentOptions fragments;
+    std::string format = "plain";
+    bool seeded = false;
+    uint64_t seed = 0;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg == "--crlf"){
+            genome.crlf = true;
+            continue;
+        }
+        if (arg == "--iupac" && mode == "fragments"){
+            fragments.iupac = true;
+            continue;
+        }
+        if (!arg.starts_with("--")){
+            args.push_back(arg);
+            continue;
+        }
+        auto name = arg.substr(0, arg.find('='));
+        std::string value = arg.size() > name.size() ? arg.substr(name.size() + 1) : (i + 1 < argc ? argv[++i] : "");
+        double number = std::atof(value.c_str());
+        if (name == "--format" && (value == "plain" || value == "gzip" || value == "bgzf")){
+            format = value;
+        }else if (name == "--seed"){
+            seed = std::strtoull(value.c_str(), nullptr, 10);
+            seeded = true;
+        }else if (name == "--length" && number >= 0){
+            genome.length = size_t(number);
+        }else if (name == "--chromosomes" && number >= 1){
+            genome.chromosomes = int(number);
+        }else if (name == "--gc" && number >= 0 && number <= 1){
+            genome.gc = number;
+        }else if (name == "--repeats" && number >= 0 && number < 1){
+            genome.repeats = number;
+        }else if (name == "--repeat-length" && number >= 1){
+            genome.repeatLength = size_t(number);
+        }else if (name == "--lowercase" && number >= 0 && number <= 1){
+            genome.lowercase = number;
+        }else if (name == "--iupac" && number >= 0 && number <= 1){
+            genome.iupac = number;
+        }else if (name == "--line" && number >= 1){
+            genome.lineWidth = size_t(number);
+        }else if (name == "--count" && number >= 0){
+            fragments.count = size_t(number);
+        }else if (name == "--min-len" && number >= 1){
+            fragments.minLength = size_t(number);
+        }else if (name == "--max-len" && number >= 1){
+            fragments.maxLength = size_t(number);
+        }else if (name == "--mutations" && number >= 0 && number <= 1){
+            fragments.mutations = number;
+        }else if (name == "--reverse" && number >= 0 && number <= 1){
+            fragments.reverse = number;
+        }else if (name == "--random" && number >= 0 && number <= 1){
+            fragments.random = number;
+        }else{
+            usage();
+            return -1;
+        }
+    }
+
+    if (mode == "genome" && args.size() == 1){
+        if (seeded){
+            genome.seed = seed;
+        }
+        if (!synthetic::writeGenome(args[0], synthetic::makeGenome(genome), genome.lineWidth, genome.crlf, format)){
+            std::cerr << "Failed to write " << args[0] << '\n';
+            return -1;
+        }
+        return 0;
+    }
+    if (mode == "fragments" && args.size() == 2){
+        if (seeded){
+            fragments.seed = seed;
+        }
+        auto chroms = synthetic::readGenome(args[0]);
+        if (chroms.empty()){
+            std::cerr << "Failed to read a genome from " << args[0] << " (it has to be plain FASTA)\n";
+            return -1;
+        }
+        if (!synthetic::writeFragments(args[1], synthetic::makeFragments(chroms, fragments))){
+            std::cerr << "Failed to write " << args[1] << '\n';
+            return -1;
+        }
+        return 0;
+    }
+    usage();
+    return -1;
+}
@@ -0,0 +1,66 @@
+#pragma once
+/**
+ * Run the tools under test as child processes, timing them and reading their
+ * peak resident set size back from the kernel (wait4), so the numbers are the
+ * tool's own and not the harness's.
+ *
+ * Needs a Unix-like system (fork, execv, wait4).
+ */
+#include <chrono>
+#include <fcntl.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace run{
+
+struct Result{
+    int status = -1;        // the exit status, -1 if it did not exit normally
+    double seconds = 0;     // wall time
+    long peakKb = 0;        // peak resident set size (kilobytes on Linux)
+};
+
+/**
+ * run a program and wait for it
+ * input : the program and its arguments, and the files for its stdin, stdout and stderr
+ * output: how it went
+ */
+inline Result command(const std::vector<std::string>& args, const std::string& in = "/dev/null",
+                      const std::string& out = "/dev/null", const std::string& err = "/dev/null"){
+    std::vector<char*> argv;
+    for (const auto& arg : args){
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    Result result;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0){
+        int files[3] = {open(in.c_str(), O_RDONLY), open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644),
+                        open(err.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+        for (int fd = 0; fd < 3; ++fd){
+            if (files[fd] < 0 || dup2(files[fd], fd) < 0){
+                _exit(126);
+            }
+            close(files[fd]);
+        }
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    if (pid < 0){
+        return result;
+    }
+    int status = 0;
+    rusage usage{};
+    if (wait4(pid, &status, 0, &usage) < 0){
+        return result;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    result.peakKb = usage.ru_maxrss;
+    return result;
+}
+
+} // namespace run
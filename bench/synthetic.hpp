@@ -0,0 +1,260 @@
+#pragma once
+/**
+ * Synthetic genomes and fragments for the benchmark and the differential harness.
+ *
+ * A genome is drawn base by base with the given GC content. A share of it
+ * (repeats) is copies of earlier stretches, some reverse complemented and
+ * with a few point mutations, like the transposons and segmental
+ * duplications that make real genomes hard on matchers. Soft-masked
+ * (lower case) runs, runs of N and scattered IUPAC codes can be mixed in.
+ * Fragments are pieces of the genome, mutated and reverse complemented at
+ * the given rates, or random sequence.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+namespace synthetic{
+
+struct GenomeOptions{
+    size_t length = 1000000;        // bases over all the chromosomes
+    int chromosomes = 4;
+    double gc = 0.41;               // share of G and C
+    double repeats = 0.1;           // share of the bases copied from earlier on
+    size_t repeatLength = 300;      // mean length of a copy
+    double lowercase = 0.0;         // share of the bases in soft-masked runs
+    double iupac = 0.0;             // share of the bases that are N runs or other IUPAC codes
+    size_t lineWidth = 60;
+    bool crlf = false;              // Windows line breaks
+    uint64_t seed = 1;
+};
+
+struct FragmentOptions{
+    size_t count = 10000;
+    size_t minLength = 20;
+    size_t maxLength = 200;
+    double mutations = 0.01;        // chance of each base being substituted
+    double reverse = 0.0;           // chance of a fragment being reverse complemented
+    double random = 0.05;           // chance of a fragment being random sequence instead
+    bool iupac = false;             // let random fragments have IUPAC codes
+    uint64_t seed = 2;
+};
+
+struct Chromosome{
+    std::string name;
+    std::string bases;              // as written, lower case included
+};
+
+inline char complementOf(char c){
+    static const std::string from = "ACGTUNRYKMSWBDHVacgtunrykmswbdhv";
+    static const std::string to   = "TGCAANYRMKSWVHDBtgcaanyrmkswvhdb";
+    auto at = from.find(c);
+    return at == std::string::npos ? c : to[at];
+}
+
+inline std::string reverseComplement(const std::string& s){
+    std::string rc(s.rbegin(), s.rend());
+    for (auto& c : rc){
+        c = complementOf(c);
+    }
+    return rc;
+}
+
+inline std::vector<Chromosome> makeGenome(const GenomeOptions& opt){
+    std::mt19937_64 rng{opt.seed};
+    std::uniform_real_distribution<double> unit{0.0, 1.0};
+    auto base = [&]{
+        double r = unit(rng);
+        return r < opt.gc / 2 ? 'G' : r < opt.gc ? 'C' : r < opt.gc + (1 - opt.gc) / 2 ? 'A' : 'T';
+    };
+    std::vector<Chromosome> genome;
+    int count = std::max(1, opt.chromosomes);
+    for (int c = 0; c < count; ++c){
+        Chromosome chrom{"chr" + std::to_string(c + 1), {}};
+        size_t length = opt.length / size_t(count) + (size_t(c) < opt.length % size_t(count) ? 1 : 0);
+        std::string& s = chrom.bases;
+        s.reserve(length);
+        std::exponential_distribution<double> span{1.0 / double(std::max<size_t>(1, opt.repeatLength))};
+        double startRepeat = opt.repeats >= 1 ? 1 : opt.repeats / ((1 - opt.repeats) * double(std::max<size_t>(1, opt.repeatLength)));
+        while(s.size() < length){
+            // a copy starts at a base with the chance that makes repeats of the bases copies on average
+            if (s.size() > opt.repeatLength && unit(rng) < startRepeat){
+                // copy an earlier stretch, maybe reverse complemented, with a few point mutations
+                size_t n = std::min(length - s.size(), std::max<size_t>(1, size_t(span(rng))));
+                n = std::min(n, s.size());
+                size_t from = std::uniform_int_distribution<size_t>{0, s.size() - n}(rng);
+                std::string copy = s.substr(from, n);
+                if (unit(rng) < 0.5){
+                    copy = reverseComplement(copy);
+                }
+                for (auto& c : copy){
+                    if (unit(rng) < 0.02){
+                        c = base();
+                    }
+                }
+                s += copy;
+            }else{
+                s += base();
+            }
+        }
+        // soft-masked runs, then N runs and lone IUPAC codes
+        for (size_t at = 0; opt.lowercase > 0 && at < s.size(); ++at){
+            if (unit(rng) < opt.lowercase / 200){
+                for (size_t end = std::min(s.size(), at + 200); at < end; ++at){
+                    s[at] = char(std::tolower(s[at]));
+                }
+            }
+        }
+        static const std::string codes = "RYKMSWBDHV";
+        for (size_t at = 0; opt.iupac > 0 && at < s.size(); ++at){
+            double r = unit(rng);
+            if (r < opt.iupac / 100){
+                for (size_t end = std::min(s.size(), at + 50); at < end; ++at){
+                    s[at] = 'N';
+                }
+            }else if (r < opt.iupac / 2){
+                s[at] = codes[rng() % codes.size()];
+            }
+        }
+        genome.push_back(std::move(chrom));
+    }
+    return genome;
+}
+
+inline std::vector<std::string> makeFragments(const std::vector<Chromosome>& genome, const FragmentOptions& opt){
+    std::mt19937_64 rng{opt.seed};
+    std::uniform_real_distribution<double> unit{0.0, 1.0};
+    std::uniform_int_distribution<size_t> length{opt.minLength, std::max(opt.minLength, opt.maxLength)};
+    static const std::string acgt = "ACGT", all = "ACGTNRYKMSWBDHVU";
+    std::vector<const Chromosome*> filled;
+    for (const auto& chrom : genome){
+        if (!chrom.bases.empty()){
+            filled.push_back(&chrom);
+        }
+    }
+    std::vector<std::string> fragments;
+    fragments.reserve(opt.count);
+    while(fragments.size() < opt.count){
+        size_t n = std::max<size_t>(1, length(rng));
+        std::string f;
+        if (filled.empty() || unit(rng) < opt.random){
+            for (size_t i = 0; i < n; ++i){
+                f += opt.iupac && unit(rng) < 0.1 ? all[rng() % all.size()] : acgt[rng() % 4];
+            }
+        }else{
+            const auto& s = filled[rng() % filled.size()]->bases;
+            n = std::min(n, s.size());
+            f = s.substr(std::uniform_int_distribution<size_t>{0, s.size() - n}(rng), n);
+            for (auto& c : f){
+                c = char(std::toupper(c));
+                if (unit(rng) < opt.mutations){
+                    c = acgt[rng() % 4];
+                }
+            }
+            if (unit(rng) < opt.reverse){
+                f = reverseComplement(f);
+            }
+        }
+        fragments.push_back(std::move(f));
+    }
+    return fragments;
+}
+
+inline std::string fastaText(const std::vector<Chromosome>& genome, size_t lineWidth, bool crlf){
+    std::string text;
+    const char* eol = crlf ? "\r\n" : "\n";
+    for (const auto& chrom : genome){
+        text += ">" + chrom.name + " synthetic" + eol;
+        for (size_t at = 0; at < chrom.bases.size(); at += std::max<size_t>(1, lineWidth)){
+            text += chrom.bases.substr(at, std::max<size_t>(1, lineWidth));
+            text += eol;
+        }
+    }
+    return text;
+}
+
+/**
+ * write a genome as FASTA, plain, gzip or BGZF (picked by format)
+ * output: whether it was written
+ */
+inline bool writeGenome(const std::string& file_name, const std::vector<Chromosome>& genome,
+                        size_t lineWidth, bool crlf, const std::string& format = "plain"){
+    std::string text = fastaText(genome, lineWidth, crlf);
+    std::ofstream file{file_name, std::ios::binary};
+    if (format == "gzip"){
+        z_stream z{};
+        deflateInit2(&z, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        std::string out(deflateBound(&z, uLong(text.size())), '\0');
+        z.next_in = reinterpret_cast<unsigned char*>(text.data());
+        z.avail_in = uInt(text.size());
+        z.next_out = reinterpret_cast<unsigned char*>(out.data());
+        z.avail_out = uInt(out.size());
+        deflate(&z, Z_FINISH);
+        out.resize(z.total_out);
+        deflateEnd(&z);
+        file << out;
+    }else if (format == "bgzf"){
+        auto block = [&](const char* data, size_t n){
+            std::string out(compressBound(uLong(n)) + 64, '\0');
+            z_stream z{};
+            deflateInit2(&z, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            z.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(data));
+            z.avail_in = uInt(n);
+            z.next_out = reinterpret_cast<unsigned char*>(out.data());
+            z.avail_out = uInt(out.size());
+            deflate(&z, Z_FINISH);
+            size_t size = z.total_out;
+            deflateEnd(&z);
+            size_t bsize = 18 + size + 8 - 1;
+            unsigned char head[18] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+                                      (unsigned char)(bsize & 0xff), (unsigned char)(bsize >> 8)};
+            uint32_t crc = uint32_t(crc32(0, reinterpret_cast<const unsigned char*>(data), uInt(n)));
+            uint32_t isize = uint32_t(n);
+            file.write(reinterpret_cast<const char*>(head), sizeof(head));
+            file.write(out.data(), std::streamsize(size));
+            file.write(reinterpret_cast<const char*>(&crc), 4);
+            file.write(reinterpret_cast<const char*>(&isize), 4);
+        };
+        for (size_t at = 0; at < text.size(); at += 65280){
+            block(text.data() + at, std::min<size_t>(65280, text.size() - at));
+        }
+        block(nullptr, 0); // the empty end-of-file block
+    }else{
+        file << text;
+    }
+    return bool(file);
+}
+
+inline bool writeFragments(const std::string& file_name, const std::vector<std::string>& fragments){
+    std::ofstream file{file_name};
+    for (size_t i = 0; i < fragments.size(); ++i){
+        file << i + 1 << ',' << fragments[i] << '\n';
+    }
+    return bool(file);
+}
+
+/**
+ * read a FASTA file back (plain only), keeping the letters as written
+ */
+inline std::vector<Chromosome> readGenome(const std::string& file_name){
+    std::ifstream file{file_name};
+    std::vector<Chromosome> genome;
+    std::string line;
+    while(std::getline(file, line)){
+        if (!line.empty() && line.back() == '\r'){
+            line.pop_back();
+        }
+        if (!line.empty() && line[0] == '>'){
+            genome.push_back({line.substr(1, line.find_first_of(" \t") - 1), {}});
+        }else if (!genome.empty()){
+            genome.back().bases += line;
+        }
+    }
+    return genome;
+}
+
+} // namespace synthetic
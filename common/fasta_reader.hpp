@@ -0,0 +1,304 @@
+#pragma once
+/**
+ * FASTA reader shared by digestFragment, match and toupper.
+ *
+ * The file is read in large blocks. Each stretch of sequence between two
+ * headers goes through one SIMD pass (AVX2, or SSE4.1 on older x86 CPUs) that
+ * drops the line breaks, and either upper-cases the letters or validates them
+ * against an alphabet and turns them into symbol codes. Both need 32 bytes
+ * with no line break in them, which is nearly all of a FASTA file; the 32
+ * bytes around a line break are done one at a time. Headers are found with
+ * memchr.
+ */
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace fasta{
+
+/**
+ * Letter -> symbol code, the same for both cases of a letter
+ */
+struct Alphabet{
+    unsigned char code[32];     // by letter & 0x1F, 0xFF for none
+
+    /**
+     * input : the letters, code i for letters[i] (at most 255 of them)
+     */
+    explicit Alphabet(std::string_view letters){
+        std::memset(code, 0xFF, sizeof(code));
+        for (size_t i = 0; i < letters.size(); ++i){
+            code[letters[i] & 0x1F] = (unsigned char)i;
+        }
+    }
+
+    // the code of a byte, 0xFF if it is not a letter of the alphabet
+    unsigned char operator()(unsigned char c) const {
+        return (c & 0xC0) == 0x40 ? code[c & 0x1F] : 0xFF;
+    }
+};
+
+namespace detail{
+
+/**
+ * Clean one byte at a time, from in[at] to at most in[to]
+ * output: where it stopped, before a letter outside the alphabet or at to
+ */
+inline size_t cleanScalar(const unsigned char* in, size_t at, size_t to, unsigned char*& out,
+                          const Alphabet* alphabet, size_t& lines){
+    for (; at < to; ++at){
+        unsigned char c = in[at];
+        if (c == '\n'){
+            ++lines;
+        }else if (c != '\r'){
+            if (alphabet == nullptr){
+                *out++ = (unsigned char)(c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c);
+            }else if ((*out = (*alphabet)(c)) != 0xFF){
+                ++out;
+            }else{
+                break;
+            }
+        }
+    }
+    return at;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+inline size_t cleanAVX2(const unsigned char* in, size_t n, unsigned char*& out, const Alphabet* alphabet, size_t& lines){
+    const __m256i newline = _mm256_set1_epi8('\n'), ret = _mm256_set1_epi8('\r');
+    const __m256i a = _mm256_set1_epi8('a' - 1), z = _mm256_set1_epi8('z' + 1);
+    const __m256i caseBit = _mm256_set1_epi8(0x20), low = _mm256_set1_epi8(0x0F);
+    const __m256i letterBits = _mm256_set1_epi8(char(0xC0)), letter = _mm256_set1_epi8(0x40), none = _mm256_set1_epi8(char(0xFF));
+    __m256i codesLo = none, codesHi = none;
+    if (alphabet != nullptr){
+        codesLo = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(alphabet->code)));
+        codesHi = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(alphabet->code + 16)));
+    }
+    size_t at = 0;
+    while(at + 32 <= n){
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + at));
+        __m256i breaks = _mm256_or_si256(_mm256_cmpeq_epi8(v, newline), _mm256_cmpeq_epi8(v, ret));
+        if (!_mm256_testz_si256(breaks, breaks)){
+            size_t stop = cleanScalar(in, at, at + 32, out, alphabet, lines);
+            if (stop < at + 32){
+                return stop;
+            }
+            at = stop;
+            continue;
+        }
+        __m256i result;
+        if (alphabet == nullptr){
+            __m256i isLower = _mm256_and_si256(_mm256_cmpgt_epi8(v, a), _mm256_cmpgt_epi8(z, v)); // bytes over 0x7F are negative
+            result = _mm256_sub_epi8(v, _mm256_and_si256(isLower, caseBit));
+        }else{
+            __m256i nibble = _mm256_and_si256(v, low);
+            result = _mm256_blendv_epi8(_mm256_shuffle_epi8(codesLo, nibble), _mm256_shuffle_epi8(codesHi, nibble),
+                                        _mm256_slli_epi16(v, 3)); // bit 4 picks the half, blendv looks at bit 7
+            __m256i bad = _mm256_or_si256(_mm256_cmpeq_epi8(result, none),
+                                          _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_and_si256(v, letterBits), letter), none));
+            if (!_mm256_testz_si256(bad, bad)){ // stops at the bad letter
+                return cleanScalar(in, at, n, out, alphabet, lines);
+            }
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), result);
+        out += 32;
+        at += 32;
+    }
+    return cleanScalar(in, at, n, out, alphabet, lines);
+}
+
+__attribute__((target("sse4.1")))
+inline size_t cleanSSE(const unsigned char* in, size_t n, unsigned char*& out, const Alphabet* alphabet, size_t& lines){
+    const __m128i newline = _mm_set1_epi8('\n'), ret = _mm_set1_epi8('\r');
+    const __m128i caseBit = _mm_set1_epi8(0x20), low = _mm_set1_epi8(0x0F);
+    const __m128i letterBits = _mm_set1_epi8(char(0xC0)), letter = _mm_set1_epi8(0x40), none = _mm_set1_epi8(char(0xFF));
+    __m128i codesLo = none, codesHi = none;
+    if (alphabet != nullptr){
+        codesLo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(alphabet->code));
+        codesHi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(alphabet->code + 16));
+    }
+    size_t at = 0;
+    while(at + 32 <= n){
+        __m128i v[2] = {_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + at)),
+                        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + at + 16))};
+        __m128i breaks = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v[0], newline), _mm_cmpeq_epi8(v[0], ret)),
+                                      _mm_or_si128(_mm_cmpeq_epi8(v[1], newline), _mm_cmpeq_epi8(v[1], ret)));
+        if (!_mm_testz_si128(breaks, breaks)){
+            size_t stop = cleanScalar(in, at, at + 32, out, alphabet, lines);
+            if (stop < at + 32){
+                return stop;
+            }
+            at = stop;
+            continue;
+        }
+        __m128i result[2];
+        for (int h = 0; h < 2; ++h){
+            if (alphabet == nullptr){
+                __m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(v[h], _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(v[h], _mm_set1_epi8('z' + 1)));
+                result[h] = _mm_sub_epi8(v[h], _mm_and_si128(isLower, caseBit)); // bytes over 0x7F are negative, never lower
+            }else{
+                __m128i nibble = _mm_and_si128(v[h], low);
+                result[h] = _mm_blendv_epi8(_mm_shuffle_epi8(codesLo, nibble), _mm_shuffle_epi8(codesHi, nibble), _mm_slli_epi16(v[h], 3));
+                __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(result[h], none),
+                                           _mm_xor_si128(_mm_cmpeq_epi8(_mm_and_si128(v[h], letterBits), letter), none));
+                if (!_mm_testz_si128(bad, bad)){ // stops at the bad letter
+                    return cleanScalar(in, at, n, out, alphabet, lines);
+                }
+            }
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), result[0]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16), result[1]);
+        out += 32;
+        at += 32;
+    }
+    return cleanScalar(in, at, n, out, alphabet, lines);
+}
+#endif
+
+} // namespace detail
+
+/**
+ * Drop the line breaks from in[0, n) and upper-case the rest (without an alphabet), or turn it
+ * into the alphabet's codes, into out (room for n bytes). Counts the line breaks into lines.
+ * output: how much of in was done, less than n if in[result] is not in the alphabet
+ */
+inline size_t clean(const unsigned char* in, size_t n, unsigned char*& out, const Alphabet* alphabet, size_t& lines){
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    static const bool sse41 = __builtin_cpu_supports("sse4.1");
+    if (avx2){
+        return detail::cleanAVX2(in, n, out, alphabet, lines);
+    }
+    if (sse41){
+        return detail::cleanSSE(in, n, out, alphabet, lines);
+    }
+#endif
+    return detail::cleanScalar(in, 0, n, out, alphabet, lines);
+}
+
+/**
+ * upper-case text in place, line breaks and all
+ */
+inline void upper(char* text, size_t n){
+    auto p = reinterpret_cast<unsigned char*>(text);
+    size_t at = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    const __m128i a = _mm_set1_epi8('a' - 1), z = _mm_set1_epi8('z' + 1), caseBit = _mm_set1_epi8(0x20);
+    for (; at + 16 <= n; at += 16){ // SSE2 is everywhere on x86-64, and this is bound by memory anyway
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + at));
+        __m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(v, a), _mm_cmplt_epi8(v, z));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p + at), _mm_sub_epi8(v, _mm_and_si128(isLower, caseBit)));
+    }
+#endif
+    for (; at < n; ++at){
+        if (p[at] >= 'a' && p[at] <= 'z'){
+            p[at] = (unsigned char)(p[at] - ('a' - 'A'));
+        }
+    }
+}
+
+/**
+ * Reads a FASTA file block by block.
+ * run() calls
+ *   header(std::string_view) with each header line, without the '>' and the line break,
+ *   bases(std::basic_string_view<unsigned char>) with the sequence that follows, in pieces:
+ *     the letters upper-cased, or their codes in the alphabet,
+ *   bad(char, size_t line) for a letter outside the alphabet (1-based line number);
+ *     reading goes on past it if bad returns.
+ * Sequence before the first header is handed over as is, without a header call.
+ */
+class Reader{
+public:
+    /**
+     * input : the file, the alphabet to encode to (none: upper-case) and how much to read at a time
+     */
+    explicit Reader(std::istream& input, const Alphabet* letters = nullptr, size_t block = 1 << 20)
+        : in(input), alphabet(letters), blockSize(block){}
+
+    template<class Header, class Bases, class Bad>
+    void run(Header&& header, Bases&& bases, Bad&& bad){
+        std::vector<unsigned char> block(blockSize), out(blockSize);
+        std::string name;
+        bool inHeader = false, lineStart = true;
+        size_t lines = 1;
+        for (;;){
+            in.read(reinterpret_cast<char*>(block.data()), std::streamsize(block.size()));
+            size_t n = size_t(in.gcount());
+            if (n == 0){
+                break;
+            }
+            unsigned char* written = out.data();
+            auto flush = [&]{
+                if (written != out.data()){
+                    bases(std::basic_string_view<unsigned char>(out.data(), size_t(written - out.data())));
+                    written = out.data();
+                }
+            };
+            for (size_t at = 0; at < n;){
+                if (inHeader){
+                    auto eol = static_cast<const unsigned char*>(std::memchr(block.data() + at, '\n', n - at));
+                    size_t end = eol ? size_t(eol - block.data()) : n;
+                    name.append(reinterpret_cast<const char*>(block.data()) + at, end - at);
+                    at = end;
+                    if (eol){
+                        if (!name.empty() && name.back() == '\r'){
+                            name.pop_back();
+                        }
+                        flush();
+                        header(std::string_view(name));
+                        inHeader = false;
+                        lineStart = true;
+                        ++lines;
+                        ++at;
+                    }
+                    continue;
+                }
+                if (lineStart && block[at] == '>'){
+                    inHeader = true;
+                    name.clear();
+                    ++at;
+                    continue;
+                }
+                // the sequence runs up to the next header; a '>' anywhere else is a bad letter
+                auto gt = static_cast<const unsigned char*>(std::memchr(block.data() + at, '>', n - at));
+                size_t end = gt ? size_t(gt - block.data()) : n;
+                while(at < end){
+                    at += clean(block.data() + at, end - at, written, alphabet, lines);
+                    if (at < end){
+                        bad(char(block[at]), lines);
+                        ++at;
+                    }
+                }
+                if (end > 0){
+                    lineStart = block[end - 1] == '\n';
+                }
+                if (gt && !lineStart){
+                    bad('>', lines);
+                    ++at;
+                }
+            }
+            flush();
+        }
+        if (inHeader){ // a header on the last line, without a line break
+            if (!name.empty() && name.back() == '\r'){
+                name.pop_back();
+            }
+            header(std::string_view(name));
+        }
+    }
+
+private:
+    std::istream& in;
+    const Alphabet* alphabet;
+    size_t blockSize;
+};
+
+} // namespace fasta
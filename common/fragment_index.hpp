@@ -0,0 +1,317 @@
+#pragma once
+/**
+ * Binary fragment index, written by digestFragment and read by match.
+ *
+ * Instead of copying the whole genome into INDEX,SEQUENCE text lines, the
+ * fragments are stored as (chromosome, offset, length) records. The sequence
+ * itself either comes along 2-bit packed, or is looked up in the original
+ * FASTA file by whoever reads the index.
+ *
+ * Layout (little endian, every section 8-byte aligned):
+ *   Header
+ *   chromosome table  for each: uint32 name length, name, uint64 length in bases
+ *   enzyme table      for each: uint32 name length, name
+ *   Record[recordCount] at recordsOffset
+ *   sequence          at sequenceOffset (only with hasSequence), for each chromosome:
+ *                     uint64 run count, Run[count], packed bases (ACGT = 0123, 4 per byte,
+ *                     first base in the low bits). Any other letter is stored as an A
+ *                     and listed in the runs instead.
+ */
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include "gzip_input.hpp"
+#include "fasta_reader.hpp"
+
+namespace fragment_index{
+
+constexpr char magic[4] = {'S', 'H', 'F', 'I'};
+constexpr uint32_t version = 1;
+constexpr uint32_t hasSequence = 1;  // Header::flags
+constexpr uint16_t noEnzyme = 0xFFFF; // start or end of a chromosome
+
+struct Header{
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t chromCount;
+    uint32_t enzymeCount;
+    uint32_t reserved;
+    uint64_t recordCount;
+    uint64_t recordsOffset;
+    uint64_t sequenceOffset;
+};
+
+struct Record{
+    uint64_t offset;    // first base of the fragment, 0-based within its chromosome
+    uint32_t chrom;     // index into the chromosome table
+    uint32_t length;    // in bases
+    uint16_t left;      // enzyme that cut the left end, index into the enzyme table
+    uint16_t right;     // enzyme that cut the right end
+    uint32_t reserved;
+};
+
+// a stretch of one letter other than ACGT
+struct Run{
+    uint64_t start;
+    uint32_t length;
+    uint32_t base;
+};
+
+struct Chromosome{
+    std::string name;
+    uint64_t length = 0;
+    std::vector<Run> runs;         // only with a sequence
+    std::vector<uint8_t> packed;   // only with a sequence
+};
+
+/**
+ * does the file start like a fragment index?
+ */
+inline bool isIndexFile(const std::string& file_name){
+    std::ifstream file{file_name, std::ios::binary};
+    char head[4] = {};
+    file.read(head, sizeof(head));
+    return file && std::memcmp(head, magic, sizeof(magic)) == 0;
+}
+
+/**
+ * 2-bit code of an upper- or lower-case base, 4 for anything else
+ */
+inline int baseCode(char ch){
+    switch(ch){
+        case 'A': case 'a': return 0;
+        case 'C': case 'c': return 1;
+        case 'G': case 'g': return 2;
+        case 'T': case 't': return 3;
+        default: return 4;
+    }
+}
+
+/**
+ * A fragment index in memory, built up chromosome by chromosome or loaded from a file
+ */
+class Index{
+public:
+    std::vector<Chromosome> chroms;
+    std::vector<std::string> enzymes;
+    std::vector<Record> records;
+    bool sequence = false;  // whether the chromosomes carry their bases
+
+    /**
+     * start a new chromosome; sequence decides whether its bases are kept
+     */
+    void startChromosome(std::string_view name){
+        chroms.push_back({std::string(name), 0, {}, {}});
+    }
+
+    /**
+     * append the next bases of the current chromosome
+     */
+    void addBases(std::string_view bases){
+        auto& chrom = chroms.back();
+        if (sequence){
+            for (char ch : bases){
+                int code = baseCode(ch);
+                uint64_t at = chrom.length++;
+                if (at % 4 == 0){
+                    chrom.packed.push_back(0);
+                }
+                if (code == 4){
+                    char upper = char(ch >= 'a' && ch <= 'z' ? ch - ('a' - 'A') : ch);
+                    auto& runs = chrom.runs;
+                    if (!runs.empty() && runs.back().base == uint32_t(upper) && runs.back().start + runs.back().length == at){
+                        ++runs.back().length;
+                    }else{
+                        runs.push_back({at, 1, uint32_t(upper)});
+                    }
+                    code = 0;
+                }
+                chrom.packed.back() = uint8_t(chrom.packed.back() | (code << (2 * (at % 4))));
+            }
+        }else{
+            chrom.length += bases.size();
+        }
+    }
+
+    /**
+     * the bases of a stretch of a chromosome, needs the sequence
+     */
+    std::string bases(uint32_t chrom_id, uint64_t offset, uint64_t length) const {
+        static constexpr char letter[4] = {'A', 'C', 'G', 'T'};
+        const auto& chrom = chroms[chrom_id];
+        std::string out(length, 'A');
+        for (uint64_t i = 0; i < length; ++i){
+            uint64_t at = offset + i;
+            out[i] = letter[(chrom.packed[at / 4] >> (2 * (at % 4))) & 3];
+        }
+        // patch in the letters that are not ACGT
+        auto run = std::ranges::upper_bound(chrom.runs, offset, {}, &Run::start);
+        if (run != chrom.runs.begin()){
+            --run;
+        }
+        for (; run != chrom.runs.end() && run->start < offset + length; ++run){
+            uint64_t from = std::max(run->start, offset);
+            uint64_t to = std::min(run->start + run->length, offset + length);
+            for (uint64_t at = from; at < to; ++at){
+                out[at - offset] = char(run->base);
+            }
+        }
+        return out;
+    }
+
+    std::string fragment(const Record& record) const {
+        return bases(record.chrom, record.offset, record.length);
+    }
+
+    /**
+     * write the index out
+     * input : the file name
+     * output: whether it worked
+     */
+    bool save(const std::string& file_name) const {
+        std::ofstream file{file_name, std::ios::binary};
+        if (!file){
+            return false;
+        }
+        Header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.flags = sequence ? hasSequence : 0;
+        header.chromCount = uint32_t(chroms.size());
+        header.enzymeCount = uint32_t(enzymes.size());
+        header.recordCount = records.size();
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const auto& chrom : chroms){
+            writeString(file, chrom.name);
+            file.write(reinterpret_cast<const char*>(&chrom.length), sizeof(chrom.length));
+        }
+        for (const auto& enzyme : enzymes){
+            writeString(file, enzyme);
+        }
+        header.recordsOffset = align(file);
+        file.write(reinterpret_cast<const char*>(records.data()), std::streamsize(records.size() * sizeof(Record)));
+        if (sequence){
+            header.sequenceOffset = align(file);
+            for (const auto& chrom : chroms){
+                uint64_t count = chrom.runs.size();
+                file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+                file.write(reinterpret_cast<const char*>(chrom.runs.data()), std::streamsize(count * sizeof(Run)));
+                file.write(reinterpret_cast<const char*>(chrom.packed.data()), std::streamsize(chrom.packed.size()));
+                align(file);
+            }
+        }
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        return bool(file);
+    }
+
+    /**
+     * read an index written by save
+     * input : the file name
+     * output: an empty string on success, what went wrong otherwise
+     */
+    std::string load(const std::string& file_name){
+        std::ifstream file{file_name, std::ios::binary};
+        Header header{};
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, magic, sizeof(magic)) != 0){
+            return "not a fragment index";
+        }
+        if (header.version != version){
+            return "fragment index version " + std::to_string(header.version) + " is not supported";
+        }
+        chroms.resize(header.chromCount);
+        for (auto& chrom : chroms){
+            chrom.name = readString(file);
+            file.read(reinterpret_cast<char*>(&chrom.length), sizeof(chrom.length));
+        }
+        enzymes.resize(header.enzymeCount);
+        for (auto& enzyme : enzymes){
+            enzyme = readString(file);
+        }
+        records.resize(header.recordCount);
+        file.seekg(std::streamoff(header.recordsOffset));
+        file.read(reinterpret_cast<char*>(records.data()), std::streamsize(records.size() * sizeof(Record)));
+        sequence = header.flags & hasSequence;
+        if (sequence){
+            file.seekg(std::streamoff(header.sequenceOffset));
+            for (auto& chrom : chroms){
+                uint64_t count = 0;
+                file.read(reinterpret_cast<char*>(&count), sizeof(count));
+                chrom.runs.resize(count);
+                chrom.packed.resize((chrom.length + 3) / 4);
+                file.read(reinterpret_cast<char*>(chrom.runs.data()), std::streamsize(count * sizeof(Run)));
+                file.read(reinterpret_cast<char*>(chrom.packed.data()), std::streamsize(chrom.packed.size()));
+                file.seekg((8 - file.tellg() % 8) % 8, std::ios::cur);
+            }
+        }
+        if (!file){
+            return "the fragment index is truncated";
+        }
+        return "";
+    }
+
+    /**
+     * fill in the sequence of every chromosome from the FASTA file the index was made from
+     * input : the FASTA file name
+     * output: an empty string on success, what went wrong otherwise
+     */
+    std::string loadSequence(const std::string& fasta_name){
+        gzip_input::File fasta{fasta_name};
+        if (!fasta){
+            return "failed to open " + fasta_name;
+        }
+        std::vector<Chromosome> expected = std::move(chroms);
+        chroms.clear();
+        sequence = true;
+        bool started = false;
+        fasta::Reader{fasta}.run([&](std::string_view name){
+            startChromosome(name);
+            started = true;
+        }, [&](std::basic_string_view<unsigned char> bases){
+            if (!started){ // sequence before the first header
+                startChromosome("");
+                started = true;
+            }
+            addBases(std::string_view(reinterpret_cast<const char*>(bases.data()), bases.size()));
+        }, [](char, size_t){});
+        if (chroms.size() != expected.size()){
+            return fasta_name + " has " + std::to_string(chroms.size()) + " headers, the index has " + std::to_string(expected.size());
+        }
+        for (size_t i = 0; i < chroms.size(); ++i){
+            if (chroms[i].name != expected[i].name || chroms[i].length != expected[i].length){
+                return fasta_name + " does not match the index at header " + expected[i].name;
+            }
+        }
+        return "";
+    }
+
+private:
+    static void writeString(std::ofstream& file, const std::string& s){
+        uint32_t size = uint32_t(s.size());
+        file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        file.write(s.data(), std::streamsize(size));
+    }
+
+    static std::string readString(std::ifstream& file){
+        uint32_t size = 0;
+        file.read(reinterpret_cast<char*>(&size), sizeof(size));
+        std::string s(size, '\0');
+        file.read(s.data(), std::streamsize(size));
+        return s;
+    }
+
+    // pad the file to a multiple of 8 bytes, output: the new position
+    static uint64_t align(std::ofstream& file){
+        static const char zeros[8] = {};
+        auto at = uint64_t(file.tellp());
+        file.write(zeros, std::streamsize((8 - at % 8) % 8));
+        return uint64_t(file.tellp());
+    }
+};
+
+} // namespace fragment_index
@@ -0,0 +1,311 @@
+#pragma once
+/**
+ * Genome files that may be gzip compressed, read like any std::istream.
+ *
+ * A plain file is read as it is. A gzip file is inflated by a thread of its
+ * own, a megabyte ahead of the reader. A BGZF file (bgzip, samtools) is a
+ * series of gzip members of at most 64 KiB each, with their compressed size
+ * in the header; the members are read off the file one after the other and
+ * inflated on several threads at once, then handed to the reader in order.
+ * Either way the decompression runs alongside whatever reads the stream,
+ * digesting or building automata, instead of in a separate step.
+ *
+ * A corrupt or truncated file is reported on stderr and ends the program,
+ * like a letter that is not IUPAC.
+ *
+ * Needs zlib (-lz).
+ */
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+namespace gzip_input{
+
+/**
+ * does the file start like gzip (BGZF included)?
+ */
+inline bool isCompressed(const std::string& file_name){
+    std::ifstream file{file_name, std::ios::binary};
+    unsigned char head[2] = {};
+    file.read(reinterpret_cast<char*>(head), sizeof(head));
+    return file && head[0] == 0x1f && head[1] == 0x8b;
+}
+
+/**
+ * The decompressed bytes of a gzip or BGZF file, in pieces made ahead by worker threads
+ */
+class Inflater : public std::streambuf{
+public:
+    /**
+     * start inflating
+     * input : the file name and how many threads may inflate BGZF members (0: one per core)
+     */
+    Inflater(const std::string& file_name, int threads) : name(file_name), raw{file_name, std::ios::binary}{
+        unsigned char head[18] = {};
+        raw.read(reinterpret_cast<char*>(head), sizeof(head));
+        bgzf = raw.gcount() == sizeof(head) && (head[3] & 4) && head[12] == 'B' && head[13] == 'C';
+        raw.clear();
+        raw.seekg(0);
+        int workers = 1;
+        if (bgzf){
+            workers = threads > 0 ? threads : int(std::max(1u, std::thread::hardware_concurrency()));
+        }else if (inflateInit2(&stream, 15 + 16) != Z_OK){
+            problem = "zlib failed to start";
+        }
+        ring.resize(bgzf ? size_t(workers) * 4 + 4 : 4);
+        for (int t = 0; t < workers; ++t){
+            threads_.emplace_back([this]{ work(); });
+        }
+    }
+    Inflater(const Inflater&) = delete;
+    Inflater& operator=(const Inflater&) = delete;
+
+    ~Inflater() override{
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        changed.notify_all();
+        for (auto& thread : threads_){
+            thread.join();
+        }
+        if (!bgzf){
+            inflateEnd(&stream);
+        }
+    }
+
+    bool isBgzf() const {
+        return bgzf;
+    }
+
+protected:
+    int_type underflow() override{
+        while(gptr() == egptr()){
+            std::unique_lock lock{mutex};
+            changed.wait(lock, [this]{
+                return !problem.empty() || ring[consumed % ring.size()].ready || (ended && consumed == reserved);
+            });
+            if (!problem.empty()){
+                std::cerr << name << ": " << problem << '\n';
+                std::cerr << "Exiting..." << '\n';
+                exit(-1);
+            }
+            Piece& piece = ring[consumed % ring.size()];
+            if (!piece.ready){
+                return traits_type::eof();
+            }
+            current.swap(piece.out);
+            piece.ready = false;
+            ++consumed;
+            lock.unlock();
+            changed.notify_all();
+            setg(current.data(), current.data(), current.data() + current.size());
+        }
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    // one BGZF member, or one megabyte of a gzip file
+    struct Piece{
+        std::vector<unsigned char> in;  // the compressed member (BGZF only)
+        std::string out;
+        bool ready = false;
+    };
+
+    std::string name;
+    std::ifstream raw;
+    bool bgzf = false;
+    z_stream stream{};                      // plain gzip, used by its one worker only
+    std::vector<unsigned char> zin = std::vector<unsigned char>(1 << 16);
+    bool finishedMember = false;
+    std::vector<Piece> ring;                // piece k is in ring[k % size]
+    std::vector<std::thread> threads_;
+    std::string current;                    // what the reader is on
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t reserved = 0, consumed = 0;      // pieces taken on by the workers, and handed to the reader
+    bool ended = false, stopping = false;
+    std::string problem;
+
+    // take on the next piece: read the next member off the file, or inflate the next megabyte
+    void work(){
+        z_stream member{};
+        if (bgzf && inflateInit2(&member, -15) != Z_OK){
+            std::lock_guard lock{mutex};
+            problem = "zlib failed to start";
+            changed.notify_all();
+            return;
+        }
+        for (;;){
+            std::unique_lock lock{mutex};
+            changed.wait(lock, [this]{ return stopping || ended || !problem.empty() || reserved < consumed + ring.size(); });
+            if (stopping || ended || !problem.empty()){
+                break;
+            }
+            Piece& piece = ring[reserved % ring.size()];
+            if (bgzf && !readMember(piece.in)){
+                ended = true;
+                changed.notify_all();
+                break;
+            }
+            ++reserved;
+            // BGZF members are independent, so this one is inflated while other workers read the next.
+            // A gzip file has one worker, which alone touches the stream and the file
+            lock.unlock();
+            std::string out;
+            std::string trouble = bgzf ? inflateMember(member, piece.in, out) : inflateSome(out);
+            lock.lock();
+            if (!trouble.empty()){
+                problem = trouble;
+            }else if (out.empty() && !bgzf){ // the end of the gzip file
+                --reserved;
+                ended = true;
+                changed.notify_all();
+                break;
+            }
+            piece.out.swap(out);
+            piece.ready = true;
+            changed.notify_all();
+        }
+        if (bgzf){
+            inflateEnd(&member);
+        }
+    }
+
+    /**
+     * read the next BGZF member off the file (under the lock)
+     * output: false at the end of the file
+     */
+    bool readMember(std::vector<unsigned char>& in){
+        in.resize(18);
+        raw.read(reinterpret_cast<char*>(in.data()), 12);
+        if (raw.gcount() == 0){
+            return false;
+        }
+        size_t xlen = size_t(in[10]) | size_t(in[11]) << 8;
+        in.resize(12 + xlen);
+        raw.read(reinterpret_cast<char*>(in.data()) + 12, std::streamsize(xlen));
+        if (!raw || in[0] != 0x1f || in[1] != 0x8b || !(in[3] & 4)){
+            problem = "is not a valid BGZF file";
+            return false;
+        }
+        size_t size = 0;
+        for (size_t at = 12; at + 4 <= 12 + xlen; at += 4 + (size_t(in[at + 2]) | size_t(in[at + 3]) << 8)){
+            if (in[at] == 'B' && in[at + 1] == 'C'){
+                size = (size_t(in[at + 4]) | size_t(in[at + 5]) << 8) + 1;
+            }
+        }
+        if (size < 12 + xlen + 8){
+            problem = "has a gzip member without a BGZF block size";
+            return false;
+        }
+        in.resize(size);
+        raw.read(reinterpret_cast<char*>(in.data()) + 12 + xlen, std::streamsize(size - 12 - xlen));
+        if (!raw){
+            problem = "is truncated";
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * inflate one BGZF member and check its CRC (outside the lock)
+     * output: an empty string on success, what went wrong otherwise
+     */
+    static std::string inflateMember(z_stream& member, const std::vector<unsigned char>& in, std::string& out){
+        auto le32 = [&](size_t at){
+            return uint32_t(in[at]) | uint32_t(in[at + 1]) << 8 | uint32_t(in[at + 2]) << 16 | uint32_t(in[at + 3]) << 24;
+        };
+        size_t xlen = size_t(in[10]) | size_t(in[11]) << 8;
+        uint32_t crc = le32(in.size() - 8), size = le32(in.size() - 4);
+        out.resize(size);
+        inflateReset(&member);
+        member.next_in = const_cast<unsigned char*>(in.data()) + 12 + xlen;
+        member.avail_in = uInt(in.size() - 12 - xlen - 8);
+        member.next_out = reinterpret_cast<unsigned char*>(out.data());
+        member.avail_out = uInt(size);
+        if (inflate(&member, Z_FINISH) != Z_STREAM_END || member.avail_out != 0){
+            return "has a corrupt BGZF block";
+        }
+        if (crc32(0, reinterpret_cast<const unsigned char*>(out.data()), uInt(size)) != crc){
+            return "has a BGZF block that fails its CRC check";
+        }
+        return "";
+    }
+
+    /**
+     * inflate up to a megabyte more of a gzip file (empty at its end)
+     * output: an empty string on success, what went wrong otherwise
+     */
+    std::string inflateSome(std::string& out){
+        constexpr size_t piece = 1 << 20;
+        out.resize(piece);
+        stream.next_out = reinterpret_cast<unsigned char*>(out.data());
+        stream.avail_out = uInt(piece);
+        while(stream.avail_out > 0){
+            if (stream.avail_in == 0){
+                raw.read(reinterpret_cast<char*>(zin.data()), std::streamsize(zin.size()));
+                stream.next_in = zin.data();
+                stream.avail_in = uInt(raw.gcount());
+                if (stream.avail_in == 0){
+                    if (!finishedMember){
+                        return "is truncated";
+                    }
+                    break;
+                }
+            }
+            if (finishedMember){ // another member follows (gzip files may be concatenated)
+                inflateReset(&stream);
+                finishedMember = false;
+            }
+            int status = inflate(&stream, Z_NO_FLUSH);
+            if (status == Z_STREAM_END){
+                finishedMember = true;
+            }else if (status != Z_OK){
+                return "is not a valid gzip file";
+            }
+        }
+        out.resize(piece - stream.avail_out);
+        return "";
+    }
+};
+
+/**
+ * A genome file, decompressed on the fly if it is gzip or BGZF
+ */
+class File : public std::istream{
+public:
+    /**
+     * input : the file name and how many threads may inflate a BGZF file (0: one per core)
+     */
+    explicit File(const std::string& file_name, int threads = 0) : std::istream(nullptr){
+        if (isCompressed(file_name)){
+            inflater = std::make_unique<Inflater>(file_name, threads);
+            rdbuf(inflater.get());
+        }else if (plain.open(file_name, std::ios::in)){
+            rdbuf(&plain);
+        }else{
+            setstate(std::ios::failbit);
+        }
+    }
+
+    bool compressed() const {
+        return inflater != nullptr;
+    }
+
+private:
+    std::filebuf plain;
+    std::unique_ptr<Inflater> inflater;
+};
+
+} // namespace gzip_input
@@ -0,0 +1,205 @@
+#pragma once
+/**
+ * Run statistics for --stats=json, shared by digestFragment and match.
+ *
+ * Phases add up the wall time spent in each step of a run (parse, build,
+ * query, write), whichever order they come in and however often. The
+ * report is one JSON object written with the small Json writer below, so
+ * that dashboards can read it without scraping the progress lines.
+ */
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define HAVE_GETRUSAGE 1
+#endif
+
+namespace stats{
+
+using Clock = std::chrono::steady_clock;
+
+inline double seconds(Clock::time_point from, Clock::time_point to){
+    return std::chrono::duration<double>(to - from).count();
+}
+
+/**
+ * Seconds spent in each phase, in the order the phases were first met
+ */
+class Phases{
+public:
+    // adds the time until it goes out of scope to a phase
+    class Timer{
+    public:
+        Timer(Phases& phases, std::string_view phase) : phases(phases), phase(phase), start(Clock::now()){}
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer(){
+            phases.add(phase, seconds(start, Clock::now()));
+        }
+
+    private:
+        Phases& phases;
+        std::string_view phase;
+        Clock::time_point start;
+    };
+
+    Timer time(std::string_view phase){
+        return Timer{*this, phase};
+    }
+
+    void add(std::string_view phase, double spent){
+        for (auto& [name, total] : all){
+            if (name == phase){
+                total += spent;
+                return;
+            }
+        }
+        all.emplace_back(std::string(phase), spent);
+    }
+
+    double operator[](std::string_view phase) const {
+        for (const auto& [name, total] : all){
+            if (name == phase){
+                return total;
+            }
+        }
+        return 0;
+    }
+
+    const std::vector<std::pair<std::string, double>>& list() const {
+        return all;
+    }
+
+private:
+    std::vector<std::pair<std::string, double>> all;
+};
+
+/**
+ * the largest resident set of this process so far, in kilobytes (0 where it cannot be asked)
+ */
+inline long peakRssKb(){
+#ifdef HAVE_GETRUSAGE
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) == 0){
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024; // bytes there
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return 0;
+}
+
+// the size of a file on disk, 0 if it cannot be told
+inline uint64_t fileSize(const std::string& file_name){
+    std::error_code problem;
+    auto size = std::filesystem::file_size(file_name, problem);
+    return problem ? 0 : uint64_t(size);
+}
+
+/**
+ * A JSON writer that puts in the commas: open objects and arrays, give keys and values
+ */
+class Json{
+public:
+    explicit Json(std::ostream& out) : out(out){}
+
+    Json& object(){
+        return open('{');
+    }
+    Json& array(){
+        return open('[');
+    }
+    Json& end(){
+        out << (closers.back() == '}' ? "}" : "]");
+        closers.pop_back();
+        first = false;
+        if (closers.empty()){
+            out << '\n';
+        }
+        return *this;
+    }
+    Json& key(std::string_view name){
+        separate();
+        text(name);
+        out << ": ";
+        keyed = true;
+        return *this;
+    }
+    Json& value(std::string_view s){
+        separate();
+        text(s);
+        return *this;
+    }
+    Json& value(const char* s){
+        return value(std::string_view(s));
+    }
+    Json& value(bool b){
+        separate();
+        out << (b ? "true" : "false");
+        return *this;
+    }
+    Json& value(double d){
+        separate();
+        out << d;
+        return *this;
+    }
+    template<class Integer>
+    Json& value(Integer i) requires std::is_integral_v<Integer>{
+        separate();
+        out << i;
+        return *this;
+    }
+    template<class T>
+    Json& field(std::string_view name, const T& v){
+        return key(name).value(v);
+    }
+
+private:
+    std::ostream& out;
+    std::string closers;
+    bool first = true;  // nothing written in the innermost object or array yet
+    bool keyed = false; // a key was just written, its value comes next
+
+    Json& open(char bracket){
+        separate();
+        out << bracket;
+        closers += bracket == '{' ? '}' : ']';
+        first = true;
+        return *this;
+    }
+    void separate(){
+        if (keyed){
+            keyed = false;
+            return;
+        }
+        if (!first){
+            out << ", ";
+        }
+        first = false;
+    }
+    void text(std::string_view s){
+        out << '"';
+        for (char c : s){
+            if (c == '"' || c == '\\'){
+                out << '\\' << c;
+            }else if ((unsigned char)c < 0x20){
+                static const char hex[] = "0123456789abcdef";
+                out << "\\u00" << hex[(c >> 4) & 0xF] << hex[c & 0xF];
+            }else{
+                out << c;
+            }
+        }
+        out << '"';
+    }
+};
+
+} // namespace stats
@@ -0,0 +1,512 @@
+#pragma once
+/**
+ * Restriction digest, shared by digestFragment and shatter.
+ *
+ * The enzymes known by name, the two site matchers (Shift-And and
+ * Aho-Corasick) and Digest, which streams a genome through one of them and
+ * tells a Sink about the headers, bases and cuts. What becomes of the
+ * fragments is up to the sink: digestFragment writes them out, shatter
+ * matches them.
+ */
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// supported enzymes: name -> (recognition site, where it cuts in the site)
+inline std::unordered_map<std::string, std::pair<std::string, int>> enzymes = {
+    {"EcoRI",  {"GAATTC",   1}},
+    {"BamHI",  {"GGATCC",   1}},
+    {"HindII", {"AAGCTT",   1}},
+    {"TaqI",   {"TCGA",     1}},
+    {"NotI",   {"GCGGCCGC", 2}},
+    {"HinFI",  {"GANTC",    1}},
+    {"Sau3AI", {"GATC",     0}},
+    {"PvuII",  {"CAGCTG",   3}},
+    {"SamI",   {"CCCGGG",   3}},
+    {"HaeIII", {"GGCC",     2}},
+    {"AluI",   {"AGCT",     2}},
+    {"EcoRV",  {"GATATC",   3}},
+    {"KpnI",   {"GGTACC",   5}},
+    {"PstI",   {"CTGCAG",   5}},
+    {"SacI",   {"GAGCTC",   5}},
+    {"SalI",   {"GTCGAC",   1}},
+    {"ScaI",   {"AGTACT",   3}},
+    {"SpeI",   {"ACTAGT",   1}},
+    {"SphI",   {"GCATGC",   5}},
+    {"StuI",   {"AGGCCT",   3}},
+    {"XbaI",   {"TCTAGA",   1}},
+};
+
+// --stats=json: the bases and fragments of every header, counted by Digest when keep_stats is set
+inline bool keep_stats = false;
+struct Counted{
+    std::string name;
+    long long bases = 0;
+    long long fragments = 1;
+};
+inline std::vector<Counted> counted; // in order
+
+// count a new header, by the first word of its name like match does
+inline void countHeader(std::string_view name){
+    counted.push_back({std::string(name.substr(0, name.find_first_of(" \t"))), 0, 1});
+}
+
+/**
+ * IUPAC nucleotide codes
+ * input : a letter of a recognition site
+ * output: the bases it stands for, plus the letter itself so that an N in the
+ *         site still matches a literal N in the genome like it used to
+ */
+inline std::string iupacBases(char code){
+    static const std::unordered_map<char, std::string> table = {
+        {'A', "A"},   {'C', "C"},   {'G', "G"},   {'T', "T"},
+        {'R', "AG"},  {'Y', "CT"},  {'S', "CG"},  {'W', "AT"},
+        {'K', "GT"},  {'M', "AC"},  {'B', "CGT"}, {'D', "AGT"},
+        {'H', "ACT"}, {'V', "ACG"}, {'N', "ACGT"},
+    };
+    auto it = table.find(code);
+    if (it == table.end() || it->second.size() == 1){
+        return std::string(1, code);
+    }
+    return it->second + code;
+}
+
+/**
+ * Aho-Corasick automaton over the recognition sites of all the chosen enzymes.
+ * The goto function is fully expanded into a DFA, so scanning costs one table
+ * lookup per base no matter how many enzymes are searched for.
+ * Degenerate sites are expanded into every concrete site they stand for,
+ * which is fine for the handful of N/R/Y letters real enzymes have.
+ */
+class AhoCorasick{
+public:
+    explicit AhoCorasick(const std::vector<std::string>& sites){
+        std::vector<std::string> patterns;
+        for (int id = 0; id < int(sites.size()); ++id){
+            std::vector<std::string> expanded{""};
+            for (char code : sites[id]){
+                std::vector<std::string> longer;
+                for (const auto& prefix : expanded){
+                    for (char base : iupacBases(code)){
+                        longer.push_back(prefix + base);
+                    }
+                }
+                expanded = std::move(longer);
+            }
+            for (auto& pat : expanded){
+                patterns.push_back(std::move(pat));
+                owner.push_back(id);
+            }
+        }
+
+
+        // only the letters used by some pattern get their own symbol,
+        // every other byte maps to symbol 0 which never extends a match
+        sym.fill(0);
+        for (const auto& pat : patterns){
+            for (unsigned char ch : pat){
+                if (sym[ch] == 0){
+                    sym[ch] = sym[std::tolower(ch)] = sigma++; // the mapped genome is not upper-cased
+                }
+            }
+        }
+
+        // build the trie
+        go.assign(sigma, -1);
+        out.emplace_back();
+        for (int id = 0; id < int(patterns.size()); ++id){
+            int cur = 0;
+            for (unsigned char ch : patterns[id]){
+                int c = sym[ch];
+                if (go[cur * sigma + c] == -1){
+                    go[cur * sigma + c] = int(out.size());
+                    go.resize(go.size() + sigma, -1);
+                    out.emplace_back();
+                }
+                cur = go[cur * sigma + c];
+            }
+            out[cur].push_back(id);
+        }
+
+        // BFS over the trie to fill in failure transitions
+        std::vector<int> fail(out.size(), 0);
+        std::queue<int> bfs;
+        for (int c = 0; c < sigma; ++c){
+            int& nxt = go[c];
+            if (nxt == -1){
+                nxt = 0;
+            }else{
+                bfs.push(nxt);
+            }
+        }
+        while(!bfs.empty()){
+            int cur = bfs.front();
+            bfs.pop();
+            const auto& inherited = out[fail[cur]];
+            out[cur].insert(out[cur].end(), inherited.begin(), inherited.end());
+            for (int c = 0; c < sigma; ++c){
+                int& nxt = go[cur * sigma + c];
+                if (nxt == -1){
+                    nxt = go[fail[cur] * sigma + c];
+                }else{
+                    fail[nxt] = go[fail[cur] * sigma + c];
+                    bfs.push(nxt);
+                }
+            }
+        }
+    }
+
+    /**
+     * scan s, the next piece of the text, and report every occurrence of every pattern.
+     * The state is kept between calls so a site split across two pieces is still found.
+     * input : the text, and a callback taking (index of the last character in s, site id)
+     * output: none
+     */
+    template<class Found>
+    void scan(std::string_view s, Found&& found){
+        for (int i = 0; i < int(s.size()); ++i){
+            cur = go[cur * sigma + sym[(unsigned char)s[i]]];
+            for (int id : out[cur]){
+                found(i, owner[id]);
+            }
+        }
+    }
+
+    // forget the text seen so far (a new header starts)
+    void reset(){
+        cur = 0;
+    }
+
+private:
+    int cur = 0;                        // current state
+    std::vector<int> owner;             // expanded pattern -> site it came from
+    int sigma = 1;                      // number of symbols, 0 is "not in any pattern"
+    std::array<int, 256> sym;           // byte -> symbol
+    std::vector<int> go;                // go[state * sigma + symbol] -> next state
+    std::vector<std::vector<int>> out;  // patterns ending at each state
+};
+
+/**
+ * Bit-parallel Shift-And matcher. All the sites are packed side by side into
+ * one 64-bit state word and every site letter is a character class, so IUPAC
+ * codes such as HinFI's GANTC cost nothing extra.
+ * Long texts are split into 4 (AVX2) or 2 (SSE2) interleaved segments that are
+ * scanned in lockstep, one 64-bit lane per segment.
+ */
+class ShiftAnd{
+public:
+    // sites longer than this in total go to the Aho-Corasick engine instead
+    static constexpr int maxBits = 64;
+
+    explicit ShiftAnd(const std::vector<std::string>& sites){
+        mask.fill(0);
+        int bit = 0;
+        for (int id = 0; id < int(sites.size()); ++id){
+            const auto& site = sites[id];
+            init |= uint64_t(1) << bit;
+            for (char code : site){
+                for (char base : iupacBases(code)){
+                    mask[(unsigned char)base] |= uint64_t(1) << bit;
+                    mask[(unsigned char)std::tolower(base)] |= uint64_t(1) << bit;
+                }
+                ++bit;
+            }
+            accept |= uint64_t(1) << (bit - 1);
+            owner[bit - 1] = id;
+            longest = std::max(longest, int(site.size()));
+        }
+    }
+
+    /**
+     * scan s, the next piece of the text, and report every occurrence of every site.
+     * The state is kept between calls so a site split across two pieces is still found.
+     * input : the text, and a callback taking (index of the last character in s, site id)
+     * output: none
+     */
+    template<class Found>
+    void scan(std::string_view s, Found&& found){
+        const int n = int(s.size());
+#if defined(__x86_64__) || defined(__i386__)
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        if (n >= 4096){
+            if (avx2){
+                scanAVX2(s, found);
+            }else{
+                scanSSE2(s, found);
+            }
+            return;
+        }
+#endif
+        state = scanRange(s, state, 0, 0, n, found);
+    }
+
+    // forget the text seen so far (a new header starts)
+    void reset(){
+        state = 0;
+    }
+
+private:
+    uint64_t state = 0;                 // carried over from the previous piece
+    std::array<uint64_t, 256> mask;     // byte -> positions of the sites it may appear at
+    std::array<int, maxBits> owner{};   // last bit of a site -> site id
+    uint64_t init = 0;                  // first bit of every site
+    uint64_t accept = 0;                // last bit of every site
+    int longest = 0;
+
+    // report the bits of hit, a state word after consuming s[end]
+    template<class Found>
+    void report(uint64_t hit, int end, Found& found) const {
+        while(hit){
+            found(end, owner[__builtin_ctzll(hit)]);
+            hit &= hit - 1;
+        }
+    }
+
+    // plain scan of s[from, to) starting in state d, only reporting matches ending at or after s[keep]
+    // output: the state after s[to-1]
+    template<class Found>
+    uint64_t scanRange(std::string_view s, uint64_t d, int from, int keep, int to, Found& found) const {
+        for (int i = from; i < to; ++i){
+            d = ((d << 1) | init) & mask[(unsigned char)s[i]];
+            if ((d & accept) && i >= keep){
+                report(d & accept, i, found);
+            }
+        }
+        return d;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    // lane 0 continues from the carried state, the others start longest-1 characters
+    // before their segment to warm up. A state only depends on the last longest-1
+    // characters, so the tail scan leaves behind the exact state to carry on with.
+    template<class Found>
+    __attribute__((target("avx2")))
+    void scanAVX2(std::string_view s, Found& found){
+        const int n = int(s.size()), seg = n / 4, warm = longest - 1; // n >= 4096 so seg > warm
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(s.data());
+        int start[4];
+        for (int k = 0; k < 4; ++k){
+            start[k] = std::max(0, k * seg - warm);
+        }
+        int steps = seg + warm;
+        __m256i d = _mm256_set_epi64x(0, 0, 0, int64_t(state));
+        const __m256i vinit = _mm256_set1_epi64x(int64_t(init));
+        const __m256i vaccept = _mm256_set1_epi64x(int64_t(accept));
+        for (int i = 0; i < steps; ++i){
+            __m256i m = _mm256_set_epi64x(int64_t(mask[p[start[3] + i]]),
+                                          int64_t(mask[p[start[2] + i]]),
+                                          int64_t(mask[p[start[1] + i]]),
+                                          int64_t(mask[p[start[0] + i]]));
+            d = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi64(d, 1), vinit), m);
+            __m256i hit = _mm256_and_si256(d, vaccept);
+            if (!_mm256_testz_si256(hit, hit)){
+                alignas(32) uint64_t lanes[4];
+                _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), hit);
+                for (int k = 0; k < 4; ++k){
+                    int end = start[k] + i;
+                    if (lanes[k] && end >= k * seg && end < (k + 1) * seg){
+                        report(lanes[k], end, found);
+                    }
+                }
+            }
+        }
+        state = scanRange(s, 0, 4 * seg - warm, 4 * seg, n, found);
+    }
+
+    template<class Found>
+    void scanSSE2(std::string_view s, Found& found){
+        const int n = int(s.size()), seg = n / 2, warm = longest - 1;
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(s.data());
+        const int start0 = 0, start1 = seg - warm;
+        int steps = seg + warm;
+        __m128i d = _mm_set_epi64x(0, int64_t(state));
+        const __m128i vinit = _mm_set1_epi64x(int64_t(init));
+        const __m128i vaccept = _mm_set1_epi64x(int64_t(accept));
+        for (int i = 0; i < steps; ++i){
+            __m128i m = _mm_set_epi64x(int64_t(mask[p[start1 + i]]),
+                                       int64_t(mask[p[start0 + i]]));
+            d = _mm_and_si128(_mm_or_si128(_mm_slli_epi64(d, 1), vinit), m);
+            __m128i hit = _mm_and_si128(d, vaccept);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(hit, _mm_setzero_si128())) != 0xFFFF){
+                alignas(16) uint64_t lanes[2];
+                _mm_store_si128(reinterpret_cast<__m128i*>(lanes), hit);
+                if (lanes[0] && i < seg){
+                    report(lanes[0], i, found);
+                }
+                int end = start1 + i;
+                if (lanes[1] && end >= seg && end < 2 * seg){
+                    report(lanes[1], end, found);
+                }
+            }
+        }
+        state = scanRange(s, 0, 2 * seg - warm, 2 * seg, n, found);
+    }
+#endif
+};
+
+/**
+ * split a list of enzymes such as "EcoRI+BamHI" or "EcoRI,BamHI"
+ * input : the list as given on the command line
+ * output: the enzyme names, duplicates removed, in the given order
+ */
+inline std::vector<std::string> splitEnzymes(const std::string& list){
+    std::vector<std::string> names;
+    std::string cur;
+    for (char ch : list + "+"){
+        if (ch == '+' || ch == ','){
+            if (!cur.empty() && std::ranges::find(names, cur) == names.end()){
+                names.push_back(cur);
+            }
+            cur.clear();
+        }else{
+            cur += ch;
+        }
+    }
+    return names;
+}
+
+/**
+ * Where the digest sends its fragments. It gets told about headers, the bases
+ * in order, the cuts between them, and the end of each header.
+ */
+class Sink{
+public:
+    virtual ~Sink() = default;
+    virtual void header(std::string_view name) = 0;
+    virtual void bases(std::string_view bases) = 0;
+    virtual void cut(int enzyme) = 0;
+    virtual void close() = 0;
+};
+
+/**
+ * Streaming digest of one genome.
+ * Bases are fed in as they are read and go through the matcher exactly once,
+ * then are written straight from the caller's buffer (or the mapped file).
+ * Only the last few bases (the longest site) are copied aside, since a site
+ * that is still being read may cut in front of them, so the extra memory is
+ * O(pattern) and the cuts do not depend on how the input is split up.
+ */
+class Digest{
+public:
+    using Matcher = std::variant<ShiftAnd, AhoCorasick>;
+
+    Digest(Matcher& matcher, const std::vector<std::string>& chosen, Sink& out)
+        : matcher(matcher), chosen(chosen), out(out){
+        for (const auto& enzyme : chosen){
+            hold = std::max(hold, int(enzymes.at(enzyme).first.size()));
+        }
+    }
+
+    /**
+     * start a new header, ending the fragment of the previous one
+     */
+    void header(std::string_view name){
+        finish();
+        std::visit([](auto& m){ m.reset(); }, matcher);
+        out.header(name);
+        if (keep_stats){
+            countHeader(name);
+        }
+    }
+
+    /**
+     * feed the next bases of the current header. They only need to stay valid during the call.
+     */
+    void feed(std::string_view bases){
+        long long base = seen;
+        std::visit([&](auto& m){
+            m.scan(bases, [&](int end, int id){
+                const auto& [pat, cut] = enzymes.at(chosen[id]);
+                cuts.emplace_back(base + end - int(pat.size()) + 1 + cut, id);
+            });
+        }, matcher);
+        seen += (long long)bases.size();
+        if (keep_stats){
+            if (counted.empty()){ // sequence before the first header
+                countHeader("");
+            }
+            counted.back().bases += (long long)bases.size();
+        }
+        flush(seen - hold + 1, bases);
+    }
+
+    /**
+     * end the current header, writing out everything held back
+     */
+    void finish(){
+        flush(seen, {});
+        out.close();
+        held.clear();
+        written = seen = 0;
+        cuts.clear();
+    }
+
+private:
+    Matcher& matcher;
+    const std::vector<std::string>& chosen;
+    Sink& out;
+    int hold = 0;                               // longest recognition site
+    std::string held;                           // bases scanned but not written yet, before the fresh ones
+    long long written = 0;                      // position of held[0] in the header
+    long long seen = 0;                         // bases already scanned
+    std::vector<std::pair<long long, int>> cuts;// (cut position, enzyme id) not applied yet
+
+    // write the bases in [from, to), which lie in held followed by fresh
+    void write(long long from, long long to, std::string_view fresh){
+        long long mid = written + (long long)held.size();
+        if (from < mid){
+            out.bases(std::string_view(held).substr(size_t(from - written), size_t(std::min(to, mid) - from)));
+        }
+        if (to > mid){
+            from = std::max(from, mid);
+            out.bases(fresh.substr(size_t(from - mid), size_t(to - from)));
+        }
+    }
+
+    // write out every base before position upto. No site found later can cut
+    // before seen - hold + 1, so the cuts in front of upto are final.
+    void flush(long long upto, std::string_view fresh){
+        if (upto > written){
+            // two enzymes cutting at the same spot only make one cut,
+            // the one listed first on the command line names it
+            std::ranges::sort(cuts);
+            auto same = std::ranges::unique(cuts, {}, &std::pair<long long, int>::first);
+            cuts.erase(same.begin(), same.end());
+
+            long long prev = written;
+            size_t done = 0;
+            for (; done < cuts.size() && cuts[done].first < upto; ++done){
+                const auto& [pos, id] = cuts[done];
+                write(prev, pos, fresh);
+                out.cut(id);
+                prev = pos;
+                if (keep_stats){
+                    ++counted.back().fragments;
+                }
+            }
+            write(prev, upto, fresh);
+            cuts.erase(cuts.begin(), cuts.begin() + (long)done);
+        }
+
+        // keep what is left of held and fresh aside
+        long long mid = written + (long long)held.size();
+        std::string rest;
+        if (upto < mid){
+            rest = held.substr(size_t(std::max(upto, written) - written));
+        }
+        rest += fresh.substr(size_t(std::max(upto, mid) - mid));
+        held = std::move(rest);
+        written = seen - (long long)held.size();
+    }
+};
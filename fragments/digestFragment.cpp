@@ -4,18 +4,60 @@
 #include <fstream>
 #include <algorithm>
 #include <unordered_map>
+#include <variant>
+#include <cstdint>
+#include <charconv>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <iterator>
+#include "../common/fragment_index.hpp"
+#include "../common/gzip_input.hpp"
+#include "../common/fasta_reader.hpp"
+#include "../common/stats.hpp"
+#include "digest.hpp"
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#endif
 
 // global variables
-static int LIMIT = int(1e7);
-std::unordered_map<std::string, std::pair<std::string, int>> enzymes;
+static int LIMIT = 1 << 16; // bases scanned and written at a time
+
+// --stats=json, with keep_stats and counted (digest.hpp)
+stats::Phases phases;
+double writing = 0; // seconds spent handing the output to the file
 
 // print usage
 void usage(){
-    std::cout << "USAGE: digestFragment <genome-file> <enzyme> <output-file>\n"
+    std::cout << "USAGE: digestFragment [--engine=shift-and|aho-corasick] [--mmap] [--threads N] [--format=csv|index [--packed]]\n"
+              << "                      [--stats=json] <genome-file> <enzyme>[+<enzyme>...] <output-file>\n"
+              << "\n"
+              << "Several enzymes can be given at once for a multi-digest, e.g. EcoRI+BamHI (',' works too).\n"
+              << "All of them are cut in a single pass over <genome-file>.\n"
+              << "IUPAC codes (N, R, Y, W, S, ...) in recognition sites match any of the bases they stand for.\n"
+              << "\n"
+              << "--engine picks the matcher. By default the SIMD Shift-And engine is used whenever the\n"
+              << "recognition sites add up to at most 64 letters, and Aho-Corasick otherwise.\n"
+              << "--mmap maps <genome-file> into memory and digests it in place, writing the fragments\n"
+              << "straight from the mapping (elsewhere the file is read into memory instead).\n"
+              << "--threads N digests the genome with N threads (implies --mmap). The output is the same as\n"
+              << "with one thread.\n"
+              << "--format=index writes a binary fragment index of (header, offset, length) records instead of\n"
+              << "text. --packed stores the genome 2-bit packed in it as well; otherwise give match the original\n"
+              << "<genome-file> to look the fragments up in.\n"
+              << "--stats=json writes statistics of the run to stderr as one JSON object once it is done: seconds\n"
+              << "spent reading the genome, building the matcher, cutting and writing the output; the bases and\n"
+              << "fragments of every header; bytes read and written, and the peak resident set.\n"
               << "\n"
               << "<genome-file> must follow the following format (multiple separated headers are OK):\n"
               << "  >HEADER\n"
               << "  Sequence Starts Here\n"
+              << "It may be gzip compressed (.fna.gz); BGZF files (bgzip) are decompressed on several threads.\n"
+              << "A compressed genome is decompressed into memory for --mmap and --threads.\n"
               << "\n"
               << "Currently supported enzymes:\n";
 
@@ -33,80 +75,657 @@ void usage(){
     }
 
     std::cout << "\n"
+              << "Each line of <output-file> is INDEX,FRAGMENT,LEFT,RIGHT where LEFT and RIGHT are the enzymes\n"
+              << "that cut the left and right ends of the fragment ('-' for the start or end of a header).\n"
               << "To save the output as a csv file, enter something like output.csv for <output-file>\n\n";
 }
 
 /**
- * compute the prefix function for string s
- * input : the string whose prefix function is to be calculated
- * output: the prefix function for string s
+ * Output buffer that gathers fragments and hands them to the file in large
+ * blocks, instead of one small write per fragment.
+ * Without a file it simply keeps growing, so a worker thread can render its
+ * piece of the output in memory.
+ */
+class Output{
+public:
+    Output() = default;
+    explicit Output(std::ofstream& file) : file(&file){
+        buf.reserve(capacity);
+    }
+    ~Output(){
+        drain();
+    }
+
+    Output& operator<<(std::string_view s){
+        if (file && buf.size() + s.size() > capacity){
+            drain();
+        }
+        buf.append(s);
+        return *this;
+    }
+    Output& operator<<(char ch){
+        return *this << std::string_view(&ch, 1);
+    }
+    Output& operator<<(int num){
+        char digits[16];
+        auto end = std::to_chars(digits, digits + sizeof(digits), num).ptr;
+        return *this << std::string_view(digits, size_t(end - digits));
+    }
+
+    /**
+     * append bases, upper-casing them on the way
+     */
+    void bases(std::string_view s){
+        while(!s.empty()){
+            if (file && buf.size() == capacity){
+                drain();
+            }
+            size_t take = file ? std::min(s.size(), capacity - buf.size()) : s.size();
+            size_t at = buf.size();
+            buf.append(s.substr(0, take));
+            for (size_t i = at; i < buf.size(); ++i){ // plain ASCII, so the compiler vectorizes it
+                buf[i] = char(buf[i] >= 'a' && buf[i] <= 'z' ? buf[i] - ('a' - 'A') : buf[i]);
+            }
+            s.remove_prefix(take);
+        }
+    }
+
+    void drain(){
+        if (file){
+            auto start = stats::Clock::now();
+            file->write(buf.data(), std::streamsize(buf.size()));
+            buf.clear();
+            writing += stats::seconds(start, stats::Clock::now());
+        }
+    }
+
+    // what has been rendered so far when there is no file
+    const std::string& str() const {
+        return buf;
+    }
+
+private:
+    static constexpr size_t capacity = 1 << 20;
+    std::ofstream* file = nullptr;
+    std::string buf;
+};
+
+/**
+ * INDEX,FRAGMENT,LEFT,RIGHT lines
+ * The numbering can start mid-way so that pieces of a header can be written separately.
  */
-std::vector<int> computePrefix(std::string_view&& s){
-    int n = int(s.size());
-    std::vector<int> ans(n);
-    for (int i = 1; i < n; ++i){
-        int j = ans[i-1];
-        while(j && s[j] != s[i]){
-            j = ans[j-1];
+class TextSink : public Sink{
+public:
+    TextSink(Output& out, const std::vector<std::string>& chosen, int index = 0, std::string left = "-", bool open = false)
+        : out(out), chosen(chosen), index(index), left(std::move(left)), open(open){}
+
+    void header(std::string_view) override {
+        close();
+        index = 0; // a new segment, reset index
+        left = "-";
+        start();
+    }
+    void bases(std::string_view bases) override {
+        if (!open && !bases.empty()){ // sequence before the first header
+            start();
+        }
+        out.bases(bases);
+    }
+    void cut(int enzyme) override {
+        if (!open){
+            start();
+        }
+        out << ',' << left << ',' << chosen[size_t(enzyme)] << '\n' << ++index << ',';
+        left = chosen[size_t(enzyme)];
+    }
+    void close() override {
+        if (open){
+            out << ',' << left << ",-\n";
         }
-        ans[i] = j + (s[j] == s[i]);
+        open = false;
+    }
+
+private:
+    Output& out;
+    const std::vector<std::string>& chosen;
+    int index;
+    std::string left;   // enzyme that cut the left end of the current fragment
+    bool open;          // whether a fragment line has been started
+
+    void start(){
+        open = true;
+        out << ++index << ',';
+    }
+};
+
+/**
+ * (chromosome, offset, length) records of a binary fragment index
+ */
+class IndexSink : public Sink{
+public:
+    explicit IndexSink(fragment_index::Index& index) : index(index){}
+
+    void header(std::string_view name) override {
+        close();
+        index.startChromosome(name);
+        open = true;
+        left = fragment_index::noEnzyme;
+        start = 0;
+    }
+    void bases(std::string_view bases) override {
+        if (!open){ // sequence before the first header
+            header("");
+        }
+        index.addBases(bases);
+    }
+    void cut(int enzyme) override {
+        if (!open){
+            header("");
+        }
+        end(uint16_t(enzyme));
+    }
+    void close() override {
+        if (open){
+            end(fragment_index::noEnzyme);
+        }
+        open = false;
+    }
+
+private:
+    fragment_index::Index& index;
+    bool open = false;
+    uint16_t left = fragment_index::noEnzyme;
+    uint64_t start = 0; // where the current fragment starts
+
+    void end(uint16_t right){
+        uint64_t length = index.chroms.back().length;
+        index.records.push_back({start, uint32_t(index.chroms.size() - 1), uint32_t(length - start), left, right, 0});
+        left = right;
+        start = length;
+    }
+};
+
+/**
+ * The whole genome file in memory: memory-mapped where possible, read in
+ * otherwise (and always when it is compressed). Either way it is scanned in place.
+ */
+class GenomeFile{
+public:
+    GenomeFile() = default;
+    GenomeFile(const GenomeFile&) = delete;
+    GenomeFile& operator=(const GenomeFile&) = delete;
+    ~GenomeFile(){
+#ifdef HAVE_MMAP
+        if (map != nullptr){
+            munmap(map, size);
+        }
+#endif
+    }
+
+    /**
+     * map (or read) the file
+     * input : the file name
+     * output: whether it worked
+     */
+    bool open(const std::string& name){
+        if (gzip_input::isCompressed(name)){
+            gzip_input::File file{name};
+            copy.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            return true;
+        }
+#ifdef HAVE_MMAP
+        int fd = ::open(name.c_str(), O_RDONLY);
+        if (fd < 0){
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0){
+            close(fd);
+            return false;
+        }
+        size = size_t(info.st_size);
+        if (size > 0){
+            map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED){
+                map = nullptr;
+                close(fd);
+                return false;
+            }
+            madvise(map, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        return true;
+#else
+        std::ifstream file{name, std::ios::binary};
+        copy.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return bool(file) || file.eof();
+#endif
+    }
+
+    std::string_view data() const {
+#ifdef HAVE_MMAP
+        if (map != nullptr){
+            return {static_cast<const char*>(map), size};
+        }
+#endif
+        return copy;
+    }
+
+private:
+#ifdef HAVE_MMAP
+    void* map = nullptr;
+    size_t size = 0;
+#endif
+    std::string copy;
+};
+
+/**
+ * call f on every line of text, without its line break.
+ * text may start or end in the middle of a line.
+ */
+template<class F>
+void forEachLine(std::string_view text, F&& f){
+    while(!text.empty()){
+        size_t eol = text.find('\n');
+        std::string_view line = text.substr(0, eol);
+        if (!line.empty() && line.back() == '\r'){
+            line.remove_suffix(1);
+        }
+        f(line);
+        if (eol == std::string_view::npos){
+            break;
+        }
+        text.remove_prefix(eol + 1);
     }
-    return ans;
 }
 
 /**
- * convert a string to uppercase
- * input : string s
- * output: string s in uppercase
+ * digest a genome that is already in memory, one line at a time
+ * input : the whole genome file and the digest to feed
+ * output: none
  */
-std::string str_toupper(std::string s) {
-    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c){ return std::toupper(c);});
-    return s;
+void digestMapped(std::string_view genome, Digest& digest){
+    forEachLine(genome, [&](std::string_view line){
+        if (!line.empty() && line[0] == '>'){ // header, a new segment, reset index
+            digest.header(line.substr(1));
+        }else{
+            digest.feed(line);
+        }
+    });
 }
 
-int main(int argc, char *argv[]){
-    // supported enzyme list
-    enzymes["EcoRI"]  = {"GAATTC",   1};
-    enzymes["BamHI"]  = {"GGATCC",   1};
-    enzymes["HindII"] = {"AAGCTT",   1};
-    enzymes["TaqI"]   = {"TCGA",     1};
-    enzymes["NotI"]   = {"GCGGCCGC", 2};
-    enzymes["HinFI"]  = {"GANTC",    1};
-    enzymes["Sau3AI"] = {"GATC",     0};
-    enzymes["PvuII"]  = {"CAGCTG",   3};
-    enzymes["SamI"]   = {"CCCGGG",   3};
-    enzymes["HaeIII"] = {"GGCC",     2};
-    enzymes["AluI"]   = {"AGCT",     2};
-    enzymes["EcoRV"]  = {"GATATC",   3};
-    enzymes["KpnI"]   = {"GGTACC",   5};
-    enzymes["PstI"]   = {"CTGCAG",   5};
-    enzymes["SacI"]   = {"GAGCTC",   5};
-    enzymes["SalI"]   = {"GTCGAC",   1};
-    enzymes["ScaI"]   = {"AGTACT",   3};
-    enzymes["SpeI"]   = {"ACTAGT",   1};
-    enzymes["SphI"]   = {"GCATGC",   5};
-    enzymes["StuI"]   = {"AGGCCT",   3};
-    enzymes["XbaI"]   = {"TCTAGA",   1};
+/**
+ * Multi-threaded digest of a genome in memory, with the same output as the
+ * serial Digest byte for byte.
+ * Each header's sequence is split into pieces of a few MB, in the middle of a line
+ * if need be, so that a chromosome written on one line is shared out too. Every piece is
+ * scanned on its own with hold bases of overlap on both sides, and keeps the
+ * cuts that fall inside it. Fragment numbers and enzyme tags are then handed
+ * down from piece to piece, the pieces are rendered in parallel too, and are
+ * written out in order.
+ */
+class ParallelDigest{
+public:
+    ParallelDigest(const Digest::Matcher& matcher, const std::vector<std::string>& chosen, int threads)
+        : matcher(matcher), chosen(chosen), threads(threads){
+        for (const auto& enzyme : chosen){
+            hold = std::max(hold, int(enzymes.at(enzyme).first.size()));
+        }
+    }
 
+    /**
+     * digest the genome into INDEX,FRAGMENT,LEFT,RIGHT lines, rendered in parallel
+     */
+    void run(std::string_view genome, std::ofstream& outfile){
+        split(genome);
+
+        // a few pieces per thread at a time keeps the rendered output small
+        size_t wave = size_t(threads) * 4;
+        struct Carry{
+            int index = 0;
+            std::string left = "-";
+            bool open = false;
+        };
+        std::vector<Carry> carry(segments.size()); // where each segment's numbering has got to
+        for (size_t first = 0; first < pieces.size(); first += wave){
+            size_t last = std::min(pieces.size(), first + wave);
+            parallel(first, last, [&](Piece& piece){ findCuts(piece); });
+            for (size_t i = first; i < last; ++i){ // hand the numbering down
+                auto& piece = pieces[i];
+                auto& [index, left, open] = carry[size_t(piece.segment)];
+                piece.index = index;
+                piece.left = left;
+                piece.open = open;
+                // a header starts fragment 1, sequence before the first header with its first base or cut
+                if (!open && ((piece.opens && segments[size_t(piece.segment)].header) || piece.size > 0 || !piece.cuts.empty())){
+                    open = true;
+                    index = 1;
+                }
+                if (!piece.cuts.empty()){
+                    index += int(piece.cuts.size());
+                    left = chosen[size_t(piece.cuts.back().second)];
+                }
+                count(piece);
+            }
+            parallel(first, last, [&](Piece& piece){
+                Output out;
+                TextSink sink{out, chosen, piece.index, piece.left, piece.open};
+                render(piece, sink);
+                piece.text = out.str();
+            });
+            auto start = stats::Clock::now();
+            for (size_t i = first; i < last; ++i){
+                outfile << pieces[i].text;
+                pieces[i] = Piece{};
+            }
+            writing += stats::seconds(start, stats::Clock::now());
+        }
+    }
+
+    /**
+     * digest the genome into a fragment index. Only finding the cuts runs in
+     * parallel, the records are cheap to make in order afterwards.
+     */
+    void run(std::string_view genome, IndexSink& sink){
+        split(genome);
+        size_t wave = size_t(threads) * 4;
+        for (size_t first = 0; first < pieces.size(); first += wave){
+            size_t last = std::min(pieces.size(), first + wave);
+            parallel(first, last, [&](Piece& piece){ findCuts(piece); });
+            for (size_t i = first; i < last; ++i){
+                count(pieces[i]);
+                render(pieces[i], sink);
+                pieces[i] = Piece{};
+            }
+        }
+        sink.close();
+    }
+
+private:
+    // the sequence of one header (or whatever comes before the first header)
+    struct Segment{
+        bool header;
+        std::string_view name;
+        size_t begin, end;  // byte range of the sequence lines
+    };
+    struct Piece{
+        int segment = 0;
+        size_t begin = 0, end = 0;  // byte range, which may start and end in the middle of a line
+        bool opens = false;         // first piece of its segment
+        bool closes = false;        // last piece of its segment
+        long long size = 0;         // bases in the piece
+        std::vector<std::pair<long long, int>> cuts; // (cut position within the piece, enzyme id)
+        int index = 0;              // fragment number when the piece starts
+        bool open = false;          // whether that fragment's line has been started
+        std::string left;           // enzyme that cut the fragment the piece starts in
+        std::string text;           // rendered output (text format only)
+    };
+    static constexpr size_t pieceSize = 1 << 22;
+
+    const Digest::Matcher& matcher;
+    const std::vector<std::string>& chosen;
+    int threads;
+    int hold = 0;
+    std::string_view genome;
+    std::vector<Segment> segments;
+    std::vector<Piece> pieces;
+
+    // split the genome at headers, then every pieceSize bytes (so a header on one line is split too)
+    void split(std::string_view text){
+        genome = text;
+        size_t at = 0;
+        bool header = false;
+        std::string_view name;
+        while(true){
+            // find the next line that starts with '>'
+            size_t next = at;
+            while((next = genome.find('>', next)) != std::string_view::npos && next > 0 && genome[next - 1] != '\n'){
+                ++next;
+            }
+            if (next == std::string_view::npos){
+                next = genome.size();
+            }
+            if (header || next > 0){
+                segments.push_back({header, name, at, next});
+            }
+            if (next == genome.size()){
+                break;
+            }
+            size_t eol = genome.find('\n', next);
+            at = eol == std::string_view::npos ? genome.size() : eol + 1;
+            header = true;
+            name = genome.substr(next + 1, at - next - 1);
+            while(!name.empty() && isBreak(name.back())){
+                name.remove_suffix(1);
+            }
+        }
+
+        for (int id = 0; id < int(segments.size()); ++id){
+            size_t begin = segments[size_t(id)].begin, end = segments[size_t(id)].end;
+            do{
+                size_t stop = end;
+                if (end - begin > pieceSize){ // mid-line is fine, only not next to a line break
+                    stop = begin + pieceSize;
+                    while(stop < end && (isBreak(genome[stop]) || genome[stop - 1] == '\r')){
+                        ++stop;
+                    }
+                }
+                Piece piece;
+                piece.segment = id;
+                piece.begin = begin;
+                piece.end = stop;
+                piece.opens = begin == segments[size_t(id)].begin;
+                piece.closes = stop == end;
+                pieces.push_back(std::move(piece));
+                begin = stop;
+            }while(begin < end);
+        }
+    }
+
+    // run work on pieces[first, last) with the worker threads
+    template<class Work>
+    void parallel(size_t first, size_t last, Work work){
+        std::atomic<size_t> next{first};
+        auto worker = [&]{
+            for (size_t i; (i = next++) < last;){
+                work(pieces[i]);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (int t = 1; t < threads; ++t){
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (auto& th : pool){
+            th.join();
+        }
+    }
+
+    static bool isBreak(char ch){
+        return ch == '\n' || ch == '\r';
+    }
+
+    // find the cuts that fall inside the piece, looking hold bases past both of its ends
+    void findCuts(Piece& piece){
+        const auto& seg = segments[size_t(piece.segment)];
+        size_t from = piece.begin;
+        long long before = 0;
+        while(before < hold && from > seg.begin){
+            if (!isBreak(genome[--from])){
+                ++before;
+            }
+        }
+        size_t to = piece.end;
+        for (int after = 0; after < hold && to < seg.end; ++to){
+            if (!isBreak(genome[to])){
+                ++after;
+            }
+        }
+
+        Digest::Matcher local = matcher;
+        std::visit([](auto& m){ m.reset(); }, local);
+        long long pos = -before, size = 0;
+        forEachLine(genome.substr(piece.begin, piece.end - piece.begin), [&](std::string_view line){
+            size += (long long)line.size();
+        });
+        forEachLine(genome.substr(from, to - from), [&](std::string_view line){
+            std::visit([&](auto& m){
+                m.scan(line, [&](int end, int id){
+                    const auto& [pat, cut] = enzymes.at(chosen[size_t(id)]);
+                    long long at = pos + end - int(pat.size()) + 1 + cut;
+                    if (at >= 0 && at < size){
+                        piece.cuts.emplace_back(at, id);
+                    }
+                });
+            }, local);
+            pos += (long long)line.size();
+        });
+        // same rule as the serial digest: one cut per spot, named by the first enzyme listed
+        std::ranges::sort(piece.cuts);
+        auto same = std::ranges::unique(piece.cuts, {}, &std::pair<long long, int>::first);
+        piece.cuts.erase(same.begin(), same.end());
+        piece.size = size;
+    }
+
+    // --stats=json: add the piece to the count of its header, in order
+    void count(const Piece& piece){
+        if (!keep_stats){
+            return;
+        }
+        if (piece.opens){
+            countHeader(segments[size_t(piece.segment)].name);
+        }
+        counted.back().bases += piece.size;
+        counted.back().fragments += (long long)piece.cuts.size();
+    }
+
+    // replay the piece into a sink, exactly the way the serial digest does
+    void render(const Piece& piece, Sink& sink){
+        const auto& seg = segments[size_t(piece.segment)];
+        if (piece.opens && seg.header){
+            sink.header(seg.name);
+        }
+        long long pos = 0;
+        size_t next = 0;
+        auto bases = [&](std::string_view some){ // the serial digest never hands over no bases
+            if (!some.empty()){
+                sink.bases(some);
+            }
+        };
+        forEachLine(genome.substr(piece.begin, piece.end - piece.begin), [&](std::string_view line){
+            long long end = pos + (long long)line.size();
+            for (; next < piece.cuts.size() && piece.cuts[next].first < end; ++next){
+                const auto& [at, id] = piece.cuts[next];
+                bases(line.substr(0, size_t(at - pos)));
+                line.remove_prefix(size_t(at - pos));
+                pos = at;
+                sink.cut(id);
+            }
+            bases(line);
+            pos = end;
+        });
+        if (piece.closes){
+            sink.close();
+        }
+    }
+};
+
+/**
+ * --stats=json: write what the run took as one JSON object
+ * input : the stream to write to, how the digest was run, and its total seconds and bytes
+ * output: none
+ */
+void writeStats(std::ostream& out, const std::string& engine, const std::vector<std::string>& chosen, int threads, bool mapped,
+                const std::string& format, double total, uint64_t bytes_read, uint64_t bytes_written){
+    stats::Json json{out};
+    json.object()
+        .field("tool", "digestFragment").field("engine", engine).field("threads", threads)
+        .field("mmap", mapped).field("format", format);
+    json.key("enzymes").array();
+    for (const auto& enzyme : chosen){
+        json.value(enzyme);
+    }
+    json.end();
+    json.key("phases").object();
+    for (const auto& [phase, seconds] : phases.list()){
+        json.field(phase, seconds);
+    }
+    json.end().field("total_seconds", total);
+    long long bases = 0, fragments = 0;
+    json.key("chromosomes").array();
+    for (const auto& c : counted){
+        json.object().field("name", c.name).field("bases", c.bases).field("fragments", c.fragments).end();
+        bases += c.bases;
+        fragments += c.fragments;
+    }
+    json.end();
+    json.field("bases", bases).field("fragments", fragments)
+        .field("bytes_read", bytes_read).field("bytes_written", bytes_written).field("peak_rss_kb", stats::peakRssKb());
+    json.end();
+}
+
+int main(int argc, char *argv[]){
     // handle command line input
-    if (argc != 4){
+    std::vector<std::string> args;
+    std::string engine = "auto";
+    bool use_mmap = false;
+    int threads = 1;
+    std::string format = "csv";
+    bool packed = false;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg.starts_with("--engine=")){
+            engine = arg.substr(9);
+        }else if (arg == "--mmap"){
+            use_mmap = true;
+        }else if (arg.starts_with("--format=")){
+            format = arg.substr(9);
+        }else if (arg == "--packed"){
+            packed = true;
+        }else if (arg.starts_with("--stats")){
+            std::string format = arg.size() > 7 && arg[7] == '=' ? arg.substr(8) : (i + 1 < argc ? argv[++i] : "");
+            if (format != "json"){
+                usage();
+                return -1;
+            }
+            keep_stats = true;
+        }else if (arg.starts_with("--threads")){
+            std::string num = arg.size() > 9 && arg[9] == '=' ? arg.substr(10) : (i + 1 < argc ? argv[++i] : "");
+            threads = std::atoi(num.c_str());
+            if (threads < 1){
+                usage();
+                return -1;
+            }
+        }else{
+            args.push_back(arg);
+        }
+    }
+    if (args.size() != 3 || (engine != "auto" && engine != "shift-and" && engine != "aho-corasick")
+        || (format != "csv" && format != "index") || (packed && format != "index")){
         usage();
         return -1;
     }
-    std::string input_file = argv[1];
-    std::string enzyme = argv[2];
-    std::string output_file = argv[3];
+    std::string input_file = args[0];
+    std::vector<std::string> chosen = splitEnzymes(args[1]);
+    std::string output_file = args[2];
 
     // verify enzyme validity
-    if (enzymes.count(enzyme) == 0){
+    if (chosen.empty()){
         usage();
         return -1;
     }
+    for (const auto& enzyme : chosen){
+        if (enzymes.count(enzyme) == 0){
+            std::cerr << "Unknown enzyme " << enzyme << "\n\n";
+            usage();
+            return -1;
+        }
+    }
 
     // variables needed
+    auto started = stats::Clock::now();
     std::ofstream outfile{output_file};
-    std::ifstream infile{input_file};
-    if (!infile){
+    if (!std::ifstream{input_file}){ // only checked: --mmap and --threads open it their own way, streaming opens it below
         std::cerr << "Failed to open input file " << input_file << '\n';
         std::cerr << "Exiting..." << '\n';
         return -1;
@@ -116,45 +735,89 @@ int main(int argc, char *argv[]){
         std::cerr << "Exiting..." << '\n';
         return -1;
     }
-    std::string line;
-    std::string now;
-    auto [pat, cut] = enzymes[enzyme];
-    int pat_len = int(pat.size());
-    int index = 0;
+    std::vector<std::string> sites;
+    int total = 0;
+    for (const auto& enzyme : chosen){
+        sites.push_back(enzymes[enzyme].first);
+        total += int(sites.back().size());
+    }
+    if (engine == "shift-and" && total > ShiftAnd::maxBits){
+        std::cerr << "The recognition sites add up to " << total << " letters, Shift-And can only take "
+                  << ShiftAnd::maxBits << ". Use --engine=aho-corasick instead.\n";
+        return -1;
+    }
+    if (engine == "auto"){
+        engine = total <= ShiftAnd::maxBits ? "shift-and" : "aho-corasick";
+    }
+    auto building = stats::Clock::now();
+    std::variant<ShiftAnd, AhoCorasick> matcher = engine == "shift-and"
+        ? std::variant<ShiftAnd, AhoCorasick>{std::in_place_type<ShiftAnd>, sites}
+        : std::variant<ShiftAnd, AhoCorasick>{std::in_place_type<AhoCorasick>, sites};
+    Output out{outfile};
+    TextSink text{out, chosen};
+    fragment_index::Index index;
+    index.enzymes = chosen;
+    index.sequence = packed;
+    IndexSink binary{index};
+    Sink& sink = format == "index" ? static_cast<Sink&>(binary) : text;
+    Digest digest{matcher, chosen, sink};
+    phases.add("build", stats::seconds(building, stats::Clock::now()));
 
     // process input file
-    // there can be more than 1e11 characters,
-    // we must process it chuck by chuck
-    // I use KMP algo which runs in O(P+T) and it is deterministic
-    while(infile){
-        std::getline(infile, line);
-        if (line[0] == '>' || int(now.size()) >= LIMIT || !infile){
-            std::string dummy = pat + "&" + now;
-            int len = int(dummy.size());
-            int prev = 0;
-            auto pi = computePrefix(dummy);
-            for (int i = pat_len + 1; i < len; ++i){
-                if (pi[i] == pat_len){
-                    outfile << now.substr(prev, i - 2*pat_len+cut-prev) << '\n' << ++index << ",";
-                    prev = i-2*pat_len+cut;
-                    i += pat_len - 1;
-                }
-            }
-            outfile << now.substr(prev);
-            if (line[0] == '>'){ // header, a new segment, reset index
-                index = 0;
-                outfile << (now.empty()? "" : "\n") << ++index << ",";
-            }
-            now = "";
+    // there can be more than 1e11 characters, so they are streamed through
+    // the matcher as they are read; both engines find every site of every
+    // enzyme in O(T) in one pass
+    double digesting = 0; // seconds spent cutting (and writing), rather than reading
+    auto reading = stats::Clock::now();
+    if (use_mmap || threads > 1){
+        GenomeFile genome;
+        if (!genome.open(input_file)){
+            std::cerr << "Failed to map input file " << input_file << '\n';
+            std::cerr << "Exiting..." << '\n';
+            return -1;
         }
-        if (infile && line[0] != '>'){
-            now += str_toupper(line);
+        phases.add("parse", stats::seconds(reading, stats::Clock::now()));
+        auto cutting = stats::Clock::now();
+        if (threads > 1 && format == "index"){
+            ParallelDigest{matcher, chosen, threads}.run(genome.data(), binary);
+        }else if (threads > 1){
+            ParallelDigest{matcher, chosen, threads}.run(genome.data(), outfile);
+        }else{
+            digestMapped(genome.data(), digest);
         }
+        digesting += stats::seconds(cutting, stats::Clock::now());
+    }else{
+        gzip_input::File infile{input_file};
+        fasta::Reader reader{infile, nullptr, size_t(LIMIT)};
+        reader.run([&](std::string_view name){ // a new segment, reset index
+                       auto cutting = stats::Clock::now();
+                       digest.header(name);
+                       digesting += stats::seconds(cutting, stats::Clock::now());
+                   },
+                   [&](std::basic_string_view<unsigned char> bases){
+                       auto cutting = stats::Clock::now();
+                       digest.feed(std::string_view(reinterpret_cast<const char*>(bases.data()), bases.size()));
+                       digesting += stats::seconds(cutting, stats::Clock::now());
+                   },
+                   [](char, size_t){});
+        phases.add("parse", stats::seconds(reading, stats::Clock::now()) - digesting);
     }
-    infile.close();
+    auto cutting = stats::Clock::now();
+    digest.finish();
+    out.drain();
     outfile.close();
+    digesting += stats::seconds(cutting, stats::Clock::now());
+    phases.add("query", digesting - writing);
+    phases.add("write", writing);
+    if (format == "index"){
+        auto timer = phases.time("write");
+        if (!index.save(output_file)){
+            std::cerr << "Failed to write the fragment index to " << output_file << '\n';
+            return -1;
+        }
+    }
+    if (keep_stats){
+        writeStats(std::cerr, engine, chosen, threads, use_mmap || threads > 1, format, stats::seconds(started, stats::Clock::now()),
+                   stats::fileSize(input_file), stats::fileSize(output_file));
+    }
 };
-
-
-
-
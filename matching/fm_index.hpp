@@ -0,0 +1,582 @@
+#pragma once
+/**
+ * FM-index Section
+ * A low memory alternative to the suffix automaton: about a byte per base
+ * once built, instead of about 72.
+ *
+ * The suffix array is built with SA-IS in linear time, turned into the BWT
+ * and then thrown away except for every 32nd text position. The BWT is kept
+ * as 3 bit planes in blocks of 128 symbols, each block starting with how
+ * often every symbol came before it, so an occurrence count is a block
+ * lookup and a couple of popcounts.
+ *
+ * Symbols: 0 is the end of the text, 1.. are the letter codes + 1 (ATCG,
+ * then the rest of IUPAC), and the last one separates chromosomes so that
+ * no match runs across them. The planes only have room for ATCG; any other
+ * letter is stored there as "rare", and the rows holding each rare letter
+ * are listed on the side, as they are few.
+ */
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+class FMIndex{
+public:
+    static constexpr int sample = 32;   // every sample-th text position keeps its place in the suffix array
+    static constexpr int sigma = 16;    // letter codes, ATCG first
+
+    struct Match{
+        int end = 0;        // last letter of the match in the pattern
+        int length = 0;
+        size_t where = 0;   // where it starts in the text, not counting the separators
+        size_t steps = 0;   // backward search steps taken to find it
+    };
+
+    // the rows of the suffix array starting with some string, one per place it occurs
+    struct Range{
+        size_t lo = 0, hi = 0;
+    };
+
+    /**
+     * index a text of letter codes
+     * input : the text, and where in it each new chromosome starts (in order)
+     */
+    void build(const std::vector<unsigned char>& text, const std::vector<size_t>& cuts){
+        size_t n = text.size() + cuts.size() + 1;
+        if (n >= size_t(empty)){
+            std::cout << "Sorry - the FM-index handles at most " << empty - 1 << " letters at once.\n";
+            exit(-1);
+        }
+        std::vector<unsigned char> t;
+        t.reserve(n);
+        separators.clear();
+        auto cut = cuts.begin();
+        for (size_t i = 0; i < text.size(); ++i){
+            for (; cut != cuts.end() && *cut == i; ++cut){
+                separators.push_back(t.size());
+                t.push_back(separator);
+            }
+            t.push_back((unsigned char)(text[i] + 1));
+        }
+        t.push_back(0);
+
+        std::vector<uint32_t> sa(n);
+        sais(t.data(), sa.data(), n, separator + 1);
+
+        rows = n;
+        std::fill(std::begin(C), std::end(C), 0);
+        for (unsigned char c : t){
+            ++C[c + 1];
+        }
+        for (int c = 1; c <= separator + 1; ++c){
+            C[c] += C[c - 1];
+        }
+        for (auto& rows_of : rare){
+            rows_of.clear();
+        }
+        blocks.assign(n / 128 + 1, Block{});
+        marked.assign(n / 64 + 1, 0);
+        markedRank.assign(n / 64 + 1, 0);
+        samples.clear();
+        uint32_t count[8] = {};
+        for (size_t i = 0; i < n; ++i){
+            auto& block = blocks[i / 128];
+            if (i % 128 == 0){
+                std::copy(std::begin(count), std::end(count), block.count);
+            }
+            unsigned char c = sa[i] == 0 ? 0 : t[sa[i] - 1];
+            if (c == separator){
+                c = planeSeparator;
+            }else if (c > dense){
+                rare[c - dense - 1].push_back(uint32_t(i));
+                c = planeRare;
+            }
+            ++count[c];
+            for (int p = 0; p < 3; ++p){
+                block.plane[p][i % 128 / 64] |= uint64_t((c >> p) & 1) << (i % 64);
+            }
+            if (sa[i] % sample == 0){
+                marked[i / 64] |= uint64_t(1) << (i % 64);
+                samples.push_back(sa[i]);
+            }
+        }
+        if (n % 128 == 0){ // the block past the end, for occurrences in all the rows
+            std::copy(std::begin(count), std::end(count), blocks[n / 128].count);
+        }
+        uint32_t ranked = 0;
+        for (size_t w = 0; w < marked.size(); ++w){
+            markedRank[w] = ranked;
+            ranked += uint32_t(std::popcount(marked[w]));
+        }
+    }
+
+    /**
+     * the longest substring of the pattern that occurs in the text, the first one in the pattern if
+     * there are several, and one of the places it occurs at.
+     * Backward search only grows a match to the left, so for each end r it
+     * checks whether the best length + 1 letters ending at r occur. When the
+     * search dies at k, every window that still holds k..r fails too, and r
+     * can jump ahead to k + best + 1.
+     * input : the letter codes of the pattern
+     * output: where it is in the pattern and in the text (length 0 if nothing matched)
+     */
+    Match longest(std::basic_string_view<unsigned char> pattern) const {
+        Match best;
+        size_t bestRow = 0;
+        long m = long(pattern.size());
+        for (long r = 0; r < m;){
+            size_t lo = 0, hi = rows;
+            long k = r;
+            for (; k >= 0; --k){
+                ++best.steps;
+                int c = pattern[size_t(k)] + 1;
+                size_t nlo = C[c] + rank(c, lo), nhi = C[c] + rank(c, hi);
+                if (nlo >= nhi){
+                    break;
+                }
+                lo = nlo;
+                hi = nhi;
+                if (r - k + 1 > best.length){
+                    best.end = int(r);
+                    best.length = int(r - k + 1);
+                    bestRow = lo;
+                }
+            }
+            // k..r does not occur (or k is -1), so neither does any window of best + 1 letters holding it
+            r = std::max(r + 1, k + best.length + 1);
+        }
+        if (best.length > 0){
+            size_t at = locate(bestRow);
+            best.where = at - size_t(std::lower_bound(separators.begin(), separators.end(), at) - separators.begin());
+        }
+        return best;
+    }
+
+    /**
+     * for each letter of the pattern, the longest stretch ending there that occurs in the text
+     * input : the letter codes of the pattern
+     * output: its length and rows for each letter
+     */
+    void longestEndingAt(std::basic_string_view<unsigned char> pattern, std::vector<int>& lengths, std::vector<Range>& ranges) const {
+        lengths.assign(pattern.size(), 0);
+        ranges.assign(pattern.size(), Range{});
+        for (size_t r = 0; r < pattern.size(); ++r){
+            Range range{0, rows};
+            for (size_t k = r + 1; k-- > 0;){
+                Range next = step(range, pattern[k] + 1);
+                if (next.lo >= next.hi){
+                    break;
+                }
+                range = next;
+                lengths[r] = int(r - k + 1);
+                ranges[r] = range;
+            }
+        }
+    }
+
+    /**
+     * the longest substring of the pattern that occurs in the text with at most k letters substituted,
+     * the first one in the pattern if there are several, and one of the places it occurs at.
+     * Bounded backtracking: from an end r the backward search runs as far as it
+     * can, then, from the leftmost letter reached back to r, every other letter
+     * is tried in its place for one substitution, and so on. Branches that
+     * cannot beat the best so far are cut with the same bounds as the automaton
+     * uses (see Approximate in match.cpp), mirrored, and the ends are tried
+     * best bound first.
+     * input : the letter codes of the pattern and k
+     * output: where it is in the pattern and in the text (length 0 if nothing matched)
+     */
+    Match longestWithin(std::basic_string_view<unsigned char> pattern, int k) const {
+        Within search{*this, pattern, k};
+        return search.run();
+    }
+
+    /**
+     * call place(where) for every place the rows' string starts in the text, not counting the separators
+     */
+    template<class Place>
+    void forEachPlace(Range range, Place&& place) const {
+        for (size_t row = range.lo; row < range.hi; ++row){
+            size_t at = locate(row);
+            place(at - size_t(std::lower_bound(separators.begin(), separators.end(), at) - separators.begin()));
+        }
+    }
+
+    /**
+     * bytes held by the index
+     */
+    size_t bytes() const {
+        size_t listed = 0;
+        for (const auto& rows_of : rare){
+            listed += rows_of.size();
+        }
+        return blocks.size() * sizeof(Block) + marked.size() * sizeof(uint64_t) + markedRank.size() * sizeof(uint32_t)
+             + samples.size() * sizeof(uint32_t) + separators.size() * sizeof(size_t) + listed * sizeof(uint32_t);
+    }
+
+private:
+    static constexpr uint32_t empty = ~uint32_t(0);
+    static constexpr int dense = 4;                 // letters with their own value in the planes
+    static constexpr int separator = sigma + 1;     // text symbol between chromosomes
+    static constexpr int planeRare = dense + 1;     // plane value of any other letter
+    static constexpr int planeSeparator = 7;
+
+    struct Block{
+        uint32_t count[8];      // occurrences of each symbol before the block
+        uint64_t plane[3][2];   // bit p of each of the 128 symbols
+    };
+
+    size_t rows = 0;
+    size_t C[separator + 2] = {};       // symbols smaller than c in the text
+    std::vector<Block> blocks;
+    std::vector<uint64_t> marked;       // rows whose text position is sampled
+    std::vector<uint32_t> markedRank;   // marked rows before each word
+    std::vector<uint32_t> samples;      // text positions of the marked rows, in row order
+    std::vector<size_t> separators;     // where the separators are in the text
+    std::vector<uint32_t> rare[sigma - dense];  // rows of the BWT holding each letter past ATCG
+
+    // positions among bits [0, bits) of one word of a block that hold symbol c
+    static uint64_t matches(const Block& block, int w, int c, int bits){
+        uint64_t m = bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+        for (int p = 0; p < 3; ++p){
+            m &= (c >> p) & 1 ? block.plane[p][w] : ~block.plane[p][w];
+        }
+        return m;
+    }
+
+    // the state of one longestWithin search, the mirror image of Approximate in match.cpp:
+    // loose and exact are indexed by q, for matches of pattern[0, q) ending at q - 1
+    struct Within{
+        // one search from one end
+        struct Search{
+            bool last = false;  // the search for the answer, not for an exact(k, q)
+            int end = 0;
+            int enough = 0;     // stop once length gets here
+            int length = 0, bestEnd = 0;
+            size_t bestRow = 0;
+        };
+
+        const FMIndex& fm;
+        std::basic_string_view<unsigned char> pattern;
+        int k;
+        int m;
+        std::vector<int> loosest, known;        // loose(j, q) and exact(j, q) (-1 until searched), row j of m + 1
+        std::vector<std::vector<Range>> paths;  // the rows of the exact search for each number of substitutions left
+        Search now;
+        size_t steps = 0;
+
+        Within(const FMIndex& fm, std::basic_string_view<unsigned char> pattern, int k)
+            : fm(fm), pattern(pattern), k(k), m(int(pattern.size())){}
+
+        Match run(){
+            size_t cells = size_t(k + 1) * size_t(m + 1);
+            loosest.assign(cells, 0);
+            known.assign(cells, -1);
+            std::vector<int> ending;
+            std::vector<Range> ranges;
+            fm.longestEndingAt(pattern, ending, ranges);
+            for (int q = 1; q <= m; ++q){
+                int l = ending[size_t(q - 1)];
+                steps += size_t(l) + 1;
+                loose(0, q) = l;
+                for (int j = 1; j <= k; ++j){ // an exact run, one substituted letter and the best with one less from there on
+                    loose(j, q) = std::min(q, l + 1 + loose(j - 1, std::max(0, q - l - 1)));
+                }
+            }
+            paths.resize(size_t(k + 1));
+
+            std::vector<int> ends(pattern.size());
+            for (int r = 0; r < m; ++r){
+                ends[size_t(r)] = r;
+            }
+            std::stable_sort(ends.begin(), ends.end(), [&](int a, int b){ return loose(k, a + 1) > loose(k, b + 1); });
+            now = {};
+            now.last = true;
+            now.enough = m + 1;
+            for (int r : ends){
+                int q = r + 1;
+                if (loose(k, q) < now.length){
+                    break;
+                }
+                now.end = r;
+                if (loose(k, q) < needed()){
+                    continue;
+                }
+                if (k > 1){ // one substitution less, then the exact run; or the other way around
+                    int exact_run = loose(0, q), fewer = exact(k - 1, q);
+                    if (std::min(exact_run + 1 + exact(k - 1, std::max(0, q - exact_run - 1)),
+                                 fewer + 1 + loose(0, std::max(0, q - fewer - 1))) < needed()){
+                        continue;
+                    }
+                }
+                extend({0, fm.rows}, r, k, 0);
+            }
+            Match best{now.bestEnd, now.length, 0, steps};
+            if (best.length > 0){
+                size_t at = fm.locate(now.bestRow);
+                best.where = at - size_t(std::lower_bound(fm.separators.begin(), fm.separators.end(), at) - fm.separators.begin());
+            }
+            return best;
+        }
+
+        int& loose(int j, int q){
+            return loosest[size_t(j) * size_t(m + 1) + size_t(q)];
+        }
+
+        // the longest match ending at letter q - 1 with at most j substitutions
+        int exact(int j, int q){
+            if (j == 0 || q == 0){
+                return loose(0, q);
+            }
+            int& found = known[size_t(j) * size_t(m + 1) + size_t(q)];
+            if (found < 0){
+                Search outer = now; // this runs in the middle of another search, which only uses paths[j + 1, ...]
+                now = {};
+                now.end = q - 1;
+                now.length = exact(j - 1, q);
+                now.enough = loose(j, q);
+                if (q > 1 && known[size_t(j) * size_t(m + 1) + size_t(q) - 1] >= 0){ // one more than up to the letter before at most
+                    now.enough = std::min(now.enough, known[size_t(j) * size_t(m + 1) + size_t(q) - 1] + 1);
+                }
+                if (now.length < now.enough){
+                    extend({0, fm.rows}, q - 1, j, 0);
+                }
+                found = now.length;
+                now = outer;
+            }
+            return found;
+        }
+
+        // longer than the best, or as long if it ends earlier in the pattern
+        int needed() const {
+            return now.length + (now.last && now.length > 0 && now.end < now.bestEnd ? 0 : 1);
+        }
+
+        // grow the match left from letter p on, done letters long so far with j substitutions left
+        void extend(Range range, int p, int j, int done){
+            auto& path = paths[size_t(j)];
+            path.clear();
+            path.push_back(range);
+            int from = p;
+            for (; p >= 0; --p){
+                ++steps;
+                Range next = fm.step(range, pattern[size_t(p)] + 1);
+                if (next.lo >= next.hi){
+                    break;
+                }
+                range = next;
+                path.push_back(range);
+            }
+            if (done + from - p >= needed()){
+                now.length = done + from - p;
+                now.bestEnd = now.end;
+                now.bestRow = range.lo;
+            }
+            for (int q = std::max(p, 0); j > 0 && q <= from && now.length < now.enough; ++q){
+                int before = done + from - q;
+                if (before + 1 + loose(j - 1, q) < needed() || before + 1 + exact(j - 1, q) < needed()){
+                    continue;
+                }
+                for (int c = 1; c <= sigma; ++c){
+                    if (c == pattern[size_t(q)] + 1){
+                        continue;
+                    }
+                    ++steps;
+                    Range next = fm.step(paths[size_t(j)][size_t(from - q)], c);
+                    if (next.lo < next.hi){
+                        extend(next, q - 1, j - 1, before + 1);
+                    }
+                }
+            }
+        }
+    };
+
+    // the rows starting with symbol c followed by the string of range
+    Range step(Range range, int c) const {
+        return {C[c] + rank(c, range.lo), C[c] + rank(c, range.hi)};
+    }
+
+    // occurrences of text symbol c in the first i rows of the BWT
+    size_t rank(int c, size_t i) const {
+        if (c > dense && c < separator){
+            const auto& rows_of = rare[c - dense - 1];
+            return size_t(std::lower_bound(rows_of.begin(), rows_of.end(), uint32_t(i)) - rows_of.begin());
+        }
+        return occ(c == separator ? planeSeparator : c, i);
+    }
+
+    // occurrences of plane value c in the first i rows of the BWT
+    size_t occ(int c, size_t i) const {
+        const auto& block = blocks[i / 128];
+        size_t count = block.count[c];
+        int within = int(i % 128);
+        if (within > 64){
+            count += size_t(std::popcount(matches(block, 0, c, 64)));
+            count += size_t(std::popcount(matches(block, 1, c, within - 64)));
+        }else if (within > 0){
+            count += size_t(std::popcount(matches(block, 0, c, within)));
+        }
+        return count;
+    }
+
+    // the text symbol in a row of the BWT
+    int symbol(size_t row) const {
+        const auto& block = blocks[row / 128];
+        int w = int(row % 128 / 64), bit = int(row % 64);
+        int c = 0;
+        for (int p = 0; p < 3; ++p){
+            c |= int((block.plane[p][w] >> bit) & 1) << p;
+        }
+        if (c == planeSeparator){
+            return separator;
+        }
+        if (c == planeRare){
+            for (int r = 0; r < sigma - dense; ++r){
+                if (std::binary_search(rare[r].begin(), rare[r].end(), uint32_t(row))){
+                    return dense + 1 + r;
+                }
+            }
+        }
+        return c;
+    }
+
+    // text position of a row: walk back to a sampled one
+    size_t locate(size_t row) const {
+        size_t steps = 0;
+        while(!((marked[row / 64] >> (row % 64)) & 1)){
+            int c = symbol(row);
+            row = C[c] + rank(c, row);
+            ++steps;
+        }
+        uint64_t before = marked[row / 64] & ((uint64_t(1) << (row % 64)) - 1);
+        return samples[markedRank[row / 64] + uint32_t(std::popcount(before))] + steps;
+    }
+
+    /**
+     * SA-IS: sort the suffixes of s, which ends in a unique smallest symbol 0
+     * input : the text, room for the suffix array, its length and the alphabet size
+     * output: sa filled in
+     */
+    template<class Symbol>
+    static void sais(const Symbol* s, uint32_t* sa, size_t n, size_t K){
+        if (n == 1){
+            sa[0] = 0;
+            return;
+        }
+        std::vector<bool> stype(n);
+        stype[n - 1] = true;
+        for (size_t i = n - 1; i-- > 0;){
+            stype[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && stype[i + 1]);
+        }
+        auto lms = [&](size_t i){
+            return i > 0 && stype[i] && !stype[i - 1];
+        };
+        std::vector<uint32_t> sizes(K, 0), bucket(K);
+        for (size_t i = 0; i < n; ++i){
+            ++sizes[s[i]];
+        }
+        auto heads = [&]{
+            uint32_t sum = 0;
+            for (size_t c = 0; c < K; ++c){
+                bucket[c] = sum;
+                sum += sizes[c];
+            }
+        };
+        auto tails = [&]{
+            uint32_t sum = 0;
+            for (size_t c = 0; c < K; ++c){
+                sum += sizes[c];
+                bucket[c] = sum;
+            }
+        };
+        auto induce = [&]{
+            heads();
+            for (size_t j = 0; j < n; ++j){
+                uint32_t k = sa[j];
+                if (k != empty && k > 0 && !stype[k - 1]){
+                    sa[bucket[s[k - 1]]++] = k - 1;
+                }
+            }
+            tails();
+            for (size_t j = n; j-- > 0;){
+                uint32_t k = sa[j];
+                if (k != empty && k > 0 && stype[k - 1]){
+                    sa[--bucket[s[k - 1]]] = k - 1;
+                }
+            }
+        };
+
+        // sort the LMS substrings
+        std::fill(sa, sa + n, empty);
+        tails();
+        for (size_t i = 1; i < n; ++i){
+            if (lms(i)){
+                sa[--bucket[s[i]]] = uint32_t(i);
+            }
+        }
+        induce();
+
+        // name them, equal substrings get equal names
+        size_t n1 = 0;
+        for (size_t j = 0; j < n; ++j){
+            if (lms(sa[j])){
+                sa[n1++] = sa[j];
+            }
+        }
+        std::fill(sa + n1, sa + n, empty);
+        uint32_t name = 0, prev = empty;
+        for (size_t j = 0; j < n1; ++j){
+            uint32_t pos = sa[j];
+            bool differ = prev == empty;
+            for (size_t d = 0; !differ; ++d){
+                if (s[pos + d] != s[prev + d] || stype[pos + d] != stype[prev + d]){
+                    differ = true;
+                }else if (d > 0 && lms(pos + d)){
+                    break;
+                }
+            }
+            if (differ){
+                ++name;
+                prev = pos;
+            }
+            sa[n1 + pos / 2] = name - 1;
+        }
+        for (size_t j = n, i = n; j-- > n1;){
+            if (sa[j] != empty){
+                sa[--i] = sa[j];
+            }
+        }
+
+        // sort the reduced string, recursing while names repeat
+        uint32_t* s1 = sa + n - n1;
+        if (name < n1){
+            sais(s1, sa, n1, name);
+        }else{
+            for (size_t i = 0; i < n1; ++i){
+                sa[s1[i]] = uint32_t(i);
+            }
+        }
+
+        // put the sorted LMS suffixes at the ends of their buckets and induce the rest
+        for (size_t i = 1, j = 0; i < n; ++i){
+            if (lms(i)){
+                s1[j++] = uint32_t(i);
+            }
+        }
+        for (size_t i = 0; i < n1; ++i){
+            sa[i] = s1[sa[i]];
+        }
+        std::fill(sa + n1, sa + n, empty);
+        tails();
+        for (size_t i = n1; i-- > 0;){
+            uint32_t j = sa[i];
+            sa[i] = empty;
+            sa[--bucket[s[j]]] = j;
+        }
+        induce();
+    }
+};
@@ -0,0 +1,46 @@
+#pragma once
+/**
+ * All the fragments, loaded once and kept in columns: one buffer of symbol
+ * codes for every fragment back to back, where each fragment starts in it,
+ * and the index each fragment had in the fragments file.
+ */
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+class FragmentSet{
+public:
+    std::vector<unsigned char> codes;   // symbol codes of all the fragments
+    std::vector<size_t> offsets{0};     // fragment i is codes[offsets[i], offsets[i+1])
+    std::vector<int> ids;               // index from the fragments file
+
+    size_t size() const {
+        return ids.size();
+    }
+
+    /**
+     * the symbol codes of fragment i
+     */
+    std::basic_string_view<unsigned char> operator[](size_t i) const {
+        return {codes.data() + offsets[i], offsets[i + 1] - offsets[i]};
+    }
+
+    /**
+     * start a new fragment; its codes are appended to codes afterwards
+     */
+    void add(int id){
+        if (!ids.empty()){
+            offsets.push_back(codes.size());
+        }
+        ids.push_back(id);
+    }
+
+    /**
+     * call once every fragment has been added
+     */
+    void done(){
+        if (!ids.empty()){
+            offsets.push_back(codes.size());
+        }
+    }
+};
@@ -0,0 +1,186 @@
+#pragma once
+/**
+ * The longest exact match of a fragment in a suffix automaton or an FM-index,
+ * shared by match and shatter: the symbol codes both read the genome into,
+ * how the best match of each fragment is kept and how it is written out.
+ */
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "suffix_automaton.hpp"
+#include "fm_index.hpp"
+#include "fragment_set.hpp"
+#include "reference_index.hpp"
+
+inline constexpr char letters[] = "ATCGNWRYKMSBDHVU"; // symbol code -> letter, ATCG first for the automaton
+inline constexpr unsigned char complement[] = {1, 0, 3, 2, 4, 5, 7, 6, 9, 8, 10, 14, 13, 12, 11, 0}; // symbol code -> its complement's
+
+// the longest match of one fragment in the current chronosome (header)
+struct Found{
+    int end = 0;        // last letter of the match in the fragment
+    int length = 0;     // 0 if nothing matched
+    size_t where = 0;   // where the match starts, counting from the start of the genome
+    size_t steps = 0;   // suffix links followed (FM-index: backward search steps) on the way
+};
+using Fragment = std::basic_string_view<unsigned char>;
+
+// the best match of one fragment over the chronosomes so far
+struct Best{
+    size_t offset = 0;  // where the match starts in FragmentSet::codes (on the forward strand)
+    int length = 0;
+    size_t where = 0;   // a place where the match occurs (the first with sam), counting from the start of the genome
+    bool reverse = false;   // the match is on the reverse complement of the fragment
+};
+
+/**
+ * Error out if somehow there is a letter that is not IUPAC
+ */
+inline void error(char ch){
+    std::cout << "got '" << ch << "', which is not an IUPAC letter (ACGTURYSWKMBDHVN)" << '\n';
+    std::cout << "Exiting" << '\n';
+    exit(-1);
+}
+
+/**
+ * Error out on a letter of the genome that is not IUPAC
+ */
+inline void badLetter(char ch, size_t line){
+    std::cout << "[genome file]\n"
+              << "Line: " << line << '\n';
+    error(ch);
+}
+
+/**
+ * Use suffix automaton to find the longest match of one fragment in the current chronosome (header)
+ * input : the fragment and where the automaton's string starts in the genome
+ * output: the match
+ */
+inline Found bestMatch(const SuffixAutomaton& sam, Fragment fragment, size_t base){
+    int cur = 0, l = 0, end = 0, maxLen = 0, found = 0;
+    size_t steps = 0;
+    for (int j = 0; j < int(fragment.size()); ++j){
+        int k = fragment[j];
+        while(cur && sam.next(cur, k) == 0){
+            cur = sam[cur].link;
+            l = sam[cur].len;
+            ++steps;
+        }
+        if (int to = sam.next(cur, k)){
+            cur = to;
+            if (++l > maxLen){
+                end = j;
+                maxLen = l;
+                found = sam.firstEnd(cur); // every string of a state ends at the same places
+            }
+        }
+    }
+    return {end, maxLen, base + size_t(found - maxLen + 1), steps};
+}
+
+/**
+ * Use the FM-index to find the longest match of one fragment in the current chronosome (header)
+ * input : the fragment and where the index's text starts in the genome
+ * output: the match
+ */
+inline Found bestMatch(const FMIndex& fm, Fragment fragment, size_t base){
+    auto match = fm.longest(fragment);
+    return {match.end, match.length, base + match.where, match.steps};
+}
+
+/**
+ * Build the suffix automaton of a piece of the genome, starting another string at every cut
+ * so that no match runs into the next chromosome
+ */
+inline void build(SuffixAutomaton& sam, const std::vector<unsigned char>& chromosome, const std::vector<size_t>& cuts){
+    sam.reserve(chromosome.size());
+    auto cut = cuts.begin();
+    for (size_t i = 0; i < chromosome.size(); ++i){
+        for (; cut != cuts.end() && *cut == i; ++cut){
+            sam.separate();
+        }
+        sam.addLetter(chromosome[i]);
+    }
+}
+
+/**
+ * spell the reverse complement of a fragment into rc
+ */
+inline Fragment reverseComplement(Fragment fragment, std::vector<unsigned char>& rc){
+    rc.assign(fragment.rbegin(), fragment.rend());
+    for (auto& c : rc){
+        c = complement[c];
+    }
+    return {rc.data(), rc.size()};
+}
+
+/**
+ * keep a match of fragment i, or of its reverse complement, if it is longer than the best so far
+ * input : the fragments, which one, the match and whether it was of the reverse complement
+ * output: best, updated
+ */
+inline void improve(Best& best, const FragmentSet& fragments, size_t i, const Found& found, bool reverse){
+    if (found.length <= best.length){
+        return;
+    }
+    size_t offset = reverse ? fragments[i].size() - size_t(found.end) - 1 // letters end..end-length+1 of the fragment, backwards
+                            : size_t(found.end - found.length + 1);
+    best = {fragments.offsets[i] + offset, found.length, found.where, reverse};
+}
+
+/**
+ * Match fragment i against the current chronosome (header): the fragment, then with both_strands
+ * its reverse complement, which only replaces the match if it finds a longer one
+ * input : the fragments, which one, a buffer for the reverse complement and the query (Fragment -> Found)
+ * output: best, updated
+ */
+template<class Query>
+void matchStrands(const FragmentSet& fragments, size_t i, bool both_strands, std::vector<unsigned char>& rc,
+                  Best& best, Query&& query){
+    auto fragment = fragments[i];
+    improve(best, fragments, i, query(fragment), false);
+    if (both_strands){
+        improve(best, fragments, i, query(reverseComplement(fragment, rc)), true);
+    }
+}
+
+/**
+ * append the output line of fragment i, NUM,MATCH,CHRONOSOME,START,END[,STRAND], to out
+ * (MATCH as it reads in the genome; the last 3 are empty if nothing matched)
+ * input : the fragments, which one, its best match and the chromosomes of the genome
+ */
+inline void appendAnswer(std::string& out, const FragmentSet& fragments, size_t i, const Best& best,
+                         const std::vector<reference_index::Chromosome>& chroms, bool both_strands){
+    auto number = [&](auto n){
+        char digits[24];
+        out.append(digits, std::to_chars(digits, digits + sizeof(digits), n).ptr);
+    };
+    number(fragments.ids[i]);
+    out += ',';
+    for (int j = 0; j < best.length; ++j){
+        out += best.reverse ? letters[complement[fragments.codes[best.offset + size_t(best.length - 1 - j)]]]
+                            : letters[fragments.codes[best.offset + size_t(j)]];
+    }
+    out += ',';
+    if (best.length > 0){
+        auto chrom = std::upper_bound(chroms.begin(), chroms.end(), best.where, [](size_t where, const auto& c){
+            return where < c.start;
+        }) - 1;
+        size_t start = best.where - chrom->start;
+        out += chrom->name;
+        out += ',';
+        number(start);
+        out += ',';
+        number(start + size_t(best.length));
+    }else{
+        out += ',';
+    }
+    if (both_strands){
+        out += best.length == 0 ? "," : best.reverse ? ",-" : ",+";
+    }
+    out += '\n';
+}
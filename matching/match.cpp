@@ -5,157 +5,1344 @@
 #include <cstring>
 #include <chrono>
 #include <vector>
+#include <atomic>
+#include <thread>
+#include <charconv>
+#include <sstream>
+#include <map>
+#include <type_traits>
+#include "../common/fragment_index.hpp"
+#include "../common/gzip_input.hpp"
+#include "../common/fasta_reader.hpp"
+#include "../common/stats.hpp"
+#include "suffix_automaton.hpp"
+#include "fm_index.hpp"
+#include "fragment_set.hpp"
+#include "reference_index.hpp"
+#include "server.hpp"
+#include "longest_match.hpp"
 
 // print usage
 void usage(){
-    std::cout << "USAGE: match <genome-file> <fragments-file> <output-file>\n"
+    std::cout << "USAGE: match [--fasta=<query-genome>] [--engine sam|fm|stream] [--huge-pages] [--threads N] [--whole-genome] [--both-strands] [--top-k K] [--min-len L] [--mismatches K] [--window W] [--stats=json] <genome-file> <fragments-file> <output-file>\n"
+              << "       match index [--huge-pages] [--whole-genome] <genome-file> [<index-file>]\n"
+              << "       match serve [--engine sam|fm] [--huge-pages] [--threads N] [--both-strands] [--socket=<path>] <genome-file>\n"
+              << "       match client --socket=<path> [--batch N] <fragments-file> <output-file>\n"
               << "It finds the longest common substring for each fragment in <fragments-file> with all the chronosomes in <genome-file>\n"
-              << "the input file should not have letters other than 'A', 'T', 'C', 'G', 'N', 'W'.\n"
-              << "The maximum length for each chronosome (header) is 25,000,000. It will crash with an error message if it goes over that\n"
+              << "the input file should only have IUPAC letters (A, C, G, T, U, R, Y, S, W, K, M, B, D, H, V, N).\n"
+              << "Each letter only matches itself: an N in a fragment matches an N in the genome.\n"
+              << "Each chronosome (header) needs about 72 bytes of memory per base while it is being matched.\n"
               << "\n"
               << "All 3 files are required.\n"
               << "\n"
               << "<genome-file> must follow the following format (multiple separated headers are OK):\n"
               << "  >HEADER\n"
               << "  Sequence Starts Here\n"
+              << "It may be gzip compressed (.fna.gz); BGZF files (bgzip) are decompressed on several threads.\n"
               << "\n"
               << "<fragments-file> must follows the following format for each line: \n"
-              << "  NUM,FRAGMENT\n"
+              << "  NUM,FRAGMENT[,...]\n"
+              << "(anything after the fragment, such as the enzymes written by digestFragment, is ignored)\n"
+              << "or be a binary fragment index written by digestFragment --format=index. If the index was made\n"
+              << "without --packed, pass the genome it was digested from as --fasta=<query-genome>.\n"
               << "\n"
-              << "To save the output as a csv file, enter something like output.csv for <output-file>\n\n";
+              << "--engine fm matches with an FM-index instead of the suffix automaton (--engine sam, the default).\n"
+              << "  It needs about 1 byte per base once built (about 6 while building) instead of 72, so whole\n"
+              << "  human chronosomes fit in a few hundred MB. The matches are the same;\n"
+              << "  START and END are one place the match occurs, not necessarily the first.\n"
+              << "--engine stream builds one automaton over all the fragments instead and streams the genome\n"
+              << "  through it once, so memory follows the fragments (about 80 bytes per fragment base) however\n"
+              << "  large the genome is. The matches are chosen like --whole-genome.\n"
+              << "--both-strands also matches the reverse complement of every fragment in the same pass.\n"
+              << "  A STRAND column is added: + if the fragment gave the best match, - if its reverse complement did\n"
+              << "  (MATCH is then the reverse complement, as it reads in the genome).\n"
+              << "--top-k K and --min-len L list every place in the genome of the K longest different maximal\n"
+              << "  matches of each fragment (all of them without --top-k), of at least L letters (1 without --min-len).\n"
+              << "  A maximal match is the longest match ending at a letter of the fragment that the next letter\n"
+              << "  does not extend. They imply --whole-genome and each line of the output is instead\n"
+              << "  NUM,MATCH,CHRONOSOME,START,END,RANK,OCCURRENCES[,STRAND]\n"
+              << "  with one line per place; fragments without such a match get no line.\n"
+              << "--mismatches K finds the longest stretch of each fragment that occurs with at most K letters\n"
+              << "  substituted instead (--engine sam or fm). MATCH is then the stretch as it is in the fragment,\n"
+              << "  and the genome has it at [START, END) with up to K letters different. It takes longer the\n"
+              << "  larger K is; 1 to 3 is what it is meant for.\n"
+              << "--window W builds the automaton of a chronosome longer than W letters (the whole genome with\n"
+              << "  --whole-genome) a window of W letters at a time instead, each thread (--threads) building and\n"
+              << "  matching windows of its own, so memory follows W (about 72 bytes per letter for each thread) and\n"
+              << "  the building is spread over the threads.\n"
+              << "  The windows overlap by the longest fragment, so the matches are the same (with --mismatches,\n"
+              << "  START and END may be another place just as good). Chronosomes too long for one automaton,\n"
+              << "  about a billion letters, are always split into windows that long.\n"
+              << "--huge-pages backs the automaton with 2 MiB pages where the system allows it.\n"
+              << "--threads N matches the fragments against each chronosome with N threads.\n"
+              << "--whole-genome builds one automaton over all the chronosomes instead of one per chronosome.\n"
+              << "  It is one pass over the fragments, but needs about 72 bytes per base of the whole genome.\n"
+              << "--stats=json writes statistics of the run to stderr as one JSON object once it is done: seconds\n"
+              << "  spent parsing the input, building, querying and writing the output; the letters, states and\n"
+              << "  clones of every automaton (bytes of every FM-index); suffix links followed per fragment letter\n"
+              << "  (search steps for fm and --mismatches); bytes read and written, and the peak resident set.\n"
+              << "  Streaming the genome counts as querying, and so does writing the --top-k lines.\n"
+              << "\n"
+              << "match index builds the automata of <genome-file> once and saves them to <index-file>\n"
+              << "(<genome-file>.sami by default), about 72 bytes per base. Give that file as <genome-file>\n"
+              << "to later runs and they map it instead of building the automata again.\n"
+              << "\n"
+              << "match serve loads <genome-file> once (one automaton or FM-index over the whole genome, or the\n"
+              << "reference index as it is) and answers batches of fragments until stopped, N (--threads, all the\n"
+              << "cores by default) at a time. It listens at the Unix domain socket <path>, or reads the requests\n"
+              << "from stdin and writes the answers to stdout without --socket. A request is\n"
+              << "  BATCH <id> <count>\n"
+              << "followed by <count> lines of the fragments file; the answer is\n"
+              << "  RESULT <id> <count> <microseconds>\n"
+              << "followed by <count> lines of output (or ERROR <id> <message>). Answers may come in any order.\n"
+              << "match client sends <fragments-file> to a server N fragments at a time (1000 by default),\n"
+              << "writes the answers to <output-file> and prints the latency of the batches.\n"
+              << "\n"
+              << "To save the output as a csv file, enter something like output.csv for <output-file>\n"
+              << "Each line of the output is\n"
+              << "  NUM,MATCH,CHRONOSOME,START,END[,STRAND]\n"
+              << "where [START, END) of CHRONOSOME, counting from 0, is a place where the match occurs in the genome\n"
+              << "(the last 3 are empty if nothing matched). --engine sam (or a reference index) gives the first\n"
+              << "such place, also with --window; --engine fm and stream, and --mismatches, give one of them.\n\n";
 }
 
 /**
- * Error out if somehow there is a letter other than "ATCGNW"
+ * global variables (for the sake of speed & simplicity)
  */
-void error(char ch){
-    std::cout << "got '" << ch << "', which is not supported (ATCGNW)" << '\n';
-    std::cout << "Exiting" << '\n';
-    exit(-1);
+int idx[128];
+const fasta::Alphabet alphabet{letters}; // the genome is read straight into symbol codes
+std::vector<Best> ans;
+int threads = 1;
+bool both_strands = false;
+int mismatches = 0; // --mismatches K
+size_t window = 0;  // --window W, 0 for one automaton per chronosome
+
+// --stats=json
+stats::Phases phases;
+std::atomic<uint64_t> queried{0}, fallbacks{0}; // letters walked in solve() and suffix links (or FM-index steps) taken
+struct Built{
+    size_t base = 0;        // where its string starts in the genome
+    size_t letters = 0;
+    long states = -1;       // -1 for an FM-index
+    long clones = -1;       // -1 if not known (a reference index)
+    size_t bytes = 0;
+};
+std::vector<Built> built;
+
+Built measure(const SuffixAutomaton& sam, size_t base, size_t letters, bool counted = true){
+    return {base, letters, sam.size(), counted ? sam.clones() : -1,
+            size_t(sam.size()) * (sizeof(SuffixAutomaton::Node) + sizeof(int))
+            + size_t(sam.overflowSize()) * sizeof(SuffixAutomaton::Edge)};
+}
+
+void record(const SuffixAutomaton& sam, size_t base, size_t letters, bool counted = true){
+    built.push_back(measure(sam, base, letters, counted));
 }
 
 /**
- * global variables (for the sake of speed & simplicity)
+ * --mismatches K: the longest stretch of one fragment that occurs in the current chronosome (header)
+ * with at most K letters substituted, the first one in the fragment if there are several.
+ * Bounded backtracking on the automaton: from a start in the fragment the exact
+ * walk goes as far as it can, then, from the deepest letter back, every other
+ * letter the automaton has in its place is tried for one substitution, and so
+ * on, cutting every branch that cannot beat the best so far.
+ * The cuts come from how far the fragment reaches from each letter. loose(k, i)
+ * adds up exact runs and substituted letters from i, which is cheap but can be
+ * far off; where that does not cut a branch, exact(k, i), the longest stretch
+ * from i with k substitutions, is searched for the same way (once, on demand)
+ * and tried as well. The starts are tried best bound first.
  */
-int idx[128];
-std::vector<std::pair<int, std::string>> ans;
+class Approximate{
+public:
+    Approximate(const SuffixAutomaton& sam, Fragment fragment) : sam(sam), fragment(fragment), n(int(fragment.size())){}
+
+    Found run(size_t base){
+        size_t rows = size_t(mismatches + 1) * size_t(n + 1);
+        loosest.assign(rows, 0);
+        known.assign(rows, -1);
+        // loose(0, i) is the longest exact match from i. The longest one ending
+        // at j starts at j - ending + 1, which never goes down as j goes up
+        std::vector<int> ending(fragment.size());
+        for (int j = 0, cur = 0, l = 0; j < n; ++j){
+            int k = fragment[size_t(j)];
+            while(cur && sam.next(cur, k) == 0){
+                cur = sam[cur].link;
+                l = sam[cur].len;
+            }
+            if (int to = sam.next(cur, k)){
+                cur = to;
+                ++l;
+            }
+            ending[size_t(j)] = l;
+        }
+        for (int i = 0, j = 0; i < n; ++i){
+            while(j < n && j - ending[size_t(j)] + 1 <= i){
+                ++j;
+            }
+            loose(0, i) = j - i;
+        }
+        // an exact run, one substituted letter and the best with one substitution less from there on
+        for (int k = 1; k <= mismatches; ++k){
+            for (int i = 0; i < n; ++i){
+                loose(k, i) = std::min(n - i, loose(0, i) + 1 + loose(k - 1, std::min(n, i + loose(0, i) + 1)));
+            }
+        }
+        paths.resize(size_t(mismatches + 1));
+
+        std::vector<int> starts(fragment.size());
+        for (int i = 0; i < n; ++i){
+            starts[size_t(i)] = i;
+        }
+        std::stable_sort(starts.begin(), starts.end(), [&](int a, int b){ return loose(mismatches, a) > loose(mismatches, b); });
+        now = {};
+        now.last = true;
+        now.enough = n + 1;
+        for (int i : starts){
+            if (loose(mismatches, i) < now.length){
+                break;
+            }
+            now.start = i;
+            if (loose(mismatches, i) < needed()){
+                continue;
+            }
+            if (mismatches > 1){ // one substitution less, then the exact run; or the other way around
+                int exact_run = loose(0, i), fewer = exact(mismatches - 1, i);
+                if (std::min(exact_run + 1 + exact(mismatches - 1, std::min(n, i + exact_run + 1)),
+                             fewer + 1 + loose(0, std::min(n, i + fewer + 1))) < needed()){
+                    continue;
+                }
+            }
+            extend(0, i, mismatches, 0);
+        }
+        if (now.length == 0){
+            return {0, 0, 0, steps};
+        }
+        return {now.bestStart + now.length - 1, now.length, base + size_t(sam.firstEnd(now.bestState) - now.length + 1), steps};
+    }
+
+private:
+    // one search from one start
+    struct Search{
+        bool last = false;  // the search for the answer, not for an exact(k, i)
+        int start = 0;
+        int enough = 0;     // stop once length gets here
+        int length = 0, bestStart = 0, bestState = 0;
+    };
+
+    const SuffixAutomaton& sam;
+    Fragment fragment;
+    int n;
+    std::vector<int> loosest, known;        // loose(k, i) and exact(k, i) (-1 until searched), row k of n + 1
+    std::vector<std::vector<int>> paths;    // the states of the exact walk for each number of substitutions left
+    Search now;
+    size_t steps = 0;
+
+    int& loose(int k, int i){
+        return loosest[size_t(k) * size_t(n + 1) + size_t(i)];
+    }
+
+    // the longest stretch starting at letter i with at most k substitutions
+    int exact(int k, int i){
+        if (k == 0 || i == n){
+            return loose(0, i);
+        }
+        int& found = known[size_t(k) * size_t(n + 1) + size_t(i)];
+        if (found < 0){
+            Search outer = now; // this runs in the middle of another search, which only uses paths[k + 1, ...]
+            now = {};
+            now.start = i;
+            now.length = exact(k - 1, i);
+            now.enough = loose(k, i);
+            if (i + 1 < n && known[size_t(k) * size_t(n + 1) + size_t(i) + 1] >= 0){ // one more than from the next letter at most
+                now.enough = std::min(now.enough, known[size_t(k) * size_t(n + 1) + size_t(i) + 1] + 1);
+            }
+            if (now.length < now.enough){
+                extend(0, i, k, 0);
+            }
+            found = now.length;
+            now = outer;
+        }
+        return found;
+    }
+
+    // the length a stretch from the current start has to reach: longer than the best, or as long if it starts earlier
+    int needed() const {
+        return now.length + (now.last && now.length > 0 && now.start < now.bestStart ? 0 : 1);
+    }
+
+    // follow the fragment from letter j on in state cur, done is the length so far and k the substitutions left
+    void extend(int cur, int j, int k, int done){
+        auto& path = paths[size_t(k)];
+        path.clear();
+        path.push_back(cur);
+        int from = j;
+        for (; j < n; ++j){
+            ++steps;
+            int to = sam.next(cur, fragment[size_t(j)]);
+            if (to == 0){
+                break;
+            }
+            cur = to;
+            path.push_back(cur);
+        }
+        if (done + j - from >= needed()){
+            now.length = done + j - from;
+            now.bestStart = now.start;
+            now.bestState = cur;
+        }
+        for (int p = std::min(j, n - 1); k > 0 && p >= from && now.length < now.enough; --p){
+            int before = done + p - from;
+            if (before + 1 + loose(k - 1, p + 1) < needed() || before + 1 + exact(k - 1, p + 1) < needed()){
+                continue;
+            }
+            for (int c = 0; c < SuffixAutomaton::sigma; ++c){
+                if (c == fragment[size_t(p)]){
+                    continue;
+                }
+                ++steps;
+                if (int to = sam.next(paths[size_t(k)][size_t(p - from)], c)){
+                    extend(to, p + 1, k - 1, before + 1);
+                }
+            }
+        }
+    }
+};
+
+Found approximateMatch(const SuffixAutomaton& sam, Fragment fragment, size_t base){
+    return Approximate{sam, fragment}.run(base);
+}
 
 /**
- * Suffix Automaton Section
- * This runs in linear time O(N)
+ * --mismatches K with the FM-index (see FMIndex::longestWithin)
  */
-constexpr static int maxn = 5e7; // Maximum amount of states
-int to[maxn][6];           // Transitions
-int link[maxn];            // Suffix links
-int len[maxn];             // Lengthes of largest strings in states
-int last = 0;              // State corresponding to the whole string
-int sz = 1;                // Current amount of states
+Found approximateMatch(const FMIndex& fm, Fragment fragment, size_t base){
+    auto match = fm.longestWithin(fragment, mismatches);
+    return {match.end, match.length, base + match.where, match.steps};
+}
 
-void addLetter (int c){   // Adding character to the end
-    if (sz == maxn){
-        std::cout << "Sorry - too many characters in one header leading to its crash.\n";
-        exit(-1);
+/**
+ * Streaming-genome mode (--engine stream): the automaton is built over all the
+ * fragments instead, and the genome is streamed through it once, so memory
+ * follows the fragments and not the chromosomes. Every state remembers the
+ * longest of its strings met in the genome and where that ended.
+ */
+struct StreamedGenome{
+    const SuffixAutomaton& sam;
+    std::vector<int> seen;          // longest string of each state found in the genome, 0 for none
+    std::vector<size_t> seenEnd;    // where its last letter is, counting from the start of the genome
+};
+
+/**
+ * the states of an automaton from the shortest to the longest (a counting sort), so the root comes first
+ * and every state comes after its suffix link
+ */
+std::vector<int> statesByLength(const SuffixAutomaton& sam){
+    int longest = 0;
+    for (int v = 0; v < sam.size(); ++v){
+        longest = std::max(longest, sam[v].len);
     }
-    int p = last;          // State of string s
-    last = sz++;           // Create state for string sc
-    len[last] = len[p] + 1;
-    for (; to[p][c] == 0; p = link[p]){
-        to[p][c] = last;  // Jumps which add new suffixes
+    std::vector<int> order(size_t(sam.size())), bucket(size_t(longest) + 2, 0);
+    for (int v = 0; v < sam.size(); ++v){
+        ++bucket[size_t(sam[v].len) + 1];
     }
-    if(to[p][c] == last){ // This is the first occurrence of c
-        link[last] = 0;
-        return;
+    for (size_t b = 1; b < bucket.size(); ++b){
+        bucket[b] += bucket[b - 1];
     }
-    int q = to[p][c];
-    if(len[q] == len[p] + 1){
-        link[last] = q;
-        return;
+    for (int v = 0; v < sam.size(); ++v){
+        order[size_t(bucket[size_t(sam[v].len)]++)] = v;
     }
-    // We split off cl from q here
-    int cl = sz++;
-    memcpy(to[cl], to[q], sizeof(to[cl]));
-    link[cl] = link[q];
-    len[cl] = len[p] + 1;
-    link[last] = link[q] = cl;
-    for (; to[p][c] == q; p = link[p]){
-        to[p][c] = cl; // Redirect transitions where needed
+    return order;
+}
+
+/**
+ * Find the longest match of one fragment in the genome streamed through the fragments' automaton.
+ * The fragment is walked through the automaton again; at each letter the
+ * suffix ending there is cut back, down the suffix links, until the genome
+ * has seen it.
+ * input : the fragment
+ * output: the match
+ */
+Found bestMatch(const StreamedGenome& genome, Fragment fragment, size_t){
+    const auto& sam = genome.sam;
+    int cur = 0, l = 0, end = 0, maxLen = 0;
+    size_t found = 0, steps = 0;
+    for (int j = 0; j < int(fragment.size()); ++j){
+        cur = sam.next(cur, fragment[j]); // always there, the fragment is in the automaton
+        ++l;
+        while(l > genome.seen[cur]){
+            if (genome.seen[cur] > 0){ // a shorter string of the same state was seen
+                l = genome.seen[cur];
+                break;
+            }
+            cur = sam[cur].link;
+            l = sam[cur].len;
+            ++steps;
+        }
+        if (l > maxLen){
+            end = j;
+            maxLen = l;
+            found = genome.seenEnd[cur] + 1 - size_t(l); // every string of a state ends at the same places
+        }
     }
+    return {end, maxLen, found, steps};
 }
 
 /**
- * convert a string to uppercase
- * input : string s
- * output: string s in uppercase
+ * the best match of one fragment: exact, or with up to --mismatches substitutions
  */
-std::string str_toupper(std::string s) {
-    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c){ return std::toupper(c);});
-    return s;
+template<class Engine>
+Found bestOf(const Engine& engine, Fragment fragment, size_t base){
+    if constexpr (!std::is_same_v<Engine, StreamedGenome>){
+        if (mismatches > 0){
+            return approximateMatch(engine, fragment, base);
+        }
+    }
+    return bestMatch(engine, fragment, base);
 }
 
 /**
- * Use suffix automaton to find the best match for the current chronosome (header)
- * input : fragment file
- * output: the best match for each fragment
+ * Find the best match of every fragment for the current chronosome (header).
+ * The automaton (or FM-index) is read-only by now, so with several threads they keep
+ * grabbing small runs of fragments from a shared counter until all are done;
+ * a thread that drew short fragments simply comes back for more. Every
+ * fragment has its own slot in best, so no locking is needed and the answers
+ * are the same as with one thread.
+ * With --both-strands each thread spells the reverse complement of the
+ * fragment into its own buffer and queries that right after the fragment.
+ * input : the fragments, where the automaton's string starts in the genome and how many threads to use
+ * output: the best match for each fragment, in best
  */
-void solve(std::ifstream& frag){
-    std::string line;
-    int count = 0;
-
-    // find the longest match for each fragment
-    while(std::getline(frag, line)){ // fragments should be all upper case now
-        auto comma = line.find(",");
-        int index = std::stoi(line.substr(0, comma));
-        line = line.substr(comma + 1);
-
-        int cur = 0, l = 0, end = 0, maxLen = 0;
-        for (int i = 0; i < int(line.size()); ++i){
-            int a = int(line[i]);
-            if (idx[a] == -1){
-                std::cout << "[fragment file]\n"
-                          << "Line: " << count << " with an index of " << index << " with line\n"
-                          << line << '\n';
-                error(line[i]);
-            }
-            int k = idx[a];
-            while(cur && to[cur][k] == 0){
-                cur = link[cur];
-                l = len[cur];
-            }
-            if (to[cur][k]){
-                cur = to[cur][k];
-                if (++l > maxLen){
-                    end = i;
-                    maxLen = l;
+template<class Engine>
+void solve(const Engine& engine, const FragmentSet& fragments, size_t base, std::vector<Best>& best, int workers){
+    constexpr size_t grab = 32;
+    std::atomic<size_t> claimed{0};
+    auto worker = [&]{
+        std::vector<unsigned char> rc;
+        uint64_t letters = 0, steps = 0;
+        for (size_t from; (from = claimed.fetch_add(grab)) < fragments.size();){
+            size_t to = std::min(fragments.size(), from + grab);
+            for (size_t i = from; i < to; ++i){
+                matchStrands(fragments, i, both_strands, rc, best[i], [&](Fragment fragment){
+                    Found found = bestOf(engine, fragment, base);
+                    letters += fragment.size();
+                    steps += found.steps;
+                    return found;
+                });
+            }
+        }
+        queried += letters;
+        fallbacks += steps;
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < workers; ++t){
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& th : pool){
+        th.join();
+    }
+}
+
+/**
+ * --window W: find the best match of every fragment for a chronosome (or the whole genome)
+ * too long to build at once, a window at a time.
+ * The windows are W letters long (at least twice the longest fragment) and each starts the longest fragment less one letter
+ * before the one before it ends, so every match lies whole in some window and none is
+ * lost. Each thread builds the automaton of one window after another and matches all
+ * the fragments against it, so the builds run on all the threads and memory follows W
+ * (about 72 bytes per letter for each thread) rather than the chronosome.
+ * A thread keeps the best match of every fragment over its windows: the longest, then
+ * the one ending first in the fragment, then the first in the genome. That order does
+ * not depend on which thread saw what, and what comes out on top is what one automaton
+ * over the whole piece would have found; with --mismatches it is as long and where in
+ * the fragment, but may be another place in the genome with as few substitutions.
+ * input : the piece as readGenome hands it over and the fragments
+ * output: the best match for each fragment, in best, as solve() does
+ */
+void solveWindows(const std::vector<unsigned char>& chromosome, size_t base, const std::vector<size_t>& cuts,
+                  const FragmentSet& fragments, std::vector<Best>& best, bool huge_pages){
+    size_t longest = 1;
+    for (size_t i = 0; i < fragments.size(); ++i){
+        longest = std::max(longest, fragments[i].size());
+    }
+    size_t overlap = longest - 1;
+    size_t length = std::min(SuffixAutomaton::maxLetters, std::max(window > 0 ? window : SuffixAutomaton::maxLetters, 2 * overlap + 1));
+    if (length <= overlap){
+        std::cerr << "Failed to split the genome into windows: a fragment of " << longest << " letters does not fit in one automaton\n";
+        std::cerr << "Exiting..." << '\n';
+        exit(-1);
+    }
+    size_t stride = length - overlap;
+    size_t count = chromosome.size() <= length ? 1 : (chromosome.size() - overlap + stride - 1) / stride;
+    int workers = int(std::min<size_t>(size_t(threads), count));
+
+    struct Place{
+        int end = 0;
+        int length = 0;
+        size_t where = 0;
+        bool operator<(const Place& other) const { // better
+            return length != other.length ? length > other.length : end != other.end ? end < other.end : where < other.where;
+        }
+    };
+    // per thread, the best of each fragment on each strand
+    std::vector<std::vector<Place>> forward(static_cast<size_t>(workers)), backward(static_cast<size_t>(workers));
+    std::vector<Built> windows(count);
+    std::vector<double> building(static_cast<size_t>(workers)), querying(static_cast<size_t>(workers));
+    std::atomic<size_t> claimed{0};
+    auto started = stats::Clock::now();
+    auto worker = [&](int t){
+        SuffixAutomaton sam{huge_pages};
+        std::vector<unsigned char> text, rc;
+        std::vector<size_t> inside;
+        auto& fwd = forward[size_t(t)];
+        auto& bwd = backward[size_t(t)];
+        fwd.assign(fragments.size(), {});
+        bwd.assign(both_strands ? fragments.size() : 0, {});
+        uint64_t letters = 0, steps = 0;
+        auto keep = [&](Place& kept, const Found& found){
+            Place place{found.end, found.length, found.where};
+            steps += found.steps;
+            if (place < kept){
+                kept = place;
+            }
+        };
+        for (size_t w; (w = claimed.fetch_add(1)) < count;){
+            auto t1 = stats::Clock::now();
+            size_t start = w * stride, end = std::min(chromosome.size(), start + length);
+            text.assign(chromosome.begin() + long(start), chromosome.begin() + long(end));
+            inside.clear();
+            for (auto cut = std::upper_bound(cuts.begin(), cuts.end(), start); cut != cuts.end() && *cut < end; ++cut){
+                inside.push_back(*cut - start);
+            }
+            build(sam, text, inside);
+            windows[w] = measure(sam, base + start, text.size());
+            auto t2 = stats::Clock::now();
+            for (size_t i = 0; i < fragments.size(); ++i){
+                auto fragment = fragments[i];
+                keep(fwd[i], bestOf(sam, fragment, base + start));
+                letters += fragment.size();
+                if (!both_strands){
+                    continue;
                 }
+                keep(bwd[i], bestOf(sam, reverseComplement(fragment, rc), base + start));
+                letters += rc.size();
             }
+            building[size_t(t)] += stats::seconds(t1, t2);
+            querying[size_t(t)] += stats::seconds(t2, stats::Clock::now());
         }
+        queried += letters;
+        fallbacks += steps;
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < workers; ++t){
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& th : pool){
+        th.join();
+    }
 
-        // add to answer if better
-        const auto& [_, match] = ans[count];
-        if (maxLen > int(match.size())){
-            ans[count] = {index, line.substr(end - maxLen + 1, maxLen)};
+    // the best over all the windows, then into best like solve() does
+    for (size_t i = 0; i < fragments.size(); ++i){
+        Place fwd, bwd;
+        for (int t = 0; t < workers; ++t){
+            fwd = std::min(fwd, forward[size_t(t)][i]);
+            if (both_strands){
+                bwd = std::min(bwd, backward[size_t(t)][i]);
+            }
         }
-        ++count;
+        improve(best[i], fragments, i, {fwd.end, fwd.length, fwd.where, 0}, false);
+        improve(best[i], fragments, i, {bwd.end, bwd.length, bwd.where, 0}, true);
     }
+    built.insert(built.end(), windows.begin(), windows.end());
+    // the threads built and queried side by side, so the wall time is shared out between the two
+    double wall = stats::seconds(started, stats::Clock::now());
+    double build_seconds = 0, query_seconds = 0;
+    for (int t = 0; t < workers; ++t){
+        build_seconds += building[size_t(t)];
+        query_seconds += querying[size_t(t)];
+    }
+    double busy = std::max(build_seconds + query_seconds, 1e-9);
+    phases.add("build", wall * build_seconds / busy);
+    phases.add("query", wall * query_seconds / busy);
+}
 
-    // rewind
-    frag.clear();
-    frag.seekg(0);
+/**
+ * --top-k / --min-len: every place the longest maximal matches of each fragment occur.
+ * A maximal match is the longest match ending at some letter of the fragment
+ * that the next letter does not extend.
+ */
+struct Candidate{
+    int end = 0;            // last letter of the match in the fragment (or its reverse complement)
+    int length = 0;
+    size_t lo = 0, hi = 0;  // the automaton state holding the match, or the FM-index rows
+    bool reverse = false;
 };
 
+/**
+ * The tree of suffix links of a whole-genome automaton, for listing where a state's strings end:
+ * the ends are the firstpos of the states made for a letter in its subtree,
+ * plus the ends it shares (see SuffixAutomaton::sharedEnds)
+ */
+struct SuffixLinkTree{
+    const SuffixAutomaton& sam;
+    std::vector<int> childStart, children;  // children of v are children[childStart[v], childStart[v + 1])
+    std::vector<int> sharedStart, shared;   // likewise, ends of v that have no state of their own
+    std::vector<size_t> count;              // how many places the strings of each state end at
+
+    explicit SuffixLinkTree(const SuffixAutomaton& automaton) : sam(automaton){
+        size_t n = size_t(sam.size());
+        childStart.assign(n + 1, 0);
+        for (int v = 1; v < sam.size(); ++v){
+            ++childStart[size_t(sam[v].link) + 1];
+        }
+        sharedStart.assign(n + 1, 0);
+        for (const auto& [v, pos] : sam.sharedEnds()){
+            ++sharedStart[size_t(v) + 1];
+        }
+        for (size_t v = 0; v < n; ++v){
+            childStart[v + 1] += childStart[v];
+            sharedStart[v + 1] += sharedStart[v];
+        }
+        children.resize(n);
+        shared.resize(sam.sharedEnds().size());
+        auto fill = childStart, fillShared = sharedStart;
+        for (int v = 1; v < sam.size(); ++v){
+            children[size_t(fill[size_t(sam[v].link)]++)] = v;
+        }
+        for (const auto& [v, pos] : sam.sharedEnds()){
+            shared[size_t(fillShared[size_t(v)]++)] = pos;
+        }
+        count.assign(n, 0);
+        auto order = statesByLength(sam);
+        for (size_t o = n; o-- > 0;){
+            int v = order[o];
+            count[size_t(v)] += size_t(sam[v].own) + size_t(sharedStart[size_t(v) + 1] - sharedStart[size_t(v)]);
+            if (v > 0){
+                count[size_t(sam[v].link)] += count[size_t(v)];
+            }
+        }
+    }
+};
+
+// maximal matches of one fragment in the automaton
+void maximalMatches(const SuffixLinkTree& tree, Fragment fragment, bool reverse, std::vector<Candidate>& out){
+    const auto& sam = tree.sam;
+    std::vector<int> length(fragment.size()), state(fragment.size());
+    int cur = 0, l = 0;
+    for (size_t j = 0; j < fragment.size(); ++j){
+        int k = fragment[j];
+        while(cur && sam.next(cur, k) == 0){
+            cur = sam[cur].link;
+            l = sam[cur].len;
+        }
+        if (int to = sam.next(cur, k)){
+            cur = to;
+            ++l;
+        }
+        length[j] = l;
+        state[j] = cur;
+    }
+    for (size_t j = 0; j < fragment.size(); ++j){
+        if (length[j] > 0 && (j + 1 == fragment.size() || length[j + 1] != length[j] + 1)){
+            out.push_back({int(j), length[j], size_t(state[j]), 0, reverse});
+        }
+    }
+}
+
+// maximal matches of one fragment in the FM-index
+void maximalMatches(const FMIndex& fm, Fragment fragment, bool reverse, std::vector<Candidate>& out){
+    std::vector<int> length;
+    std::vector<FMIndex::Range> rows;
+    fm.longestEndingAt(fragment, length, rows);
+    for (size_t j = 0; j < fragment.size(); ++j){
+        if (length[j] > 0 && (j + 1 == fragment.size() || length[j + 1] != length[j] + 1)){
+            out.push_back({int(j), length[j], rows[j].lo, rows[j].hi, reverse});
+        }
+    }
+}
+
+size_t occurrences(const SuffixLinkTree& tree, const Candidate& match){
+    return tree.count[match.lo];
+}
+
+size_t occurrences(const FMIndex&, const Candidate& match){
+    return match.hi - match.lo;
+}
+
+// call place(where) for every place the match starts in the genome, walking the state's subtree
+template<class Place>
+void forEachPlace(const SuffixLinkTree& tree, const Candidate& match, Place&& place){
+    std::vector<int> stack{int(match.lo)};
+    while(!stack.empty()){
+        int v = stack.back();
+        stack.pop_back();
+        if (tree.sam[v].own){
+            place(size_t(tree.sam.firstEnd(v) - match.length + 1));
+        }
+        for (int e = tree.sharedStart[size_t(v)]; e < tree.sharedStart[size_t(v) + 1]; ++e){
+            place(size_t(tree.shared[size_t(e)] - match.length + 1));
+        }
+        for (int c = tree.childStart[size_t(v)]; c < tree.childStart[size_t(v) + 1]; ++c){
+            stack.push_back(tree.children[size_t(c)]);
+        }
+    }
+}
+
+template<class Place>
+void forEachPlace(const FMIndex& fm, const Candidate& match, Place&& place){
+    fm.forEachPlace({match.lo, match.hi}, place);
+}
+
+/**
+ * Write every place of the top_k longest distinct maximal matches of at least min_len letters
+ * of each fragment (top_k 0: all of them). Lines are written as the places are found, so
+ * a fragment that matches a repeat a million times costs no memory.
+ * input : the whole-genome engine, the fragments, the chromosomes and the limits
+ * output: NUM,MATCH,CHRONOSOME,START,END,RANK,OCCURRENCES[,STRAND] lines
+ */
+template<class Engine>
+void listMatches(const Engine& engine, const FragmentSet& fragments, const std::vector<reference_index::Chromosome>& chroms,
+                 std::ofstream& outfile, int top_k, int min_len){
+    std::vector<unsigned char> rc;
+    std::vector<Candidate> candidates, chosen;
+    std::string match;
+    for (size_t i = 0; i < fragments.size(); ++i){
+        auto fragment = fragments[i];
+        rc.assign(fragment.rbegin(), fragment.rend());
+        for (auto& c : rc){
+            c = complement[c];
+        }
+        auto spelled = [&](const Candidate& m){
+            return (m.reverse ? Fragment(rc.data(), rc.size()) : fragment).substr(size_t(m.end - m.length + 1), size_t(m.length));
+        };
+        candidates.clear();
+        maximalMatches(engine, fragment, false, candidates);
+        if (both_strands){
+            maximalMatches(engine, Fragment(rc.data(), rc.size()), true, candidates);
+        }
+        std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b){
+            return a.length > b.length;
+        });
+        chosen.clear();
+        for (const auto& m : candidates){
+            if (m.length < min_len || (top_k > 0 && int(chosen.size()) == top_k)){
+                break;
+            }
+            bool again = std::any_of(chosen.begin(), chosen.end(), [&](const Candidate& c){
+                return spelled(c) == spelled(m);
+            });
+            if (!again){
+                chosen.push_back(m);
+            }
+        }
+        for (size_t rank = 0; rank < chosen.size(); ++rank){
+            const auto& m = chosen[rank];
+            match.clear();
+            for (unsigned char c : spelled(m)){
+                match += letters[c];
+            }
+            size_t count = occurrences(engine, m);
+            forEachPlace(engine, m, [&](size_t where){
+                auto chrom = std::upper_bound(chroms.begin(), chroms.end(), where, [](size_t w, const auto& c){
+                    return w < c.start;
+                }) - 1;
+                size_t start = where - chrom->start;
+                outfile << fragments.ids[i] << "," << match << "," << chrom->name << "," << start << "," << start + size_t(m.length)
+                        << "," << rank + 1 << "," << count;
+                if (both_strands){
+                    outfile << "," << (m.reverse ? "-" : "+");
+                }
+                outfile << '\n';
+            });
+        }
+    }
+}
+
+/**
+ * write the best match of each fragment, a NUM,MATCH,CHRONOSOME,START,END[,STRAND] line each
+ * input : the fragments, their matches and the chromosomes of the genome
+ * output: the lines, in out
+ */
+void writeAnswers(std::ostream& out, const FragmentSet& fragments, const std::vector<Best>& best,
+                  const std::vector<reference_index::Chromosome>& chroms){
+    std::string lines;
+    for (size_t i = 0; i < fragments.size(); ++i){
+        appendAnswer(lines, fragments, i, best[i], chroms, both_strands);
+        if (lines.size() >= (1 << 16)){
+            out << lines;
+            lines.clear();
+        }
+    }
+    out << lines;
+}
+
+/**
+ * append one fragment to the set, checking its letters
+ * input : the set, its index, the fragment and its line number in the fragments file
+ * output: none, exits on a letter that is not IUPAC
+ */
+void addFragment(FragmentSet& fragments, int index, std::string_view fragment, int count){
+    fragments.add(index);
+    for (char ch : fragment){ // fragments should be all upper case now
+        int a = int((unsigned char)ch);
+        if (a >= 128 || idx[a] == -1){
+            std::cout << "[fragment file]\n"
+                      << "Line: " << count << " with an index of " << index << " with line\n"
+                      << fragment << '\n';
+            error(ch);
+        }
+        fragments.codes.push_back((unsigned char)idx[a]);
+    }
+}
+
+/**
+ * Read the genome a chronosome (header) at a time, or all of it at once
+ * input : the genome file, whether to read it all at once, and what to do with each piece read
+ *         (called with its letter codes, where it starts in the genome and where chromosomes
+ *         after the first begin in it)
+ * output: the chromosomes in the order of the genome file
+ */
+template<class Read>
+std::vector<reference_index::Chromosome> readGenome(std::istream& ref, bool whole_genome, Read&& piece){
+    std::vector<reference_index::Chromosome> chroms;
+    std::vector<unsigned char> chromosome;
+    std::vector<size_t> starts;     // where each chromosome starts, counting from the start of the genome
+    size_t read = 0;                // letters of the genome read so far
+    auto started = stats::Clock::now();
+    double laps = 0;                // seconds spent in piece, the rest is parsing
+    auto lap = [&](size_t base){    // base: where chromosome[0] is in the genome
+        auto t1 = stats::Clock::now();
+        std::vector<size_t> cuts;
+        for (auto next = std::upper_bound(starts.begin(), starts.end(), base); next != starts.end(); ++next){
+            cuts.push_back(*next - base);
+        }
+        piece(chromosome, base, cuts);
+        std::cout << "one lap finished... \n";
+        chromosome.clear();
+        laps += stats::seconds(t1, stats::Clock::now());
+    };
+    auto header = [&](std::string_view name){ // the name is the first word, like the FASTA id
+        if (!chroms.empty()){
+            if (!whole_genome){
+                lap(starts.back());
+            }
+            chroms.back().length = read - chroms.back().start;
+        }
+        chroms.push_back({std::string(name.substr(0, name.find_first_of(" \t"))), read, 0});
+        starts.push_back(read);
+    };
+    fasta::Reader{ref, &alphabet}.run(header, [&](std::basic_string_view<unsigned char> codes){
+        if (chroms.empty()){ // sequence before the first header
+            header("");
+        }
+        chromosome.insert(chromosome.end(), codes.begin(), codes.end());
+        read += codes.size();
+    }, badLetter);
+    if (chroms.empty()){
+        header("");
+    }
+    chroms.back().length = read - chroms.back().start;
+    lap(whole_genome ? 0 : starts.back()); // the last header, or all of them
+    phases.add("parse", stats::seconds(started, stats::Clock::now()) - laps);
+    return chroms;
+}
+
+/**
+ * Stream the genome through the automaton of the fragments (see StreamedGenome), one letter at a time
+ * input : the genome file and the automaton
+ * output: the chromosomes in the order of the genome file, and genome filled in
+ */
+std::vector<reference_index::Chromosome> streamGenome(std::istream& ref, StreamedGenome& genome){
+    const auto& sam = genome.sam;
+    genome.seen.assign(size_t(sam.size()), 0);
+    genome.seenEnd.assign(size_t(sam.size()), 0);
+    std::vector<reference_index::Chromosome> chroms;
+    size_t read = 0;                // letters of the genome read so far
+    int cur = 0, l = 0;
+    auto started = stats::Clock::now();
+    double walking = 0;             // seconds spent walking the automaton, the rest is parsing
+    auto header = [&](std::string_view name){ // the name is the first word, like the FASTA id
+        if (!chroms.empty()){
+            chroms.back().length = read - chroms.back().start;
+        }
+        chroms.push_back({std::string(name.substr(0, name.find_first_of(" \t"))), read, 0});
+        cur = l = 0; // no match runs into the next chromosome
+    };
+    fasta::Reader{ref, &alphabet}.run(header, [&](std::basic_string_view<unsigned char> codes){
+        if (chroms.empty()){ // sequence before the first header
+            header("");
+        }
+        auto t1 = stats::Clock::now();
+        for (int k : codes){
+            while(cur && sam.next(cur, k) == 0){
+                cur = sam[cur].link;
+                l = sam[cur].len;
+            }
+            if (int to = sam.next(cur, k)){
+                cur = to;
+                ++l;
+            }
+            if (l > genome.seen[size_t(cur)]){
+                genome.seen[size_t(cur)] = l;
+                genome.seenEnd[size_t(cur)] = read;
+            }
+            ++read;
+        }
+        walking += stats::seconds(t1, stats::Clock::now());
+    }, badLetter);
+    if (chroms.empty()){
+        header("");
+    }
+    chroms.back().length = read - chroms.back().start;
+    phases.add("parse", stats::seconds(started, stats::Clock::now()) - walking);
+    auto timer = phases.time("query");
+    phases.add("query", walking);
+
+    // a state whose string was seen has all of its suffix link's strings seen as well.
+    // Go from the longest states down so that this reaches all the way to the root
+    auto order = statesByLength(sam);
+    for (size_t o = order.size(); o-- > 1;){
+        int v = order[o];
+        int p = sam[v].link;
+        if (genome.seen[size_t(v)] > 0 && p > 0 && genome.seen[size_t(p)] < sam[p].len){
+            genome.seen[size_t(p)] = sam[p].len;
+            genome.seenEnd[size_t(p)] = genome.seenEnd[size_t(v)];
+        }
+    }
+    std::cout << "one lap finished... \n";
+    return chroms;
+}
+
+/**
+ * match index: build the automata of a genome and save them for later runs
+ * input : the genome file and the index file (empty for the default)
+ * output: the exit code
+ */
+int buildIndex(const std::string& ref_genome_file, std::string index_file, bool huge_pages, bool whole_genome){
+    if (index_file.empty()){
+        index_file = ref_genome_file + ".sami";
+    }
+    gzip_input::File ref{ref_genome_file};
+    if (!ref){
+        std::cerr << "Failed to open input file " << ref_genome_file << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    reference_index::Writer writer{index_file};
+    if (!writer){
+        std::cerr << "Failed to create index file " << index_file << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    auto t1 = std::chrono::high_resolution_clock::now();
+    SuffixAutomaton sam{huge_pages};
+    writer.chroms = readGenome(ref, whole_genome, [&](const auto& chromosome, size_t base, const auto& cuts){
+        build(sam, chromosome, cuts);
+        writer.add(sam, base);
+    });
+    if (!writer.finish(whole_genome)){
+        std::cerr << "Failed to write index file " << index_file << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::cout << "Done! the index is saved to " << index_file << '\n';
+    std::cout << "Total time taken = " << std::chrono::duration_cast<std::chrono::milliseconds>(t2-t1).count() << '\n';
+    return 0;
+}
+
+/**
+ * match serve: load the reference once, then answer batches of fragments (see server.hpp)
+ * over a Unix domain socket, or over stdin and stdout when socket_path is empty.
+ * A FASTA genome is built into one automaton (or FM-index) over the whole genome,
+ * a reference index is mapped as it is.
+ * input : the genome or reference index, the engine, the socket and how many batches to answer at once
+ * output: the exit code
+ */
+int serve(const std::string& ref_genome_file, const std::string& engine, bool huge_pages,
+          const std::string& socket_path, int workers){
+    // in stdio mode stdout carries the answers, so everything else printed goes to stderr
+    std::streambuf* protocol = std::cout.rdbuf();
+    if (socket_path.empty()){
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+    auto t1 = std::chrono::high_resolution_clock::now();
+    reference_index::Index index;
+    SuffixAutomaton sam{huge_pages};
+    FMIndex fm;
+    std::vector<reference_index::Chromosome> chroms;
+    bool indexed = reference_index::isIndexFile(ref_genome_file);
+    if (indexed){
+        if (engine != "sam"){
+            std::cerr << ref_genome_file << " is a reference index of suffix automata, it cannot be used with --engine " << engine << '\n';
+            return -1;
+        }
+        std::string problem = index.load(ref_genome_file);
+        if (!problem.empty()){
+            std::cerr << "Failed to read reference index " << ref_genome_file << ": " << problem << '\n';
+            return -1;
+        }
+        chroms = index.chroms;
+    }else{
+        gzip_input::File ref{ref_genome_file};
+        if (!ref){
+            std::cerr << "Failed to open input file " << ref_genome_file << '\n';
+            return -1;
+        }
+        chroms = readGenome(ref, true, [&](const auto& chromosome, size_t, const auto& cuts){
+            if (engine == "fm"){
+                fm.build(chromosome, cuts);
+            }else{
+                build(sam, chromosome, cuts);
+            }
+        });
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::cerr << "reference loaded in " << std::chrono::duration_cast<std::chrono::milliseconds>(t2-t1).count()
+              << " ms, answering " << workers << " batches at a time\n";
+
+    // every batch gets its own fragments and answers, the reference is only read
+    auto answer = [&](const server::Batch& batch, std::string& reply){
+        FragmentSet fragments;
+        for (size_t k = 0; k < batch.lines.size(); ++k){
+            std::string_view line = batch.lines[k];
+            auto comma = std::min(line.find(','), line.size());
+            int number = 0;
+            auto [end, problem] = std::from_chars(line.data(), line.data() + comma, number);
+            if (comma == line.size() || problem != std::errc{} || end != line.data() + comma){
+                reply = "line " + std::to_string(k + 1) + " of the batch is not NUM,FRAGMENT";
+                return false;
+            }
+            auto fragment = line.substr(comma + 1);
+            fragment = fragment.substr(0, fragment.find(',')); // drop the enzyme columns
+            for (char ch : fragment){
+                int a = int((unsigned char)ch);
+                if (a >= 128 || idx[a] == -1){
+                    reply = "line " + std::to_string(k + 1) + " of the batch has '" + ch + "', which is not an IUPAC letter";
+                    return false;
+                }
+            }
+            addFragment(fragments, number, fragment, int(k));
+        }
+        fragments.done();
+        std::vector<Best> best(fragments.size());
+        if (indexed){
+            SuffixAutomaton view;
+            for (size_t i = 0; i < index.automata.size(); ++i){
+                index.view(i, view);
+                solve(view, fragments, index.automata[i].base, best, 1);
+            }
+        }else if (engine == "fm"){
+            solve(fm, fragments, 0, best, 1);
+        }else{
+            solve(sam, fragments, 0, best, 1);
+        }
+        std::ostringstream out;
+        writeAnswers(out, fragments, best, chroms);
+        reply = out.str();
+        return true;
+    };
+
+    server::Pool pool{workers};
+    if (socket_path.empty()){
+        std::ostream replies{protocol};
+        server::serveConnection([](std::string& line){ return bool(std::getline(std::cin, line)); },
+                                [&](const std::string& text){ replies << text << std::flush; }, pool, answer);
+        std::cout.rdbuf(protocol);
+        return 0;
+    }
+#ifdef HAVE_UNIX_SOCKETS
+    std::string problem = server::listen(socket_path, pool, answer);
+    if (!problem.empty()){
+        std::cerr << problem << '\n';
+        return -1;
+    }
+    return 0;
+#else
+    std::cerr << "Unix domain sockets are not available here, leave out --socket to serve over stdin and stdout\n";
+    return -1;
+#endif
+}
+
+/**
+ * match client: send a fragments file to match serve in batches and write the answers
+ * in the order of the file, like a normal run would
+ * input : the server's socket, the fragments file (csv), the output file and the fragments per batch
+ * output: the exit code
+ */
+int client(const std::string& socket_path, const std::string& fragments_file, const std::string& output_file, size_t batch_size){
+#ifdef HAVE_UNIX_SOCKETS
+    std::ifstream frag{fragments_file};
+    if (!frag){
+        std::cerr << "Failed to open input file " << fragments_file << '\n';
+        return -1;
+    }
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(frag, line);){
+        if (!line.empty()){
+            lines.push_back(line);
+        }
+    }
+    std::ofstream outfile{output_file};
+    if (!outfile){
+        std::cerr << "Failed to create output file " << output_file << '\n';
+        return -1;
+    }
+    int fd = server::connectTo(socket_path);
+    if (fd < 0){
+        std::cerr << "Failed to connect to " << socket_path << '\n';
+        return -1;
+    }
+    using Clock = std::chrono::steady_clock;
+    auto t1 = Clock::now();
+    size_t batches = (lines.size() + batch_size - 1) / batch_size;
+    std::vector<Clock::time_point> sent(batches);
+    std::thread sender([&]{ // the answers are read while the batches are still going out
+        for (size_t b = 0; b < batches; ++b){
+            std::string request = "BATCH " + std::to_string(b) + " "
+                                  + std::to_string(std::min(batch_size, lines.size() - b * batch_size)) + "\n";
+            for (size_t i = b * batch_size; i < std::min(lines.size(), (b + 1) * batch_size); ++i){
+                request += lines[i] + "\n";
+            }
+            sent[b] = Clock::now();
+            server::writeAll(fd, request);
+        }
+        server::writeAll(fd, "QUIT\n");
+    });
+    server::LineReader readLine{fd};
+    std::map<size_t, std::string> answers;
+    std::vector<long long> serverTime, roundTrip;
+    std::string line;
+    bool ok = true;
+    while(answers.size() < batches && readLine(line)){
+        std::istringstream header{line};
+        std::string kind;
+        size_t id = 0, count = 0;
+        long long micros = 0;
+        header >> kind >> id;
+        if (kind != "RESULT" || id >= batches || answers.count(id)){ // an error, or not a batch this client is waiting for
+            std::cerr << "the server answered: " << line << '\n';
+            ok = false;
+            break;
+        }
+        header >> count >> micros;
+        auto& answer = answers[id];
+        for (size_t i = 0; i < count && readLine(line); ++i){
+            answer += line + "\n";
+        }
+        serverTime.push_back(micros);
+        roundTrip.push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - sent[id]).count());
+    }
+    ::shutdown(fd, SHUT_RDWR); // lets the sender finish if the server gave up early
+    sender.join();
+    ::close(fd);
+    if (!ok || answers.size() < batches){
+        std::cerr << "Failed to get all the answers from " << socket_path << '\n';
+        return -1;
+    }
+    for (const auto& [id, answer] : answers){
+        outfile << answer;
+    }
+    auto t2 = Clock::now();
+    auto median = [](std::vector<long long> v){
+        std::sort(v.begin(), v.end());
+        return v.empty() ? 0 : v[v.size() / 2];
+    };
+    std::cout << batches << " batches of up to " << batch_size << " fragments, answered in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(t2-t1).count() << " ms\n"
+              << "latency in the server: median " << median(serverTime) << " us, max "
+              << (serverTime.empty() ? 0 : *std::max_element(serverTime.begin(), serverTime.end())) << " us\n"
+              << "round trip:            median " << median(roundTrip) << " us, max "
+              << (roundTrip.empty() ? 0 : *std::max_element(roundTrip.begin(), roundTrip.end())) << " us\n";
+    return 0;
+#else
+    (void)socket_path, (void)fragments_file, (void)output_file, (void)batch_size;
+    std::cerr << "Unix domain sockets are not available here\n";
+    return -1;
+#endif
+}
+
+/**
+ * --stats=json: write what the run took as one JSON object
+ * input : the stream, the run's settings and sizes, and the chromosomes of the genome
+ * output: the object, in out
+ */
+void writeStats(std::ostream& out, const std::string& engine, bool whole_genome, const FragmentSet& fragments,
+                const std::vector<reference_index::Chromosome>& chroms, double total, uint64_t bytes_read, uint64_t bytes_written){
+    stats::Json json{out};
+    json.object()
+        .field("tool", "match").field("engine", engine).field("threads", threads)
+        .field("whole_genome", whole_genome).field("both_strands", both_strands).field("mismatches", mismatches)
+        .field("window", window)
+        .field("fragments", fragments.size()).field("fragment_letters", fragments.codes.size())
+        .field("chromosomes", chroms.size());
+    json.key("phases").object();
+    for (const auto& [phase, seconds] : phases.list()){
+        json.field(phase, seconds);
+    }
+    json.end().field("total_seconds", total);
+    json.key(engine == "fm" ? "indexes" : "automata").array();
+    for (const auto& b : built){
+        // the chromosomes in it, by where they start
+        // (the one it starts in, for a --window in the middle of one)
+        auto first = std::upper_bound(chroms.begin(), chroms.end(), b.base, [](size_t at, const auto& c){ return at < c.start; });
+        first = first == chroms.begin() ? first : std::prev(first);
+        auto last = engine == "stream" ? first : std::lower_bound(first, chroms.end(), b.base + std::max<size_t>(b.letters, 1),
+                                                                  [](const auto& c, size_t at){ return c.start < at; });
+        json.object();
+        if (engine == "stream"){
+            json.field("name", "(fragments)");
+        }else{
+            json.field("name", first == chroms.end() ? "" : first->name).field("chromosomes", size_t(last - first)).field("start", b.base);
+        }
+        json.field("letters", b.letters);
+        if (b.states >= 0){
+            json.field("states", b.states);
+        }
+        if (b.clones >= 0){
+            json.field("clones", b.clones);
+        }
+        json.field("bytes", b.bytes).end();
+    }
+    json.end();
+    uint64_t letters = queried, steps = fallbacks;
+    bool searched = engine == "fm" || mismatches > 0; // steps of a search rather than suffix links
+    if (letters > 0){ // not for --top-k, which has no solve()
+        json.key("query").object()
+            .field("letters", letters)
+            .field(searched ? "search_steps" : "fallbacks", steps)
+            .field(searched ? "search_steps_per_letter" : "fallbacks_per_letter", double(steps) / double(letters))
+            .end();
+    }
+    json.field("bytes_read", bytes_read).field("bytes_written", bytes_written).field("peak_rss_kb", stats::peakRssKb());
+    json.end();
+}
+
 int main(int argc, char* argv[]){
     // handle command line input
-    if (argc != 4){
+    std::vector<std::string> args;
+    std::string query_genome_file;
+    bool huge_pages = false;
+    bool whole_genome = false;
+    std::string engine = "sam";
+    int top_k = 0, min_len = 0;
+    bool want_stats = false;
+    bool threads_given = false;
+    std::string socket_path;
+    size_t batch_size = 1000;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg.starts_with("--fasta=")){
+            query_genome_file = arg.substr(8);
+        }else if (arg == "--huge-pages"){
+            huge_pages = true;
+        }else if (arg.starts_with("--engine")){
+            engine = arg.size() > 8 && arg[8] == '=' ? arg.substr(9) : (i + 1 < argc ? argv[++i] : "");
+            if (engine != "sam" && engine != "fm" && engine != "stream"){
+                usage();
+                return -1;
+            }
+        }else if (arg.starts_with("--top-k") || arg.starts_with("--min-len")){
+            auto name = arg.substr(0, arg.find('='));
+            std::string num = arg.size() > name.size() ? arg.substr(name.size() + 1) : (i + 1 < argc ? argv[++i] : "");
+            (name == "--top-k" ? top_k : min_len) = std::atoi(num.c_str());
+            if (std::atoi(num.c_str()) < 1 || (name != "--top-k" && name != "--min-len")){
+                usage();
+                return -1;
+            }
+        }else if (arg.starts_with("--mismatches")){
+            std::string num = arg.size() > 12 && arg[12] == '=' ? arg.substr(13) : (i + 1 < argc ? argv[++i] : "");
+            mismatches = std::atoi(num.c_str());
+            if (num.empty() || mismatches < 0){
+                usage();
+                return -1;
+            }
+        }else if (arg.starts_with("--stats")){
+            std::string format = arg.size() > 7 && arg[7] == '=' ? arg.substr(8) : (i + 1 < argc ? argv[++i] : "");
+            if (format != "json"){
+                usage();
+                return -1;
+            }
+            want_stats = true;
+        }else if (arg.starts_with("--window")){
+            std::string num = arg.size() > 8 && arg[8] == '=' ? arg.substr(9) : (i + 1 < argc ? argv[++i] : "");
+            window = size_t(std::max(0L, std::atol(num.c_str())));
+            if (window < 1){
+                usage();
+                return -1;
+            }
+        }else if (arg == "--both-strands"){
+            both_strands = true;
+        }else if (arg == "--whole-genome"){
+            whole_genome = true;
+        }else if (arg.starts_with("--threads")){
+            std::string num = arg.size() > 9 && arg[9] == '=' ? arg.substr(10) : (i + 1 < argc ? argv[++i] : "");
+            threads = std::atoi(num.c_str());
+            threads_given = true;
+            if (threads < 1){
+                usage();
+                return -1;
+            }
+        }else if (arg.starts_with("--socket")){
+            socket_path = arg.size() > 8 && arg[8] == '=' ? arg.substr(9) : (i + 1 < argc ? argv[++i] : "");
+            if (socket_path.empty()){
+                usage();
+                return -1;
+            }
+        }else if (arg.starts_with("--batch")){
+            std::string num = arg.size() > 7 && arg[7] == '=' ? arg.substr(8) : (i + 1 < argc ? argv[++i] : "");
+            batch_size = size_t(std::max(0, std::atoi(num.c_str())));
+            if (batch_size < 1){
+                usage();
+                return -1;
+            }
+        }else{
+            args.push_back(arg);
+        }
+    }
+
+    // give each letter its own index. The input files should not have letters other than IUPAC ones
+    memset(idx, -1, sizeof(idx));
+    for (int i = 0; letters[i]; ++i){
+        idx[int(letters[i])] = i;
+    }
+
+    if (!args.empty() && args[0] == "index" && (args.size() == 2 || args.size() == 3)){
+        if (engine != "sam"){
+            std::cerr << "match index only saves suffix automata of the genome, --engine " << engine << " builds from the FASTA file every run\n";
+            return -1;
+        }
+        return buildIndex(args[1], args.size() == 3 ? args[2] : "", huge_pages, whole_genome);
+    }
+    if (!args.empty() && args[0] == "serve" && args.size() == 2){
+        if (engine == "stream" || top_k > 0 || min_len > 0){
+            std::cerr << "match serve answers with --engine sam or fm, without --top-k or --min-len\n";
+            return -1;
+        }
+        if (!threads_given){
+            threads = int(std::max(1u, std::thread::hardware_concurrency()));
+        }
+        return serve(args[1], engine, huge_pages, socket_path, threads);
+    }
+    if (!args.empty() && args[0] == "client" && args.size() == 3){
+        if (socket_path.empty()){
+            usage();
+            return -1;
+        }
+        return client(socket_path, args[1], args[2], batch_size);
+    }
+    if (args.size() != 3){
         usage();
         return -1;
     }
-    std::string ref_genome_file = argv[1];
-    std::string fragments_file  = argv[2];
-    std::string output_file     = argv[3];
+    std::string ref_genome_file = args[0];
+    std::string fragments_file  = args[1];
+    std::string output_file     = args[2];
 
     // open all the files needed and verify whether they are successful
     std::ofstream outfile{output_file};
-    std::ifstream ref{ref_genome_file};
+    gzip_input::File ref{ref_genome_file};
     std::ifstream frag{fragments_file};
     if (!ref){
         std::cerr << "Failed to open input file " << ref_genome_file << '\n';
@@ -173,63 +1360,189 @@ int main(int argc, char* argv[]){
         return -1;
     }
 
-    // give each letter its own index. The input files should not have letters other than ATCGNW
-    memset(idx, -1, sizeof(idx));
-    idx['A'] = 0;
-    idx['T'] = 1;
-    idx['C'] = 2;
-    idx['G'] = 3;
-    idx['N'] = 4;
-    idx['W'] = 5;
-
-    // count how many fragments are there
+    // load all the fragments once. A binary fragment index is read in whole
+    // and its fragments are spelled out from the sequence
+    auto started = stats::Clock::now();
+    FragmentSet fragments;
     std::string line;
-    int count = 0;
-    while(std::getline(frag, line)){
-        ++count;
+    if (fragment_index::isIndexFile(fragments_file)){
+        fragment_index::Index index;
+        std::string problem = index.load(fragments_file);
+        if (problem.empty() && !index.sequence){
+            problem = query_genome_file.empty()
+                ? "the fragment index has no sequence, pass the genome it was made from with --fasta="
+                : index.loadSequence(query_genome_file);
+        }
+        if (!problem.empty()){
+            std::cerr << "Failed to read fragment index " << fragments_file << ": " << problem << '\n';
+            std::cerr << "Exiting..." << '\n';
+            return -1;
+        }
+        uint32_t chrom = ~0u;
+        int number = 0;
+        int count = 0;
+        for (const auto& record : index.records){
+            if (record.chrom != chrom){ // numbered per header like the csv
+                chrom = record.chrom;
+                number = 0;
+            }
+            addFragment(fragments, ++number, index.fragment(record), count++);
+        }
+    }else{
+        int count = 0;
+        while(std::getline(frag, line)){
+            auto comma = line.find(",");
+            int index = std::stoi(line.substr(0, comma));
+            auto fragment = std::string_view(line).substr(comma + 1);
+            addFragment(fragments, index, fragment.substr(0, fragment.find(",")), count++); // drop the enzyme columns
+        }
     }
-    frag.clear();
-    frag.seekg(0);
-    ans = std::vector<std::pair<int, std::string>>(count);
+    fragments.done();
+    ans = std::vector<Best>(fragments.size());
+    phases.add("parse", stats::seconds(started, stats::Clock::now()));
     auto t1 = std::chrono::high_resolution_clock::now();
 
-    // build the suffix automaton and solve for each header
-    std::getline(ref, line); // skip the first header line
-    while(std::getline(ref, line)){
-        if (line[0] == '>'){ // header
-            solve(frag);
+    // solve for each automaton of a reference index, or build the suffix automaton
+    // and solve for each header (or once for the whole genome)
+    SuffixAutomaton sam{huge_pages};
+    std::vector<reference_index::Chromosome> chroms;
+    bool indexed = reference_index::isIndexFile(ref_genome_file);
+    if (indexed && engine != "sam"){
+        std::cerr << ref_genome_file << " is a reference index of suffix automata, it cannot be used with --engine " << engine << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    bool listing = top_k > 0 || min_len > 0;
+    if (listing && (indexed || engine == "stream")){
+        std::cerr << "--top-k and --min-len need the genome itself (not a reference index) and --engine sam or fm\n";
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    if (mismatches > 0 && (listing || engine == "stream")){
+        std::cerr << "--mismatches needs --engine sam or fm, without --top-k or --min-len\n";
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    if (window > 0 && (listing || indexed || engine != "sam")){
+        std::cerr << "--window needs --engine sam and the genome itself (not a reference index), without --top-k or --min-len\n";
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    if (listing){ // every place is listed from one automaton (or FM-index) over the whole genome
+        whole_genome = true;
+    }
+    FMIndex fm;
+    if (indexed){
+        reference_index::Index index;
+        std::string problem;
+        {
+            auto timer = phases.time("parse");
+            problem = index.load(ref_genome_file);
+        }
+        if (!problem.empty()){
+            std::cerr << "Failed to read reference index " << ref_genome_file << ": " << problem << '\n';
+            std::cerr << "Exiting..." << '\n';
+            return -1;
+        }
+        for (size_t i = 0; i < index.automata.size(); ++i){
+            index.view(i, sam);
+            size_t base = index.automata[i].base;
+            size_t end = i + 1 < index.automata.size() ? index.automata[i + 1].base
+                       : index.chroms.empty() ? base : index.chroms.back().start + index.chroms.back().length;
+            record(sam, base, end - base, false);
+            auto timer = phases.time("query");
+            solve(sam, fragments, base, ans, threads);
             std::cout << "one lap finished... \n";
-            for (int i = 0; i < sz; ++i){
-                memset(to[i], 0, sizeof(to[i]));
+        }
+        chroms = std::move(index.chroms);
+    }else if (engine == "stream"){
+        auto building = stats::Clock::now();
+        sam.reserve(fragments.codes.size() * (both_strands ? 2 : 1));
+        for (size_t i = 0; i < fragments.size(); ++i){
+            sam.separate();
+            for (unsigned char c : fragments[i]){
+                sam.addLetter(c);
             }
-            memset(link, 0, sz * sizeof(int));
-            memset(len,  0, sz * sizeof(int));
-            last = 0;
-            sz = 1;
-            continue;
+            if (both_strands){ // the reverse complements are walked through the automaton as well
+                sam.separate();
+                auto fragment = fragments[i];
+                for (auto c = fragment.rbegin(); c != fragment.rend(); ++c){
+                    sam.addLetter(complement[*c]);
+                }
+            }
+        }
+        record(sam, 0, fragments.codes.size() * (both_strands ? 2 : 1));
+        phases.add("build", stats::seconds(building, stats::Clock::now()));
+        StreamedGenome genome{sam, {}, {}};
+        chroms = streamGenome(ref, genome);
+        auto timer = phases.time("query");
+        solve(genome, fragments, 0, ans, threads);
+    }else if (engine == "fm"){
+        chroms = readGenome(ref, whole_genome, [&](const auto& chromosome, size_t base, const auto& cuts){
+            {
+                auto timer = phases.time("build");
+                fm.build(chromosome, cuts);
+            }
+            built.push_back({base, chromosome.size(), -1, -1, fm.bytes()});
+            if (!listing){
+                auto timer = phases.time("query");
+                solve(fm, fragments, base, ans, threads);
+            }
+        });
+    }else{
+        chroms = readGenome(ref, whole_genome, [&](const auto& chromosome, size_t base, const auto& cuts){
+            if (!listing && ((window > 0 && chromosome.size() > window) || chromosome.size() > SuffixAutomaton::maxLetters)){
+                solveWindows(chromosome, base, cuts, fragments, ans, huge_pages);
+                return;
+            }
+            {
+                auto timer = phases.time("build");
+                build(sam, chromosome, cuts);
+            }
+            record(sam, base, chromosome.size());
+            if (!listing){
+                auto timer = phases.time("query");
+                solve(sam, fragments, base, ans, threads);
+            }
+        });
+    }
+    auto report = [&]{ // --stats=json, once the output is all written
+        if (want_stats){
+            outfile.flush();
+            uint64_t bytes_read = stats::fileSize(ref_genome_file) + stats::fileSize(fragments_file)
+                                + (query_genome_file.empty() ? 0 : stats::fileSize(query_genome_file));
+            writeStats(std::cerr, engine, whole_genome, fragments, chroms, stats::seconds(started, stats::Clock::now()),
+                       bytes_read, uint64_t(std::max<std::streamoff>(0, outfile.tellp())));
         }
-        for (unsigned char ch : str_toupper(line)){
-            if (idx[ch] == -1){
-                std::cout << "[genome file]\n"
-                          << "Line: \n"
-                          << line << '\n';
-                error(ch);
+    };
+    if (listing){
+        {
+            auto timer = phases.time("query");
+            if (engine == "fm"){
+                listMatches(fm, fragments, chroms, outfile, top_k, min_len);
+            }else{
+                listMatches(SuffixLinkTree{sam}, fragments, chroms, outfile, top_k, min_len);
             }
-            addLetter(idx[ch]);
         }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::cout << "Done! the matches are listed in " << output_file << '\n';
+        std::cout << "Total time taken = " << std::chrono::duration_cast<std::chrono::milliseconds>(t2-t1).count() << '\n';
+        report();
+        return 0;
     }
     auto t2 = std::chrono::high_resolution_clock::now();
     std::cout << "Done! now outputting the answer to " << output_file << '\n';
     std::cout << "Total time taken = " << std::chrono::duration_cast<std::chrono::milliseconds>(t2-t1).count() << '\n';
 
     // output the answer
-    for (const auto& each : ans){
-        const auto& [index, match] = each;
-        outfile << index << "," << match << '\n';
+    {
+        auto timer = phases.time("write");
+        writeAnswers(outfile, fragments, ans, chroms);
+        outfile.flush();
     }
+    report();
 
     // close all the files
-    ref.close();
     frag.close();
     outfile.close();
 }
@@ -0,0 +1,251 @@
+#pragma once
+/**
+ * Reference index, written by "match index" and memory mapped by match.
+ *
+ * Building the suffix automata of a genome takes minutes, but they only
+ * depend on the genome. The index keeps the built automata on disk exactly
+ * as they lie in memory, so a query run maps the file and starts matching
+ * right away; pages are only read in as the fragments walk into them.
+ *
+ * Layout (little endian, native SuffixAutomaton::Node layout):
+ *   Header
+ *   for each automaton: Node[states] at a 64-byte aligned offset, then int firstpos[states],
+ *                       then Edge[edges] (the overflow transitions on letters other than ACGT)
+ *   chromosome table  at chromsOffset, for each: uint32 name length, name, uint64 start, uint64 length
+ *   automaton table   at automataOffset: Automaton[automatonCount]
+ * There is one automaton per chromosome, or a single one for the whole genome.
+ */
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "suffix_automaton.hpp"
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace reference_index{
+
+constexpr char magic[4] = {'S', 'H', 'R', 'I'};
+constexpr uint32_t version = 2;
+constexpr uint32_t wholeGenome = 1;  // Header::flags
+
+struct Header{
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t nodeSize;       // sizeof(SuffixAutomaton::Node) of the writer
+    uint64_t chromCount;
+    uint64_t automatonCount;
+    uint64_t chromsOffset;
+    uint64_t automataOffset;
+};
+
+struct Automaton{
+    uint64_t base;      // where its string starts, counting from the start of the genome
+    uint64_t states;
+    uint64_t offset;    // of its nodes
+    uint64_t edges;     // overflow edges after the firstpos array
+};
+
+struct Chromosome{
+    std::string name;
+    uint64_t start = 0;     // counting from the start of the genome
+    uint64_t length = 0;
+};
+
+/**
+ * does the file start like a reference index?
+ */
+inline bool isIndexFile(const std::string& file_name){
+    std::ifstream file{file_name, std::ios::binary};
+    char head[4] = {};
+    file.read(head, sizeof(head));
+    return file && std::memcmp(head, magic, sizeof(magic)) == 0;
+}
+
+/**
+ * Writes the automata one at a time as they are built, then the tables
+ */
+class Writer{
+public:
+    std::vector<Chromosome> chroms;
+
+    explicit Writer(const std::string& file_name) : file{file_name, std::ios::binary}{
+        Header header{};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    explicit operator bool() const {
+        return bool(file);
+    }
+
+    /**
+     * append a built automaton whose string starts at base in the genome
+     */
+    void add(const SuffixAutomaton& sam, uint64_t base){
+        uint64_t states = uint64_t(sam.size());
+        uint64_t edges = uint64_t(sam.overflowSize());
+        automata.push_back({base, states, align(64), edges});
+        file.write(reinterpret_cast<const char*>(sam.data()), std::streamsize(states * sizeof(SuffixAutomaton::Node)));
+        file.write(reinterpret_cast<const char*>(sam.firstEnds()), std::streamsize(states * sizeof(int)));
+        file.write(reinterpret_cast<const char*>(sam.overflowEdges()), std::streamsize(edges * sizeof(SuffixAutomaton::Edge)));
+    }
+
+    /**
+     * write the tables and the header
+     * input : whether the automata cover the whole genome
+     * output: whether everything was written
+     */
+    bool finish(bool whole_genome){
+        Header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.flags = whole_genome ? wholeGenome : 0;
+        header.nodeSize = uint32_t(sizeof(SuffixAutomaton::Node));
+        header.chromCount = chroms.size();
+        header.automatonCount = automata.size();
+        header.chromsOffset = align(8);
+        for (const auto& chrom : chroms){
+            uint32_t size = uint32_t(chrom.name.size());
+            file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+            file.write(chrom.name.data(), std::streamsize(size));
+            file.write(reinterpret_cast<const char*>(&chrom.start), sizeof(chrom.start));
+            file.write(reinterpret_cast<const char*>(&chrom.length), sizeof(chrom.length));
+        }
+        header.automataOffset = align(8);
+        file.write(reinterpret_cast<const char*>(automata.data()), std::streamsize(automata.size() * sizeof(Automaton)));
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.close();
+        return !file.fail();
+    }
+
+private:
+    std::ofstream file;
+    std::vector<Automaton> automata;
+
+    // pad the file to a multiple of to bytes, output: the new position
+    uint64_t align(uint64_t to){
+        static const char zeros[64] = {};
+        auto at = uint64_t(file.tellp());
+        file.write(zeros, std::streamsize((to - at % to) % to));
+        return uint64_t(file.tellp());
+    }
+};
+
+/**
+ * A reference index mapped into memory (or read in where there is no mmap)
+ */
+class Index{
+public:
+    std::vector<Chromosome> chroms;
+    std::vector<Automaton> automata;
+    bool whole_genome = false;
+
+    Index() = default;
+    Index(const Index&) = delete;
+    Index& operator=(const Index&) = delete;
+    ~Index(){
+#ifdef HAVE_MMAP
+        if (mapped != nullptr){
+            munmap(mapped, bytes);
+        }
+#endif
+    }
+
+    /**
+     * map an index written by Writer
+     * input : the file name
+     * output: an empty string on success, what went wrong otherwise
+     */
+    std::string load(const std::string& file_name){
+#ifdef HAVE_MMAP
+        int fd = open(file_name.c_str(), O_RDONLY);
+        if (fd < 0){
+            return "failed to open " + file_name;
+        }
+        off_t end = lseek(fd, 0, SEEK_END);
+        bytes = end > 0 ? size_t(end) : 0;
+        void* p = bytes ? mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (p == MAP_FAILED){
+            return "failed to map " + file_name;
+        }
+        mapped = p;
+        const char* data = static_cast<const char*>(p);
+#else
+        std::ifstream file{file_name, std::ios::binary};
+        if (!file){
+            return "failed to open " + file_name;
+        }
+        copy.assign(std::istreambuf_iterator<char>(file), {});
+        bytes = copy.size();
+        const char* data = copy.data();
+#endif
+        Header header{};
+        if (bytes < sizeof(header)){
+            return "not a reference index";
+        }
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0){
+            return "not a reference index";
+        }
+        if (header.version != version){
+            return "reference index version " + std::to_string(header.version) + " is not supported";
+        }
+        if (header.nodeSize != sizeof(SuffixAutomaton::Node)){
+            return "the reference index was written by an incompatible build of match, rebuild it with match index";
+        }
+        whole_genome = header.flags & wholeGenome;
+        if (header.automataOffset + header.automatonCount * sizeof(Automaton) > bytes){
+            return "the reference index is truncated";
+        }
+        const char* at = data + header.chromsOffset;
+        chroms.resize(header.chromCount);
+        for (auto& chrom : chroms){
+            uint32_t size = 0;
+            std::memcpy(&size, at, sizeof(size));
+            at += sizeof(size);
+            chrom.name.assign(at, size);
+            at += size;
+            std::memcpy(&chrom.start, at, sizeof(chrom.start));
+            std::memcpy(&chrom.length, at + sizeof(chrom.start), sizeof(chrom.length));
+            at += sizeof(chrom.start) + sizeof(chrom.length);
+        }
+        automata.resize(header.automatonCount);
+        std::memcpy(automata.data(), data + header.automataOffset, automata.size() * sizeof(Automaton));
+        for (const auto& automaton : automata){
+            if (automaton.offset + automaton.states * (sizeof(SuffixAutomaton::Node) + sizeof(int))
+                + automaton.edges * sizeof(SuffixAutomaton::Edge) > header.chromsOffset){
+                return "the reference index is truncated";
+            }
+        }
+        base = data;
+        return "";
+    }
+
+    /**
+     * point sam at the i-th automaton, without copying it
+     */
+    void view(size_t i, SuffixAutomaton& sam) const {
+        const auto& automaton = automata[i];
+        auto nodes = reinterpret_cast<const SuffixAutomaton::Node*>(base + automaton.offset);
+        auto first = reinterpret_cast<const int*>(nodes + automaton.states);
+        auto edges = reinterpret_cast<const SuffixAutomaton::Edge*>(first + automaton.states);
+        sam.view(nodes, first, int(automaton.states), edges, int(automaton.edges));
+    }
+
+private:
+    const char* base = nullptr;
+    size_t bytes = 0;
+#ifdef HAVE_MMAP
+    void* mapped = nullptr;
+#else
+    std::vector<char> copy;
+#endif
+};
+
+} // namespace reference_index
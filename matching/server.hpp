@@ -0,0 +1,338 @@
+#pragma once
+/**
+ * match serve: keep the reference resident and answer batches of fragments.
+ *
+ * The protocol is plain text, the same over a Unix domain socket or over
+ * stdin/stdout. A request is a header line and then that many fragment lines,
+ * written like the lines of a fragments file:
+ *   BATCH <id> <count>
+ *   NUM,FRAGMENT[,...]          (count lines)
+ * The answer to each batch is
+ *   RESULT <id> <count> <microseconds>
+ *   NUM,MATCH,CHRONOSOME,START,END[,STRAND]   (count lines, as in the output file)
+ * or, if the batch could not be matched,
+ *   ERROR <id> <message>
+ * Batches of one connection are answered concurrently, so the answers may come
+ * back in any order; the id tells them apart. <microseconds> is the time from
+ * the end of the request to its answer, waiting for a free thread included.
+ * QUIT (or the end of the input) ends the connection.
+ */
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define HAVE_UNIX_SOCKETS 1
+#endif
+
+namespace server{
+
+struct Batch{
+    std::string id;
+    std::vector<std::string> lines;
+    std::chrono::steady_clock::time_point received;
+};
+
+/**
+ * A fixed set of threads running the jobs given to it in order
+ */
+class Pool{
+public:
+    explicit Pool(int workers){
+        for (int t = 0; t < workers; ++t){
+            threads.emplace_back([this]{ run(); });
+        }
+    }
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    // finish the jobs given so far, then stop
+    ~Pool(){
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& thread : threads){
+            thread.join();
+        }
+    }
+
+    void submit(std::function<void()> job){
+        {
+            std::lock_guard lock{mutex};
+            jobs.push_back(std::move(job));
+        }
+        ready.notify_one();
+    }
+
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool stopping = false;
+
+    void run(){
+        for (;;){
+            std::function<void()> job;
+            {
+                std::unique_lock lock{mutex};
+                ready.wait(lock, [this]{ return stopping || !jobs.empty(); });
+                if (jobs.empty()){
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+/**
+ * Read requests from one connection and answer each of them on the pool.
+ * Returns once the connection ends and every one of its batches is answered.
+ * input : readLine(std::string&) -> bool, false at the end of the input;
+ *         write(const std::string&) sends a whole answer, called by one thread at a time;
+ *         answer(const Batch&, std::string& reply) -> bool fills reply with the result lines,
+ *         or with what went wrong if it returns false
+ */
+template<class ReadLine, class Write, class Answer>
+void serveConnection(ReadLine&& readLine, Write&& write, Pool& pool, Answer& answer){
+    std::mutex writing;
+    std::condition_variable finished;
+    size_t pending = 0;
+    auto send = [&](const std::string& text){
+        std::lock_guard lock{writing};
+        write(text);
+    };
+    std::string line;
+    while(readLine(line)){
+        if (!line.empty() && line.back() == '\r'){
+            line.pop_back();
+        }
+        if (line.empty()){
+            continue;
+        }
+        if (line == "QUIT"){
+            break;
+        }
+        auto batch = std::make_shared<Batch>();
+        size_t count = 0;
+        auto space = line.find(' ');
+        auto last = line.rfind(' ');
+        auto [end, problem] = std::from_chars(line.data() + last + 1, line.data() + line.size(), count);
+        if (!line.starts_with("BATCH ") || space == last || problem != std::errc{} || end != line.data() + line.size()){
+            send("ERROR - expected BATCH <id> <count>, got " + line + "\n");
+            break; // the lines that follow cannot be told apart any more
+        }
+        batch->id = line.substr(space + 1, last - space - 1);
+        for (std::string fragment; batch->lines.size() < count && readLine(fragment);){
+            if (!fragment.empty() && fragment.back() == '\r'){
+                fragment.pop_back();
+            }
+            batch->lines.push_back(std::move(fragment));
+        }
+        if (batch->lines.size() < count){ // cut off in the middle of the batch
+            break;
+        }
+        batch->received = std::chrono::steady_clock::now();
+        {
+            std::lock_guard lock{writing};
+            ++pending;
+        }
+        pool.submit([&, batch]{
+            auto started = std::chrono::steady_clock::now();
+            std::string reply;
+            bool ok = answer(*batch, reply);
+            auto done = std::chrono::steady_clock::now();
+            auto waited = std::chrono::duration_cast<std::chrono::microseconds>(started - batch->received).count();
+            auto total = std::chrono::duration_cast<std::chrono::microseconds>(done - batch->received).count();
+            std::cerr << "batch " << batch->id << ": " << batch->lines.size() << " fragments in " << total
+                      << " us (" << waited << " us waiting)" << (ok ? "" : ", failed") << '\n';
+            std::lock_guard lock{writing};
+            write(ok ? "RESULT " + batch->id + " " + std::to_string(batch->lines.size()) + " " + std::to_string(total) + "\n" + reply
+                     : "ERROR " + batch->id + " " + reply + "\n");
+            if (--pending == 0){
+                finished.notify_all();
+            }
+        });
+    }
+    std::unique_lock lock{writing};
+    finished.wait(lock, [&]{ return pending == 0; });
+}
+
+#ifdef HAVE_UNIX_SOCKETS
+/**
+ * Lines read straight from a socket
+ */
+class LineReader{
+public:
+    explicit LineReader(int socket) : fd(socket){}
+
+    bool operator()(std::string& line){
+        line.clear();
+        for (;;){
+            auto newline = buffer.find('\n', at);
+            if (newline != std::string::npos){
+                line.append(buffer, at, newline - at);
+                at = newline + 1;
+                return true;
+            }
+            line.append(buffer, at);
+            buffer.clear();
+            at = 0;
+            char chunk[1 << 16];
+            ssize_t got = ::read(fd, chunk, sizeof(chunk));
+            if (got < 0 && errno == EINTR){
+                continue;
+            }
+            if (got <= 0){
+                return !line.empty();
+            }
+            buffer.assign(chunk, size_t(got));
+        }
+    }
+
+private:
+    int fd;
+    std::string buffer;
+    size_t at = 0;
+};
+
+// write all of text to a socket, output: false if the other end went away
+inline bool writeAll(int fd, const std::string& text){
+    for (size_t done = 0; done < text.size();){
+        ssize_t wrote = ::write(fd, text.data() + done, text.size() - done);
+        if (wrote < 0 && errno == EINTR){
+            continue;
+        }
+        if (wrote <= 0){
+            return false;
+        }
+        done += size_t(wrote);
+    }
+    return true;
+}
+
+// the address of a socket file, output: false if the path is too long
+inline bool address(const std::string& path, sockaddr_un& addr){
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)){
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+/**
+ * connect to a server listening at path
+ * output: the socket, or -1
+ */
+inline int connectTo(const std::string& path){
+    sockaddr_un addr;
+    if (!address(path, addr)){
+        return -1;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && ::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0){
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline volatile std::sig_atomic_t stopRequested = 0;
+inline int wakeFd = -1; // the write end of the pipe that wakes the accept loop up on a signal
+
+/**
+ * Listen at path and serve every connection on its own reading thread,
+ * with the matching done on the pool, until SIGINT or SIGTERM.
+ * input : the socket path (replaced if it is there already), the pool and the answer function
+ * output: an empty string once stopped, what went wrong otherwise
+ */
+template<class Answer>
+std::string listen(const std::string& path, Pool& pool, Answer& answer){
+    sockaddr_un addr;
+    if (!address(path, addr)){
+        return "the socket path is too long";
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(path.c_str());
+    if (fd < 0 || ::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 64) != 0){
+        return "failed to listen at " + path;
+    }
+    // the signal may be delivered to any thread (the pool's, a connection's), so rather than
+    // count on it interrupting accept() the handler writes to a pipe the loop polls as well
+    int wake[2];
+    if (::pipe(wake) != 0){
+        ::close(fd);
+        return "failed to make a pipe";
+    }
+    wakeFd = wake[1];
+    std::signal(SIGPIPE, SIG_IGN); // a client that hangs up early only loses its answers
+    struct sigaction stop{};
+    stop.sa_handler = [](int){
+        stopRequested = 1;
+        char byte = 0;
+        [[maybe_unused]] auto written = ::write(wakeFd, &byte, 1);
+    };
+    sigaction(SIGINT, &stop, nullptr);
+    sigaction(SIGTERM, &stop, nullptr);
+    std::cerr << "listening at " << path << '\n';
+    std::mutex connections;
+    std::condition_variable closed;
+    std::set<int> open;
+    while(!stopRequested){
+        pollfd ready[2] = {{fd, POLLIN, 0}, {wake[0], POLLIN, 0}};
+        if (::poll(ready, 2, -1) < 0 || (ready[1].revents & POLLIN) || !(ready[0].revents & POLLIN)){
+            continue; // interrupted, or told to stop
+        }
+        int client = ::accept(fd, nullptr, nullptr);
+        if (client < 0){
+            continue;
+        }
+        std::lock_guard lock{connections};
+        open.insert(client);
+        std::thread([&, client]{
+            serveConnection(LineReader{client}, [client](const std::string& text){ writeAll(client, text); }, pool, answer);
+            std::lock_guard lock{connections};
+            ::close(client);
+            open.erase(client);
+            closed.notify_all();
+        }).detach();
+    }
+    ::close(fd);
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+    ::close(wake[0]);
+    ::close(wake[1]);
+    // stop reading from the clients, answer what they have sent already
+    std::unique_lock lock{connections};
+    for (int client : open){
+        ::shutdown(client, SHUT_RD);
+    }
+    closed.wait(lock, [&]{ return open.empty(); });
+    ::unlink(path.c_str());
+    return "";
+}
+#endif
+
+} // namespace server
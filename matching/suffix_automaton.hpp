@@ -0,0 +1,324 @@
+#pragma once
+/**
+ * Suffix Automaton Section
+ * This runs in linear time O(N)
+ *
+ * The states live in one arena sized to the chromosome (at most 2n states),
+ * and each state keeps its transitions, suffix link and length together in a
+ * 32-byte node, so a step of addLetter or of a query touches one cache line.
+ * Clearing the automaton for the next chromosome is O(1): states are wiped
+ * when they are created, not when they are thrown away.
+ *
+ * Each state also remembers where its strings first end (firstpos), so a
+ * match can be located without searching for it again. That is kept in its
+ * own array next to the nodes since it is only read when a match improves.
+ * Several strings can go into one automaton (a generalized suffix automaton):
+ * separate() starts the next one, no match runs across the join, and
+ * positions keep counting across all of them.
+ *
+ * An automaton can also be a read-only view of nodes that live elsewhere,
+ * such as a reference index mapped from disk.
+ *
+ * Only A, T, C and G get a slot in the node. The rest of the IUPAC letters
+ * are rare in real assemblies, so their transitions go to a shared overflow
+ * list of edges that the node points into; the nodes stay at 32 bytes and
+ * the ACGT path never looks at the list.
+ */
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <utility>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
+
+class SuffixAutomaton{
+public:
+    static constexpr int sigma = 16;    // ATCG, then NWRYKMSBDHVU
+    static constexpr int dense = 4;     // letters with a slot in the node
+    static constexpr size_t maxLetters = (size_t(1) << 30) - 2; // states and positions are ints, 2n + 2 states at most
+
+    struct alignas(32) Node{
+        int to[dense];  // Transitions on ATCG
+        int link;       // Suffix link
+        int len;        // Length of the largest string in the state
+        int extra;      // First overflow edge, 0 for none
+        int own;        // 1 if the state was made for a letter, 0 for a clone
+    };
+
+    // a transition on one of the other letters
+    struct Edge{
+        int symbol;
+        int target;
+        int next;       // Next edge of the same state, 0 for none
+    };
+
+    /**
+     * huge_pages asks for 2 MiB pages (Linux) to cut down on TLB misses over large arenas
+     */
+    explicit SuffixAutomaton(bool huge_pages = false) : huge(huge_pages){}
+    SuffixAutomaton(const SuffixAutomaton&) = delete;
+    SuffixAutomaton& operator=(const SuffixAutomaton&) = delete;
+    ~SuffixAutomaton(){
+        release();
+    }
+
+    /**
+     * make room for a string of the given length and start over, empty
+     */
+    void reserve(size_t letters){
+        if (letters > maxLetters){
+            std::cout << "Sorry - one automaton holds at most " << maxLetters << " letters, this string has " << letters << ".\n";
+            exit(-1);
+        }
+        size_t need = 2 * letters + 2;
+        if (need > capacity){
+            release();
+            allocate(need);
+        }
+        reset();
+    }
+
+    /**
+     * forget the string, O(1)
+     */
+    void reset(){
+        nodes[0] = Node{};
+        nodes[0].link = -1;
+        first[0] = -1;
+        last = 0;
+        sz = 1;
+        letters = 0;
+        cloneCount = 0;
+        shared.clear();
+        overflow.assign(1, Edge{}); // edge 0 stands for none
+        edges = overflow.data();
+        edgeCount = 1;
+    }
+
+    /**
+     * start another string in the same automaton, O(1)
+     */
+    void separate(){
+        last = 0;
+    }
+
+    void addLetter (int c){   // Adding character to the end
+        if (size_t(sz) + 2 > capacity){
+            std::cout << "Sorry - the automaton ran out of room, reserve() was given too few letters.\n";
+            exit(-1);
+        }
+        int p = last;          // State of string s
+        int pos = letters++;
+        if (next(p, c)){      // sc is already known from an earlier string (only after separate())
+            int q = next(p, c);
+            last = nodes[q].len == nodes[p].len + 1 ? q : split(p, q, c);
+            shared.push_back({last, pos});
+            return;
+        }
+        last = sz++;           // Create state for string sc
+        nodes[last] = Node{};
+        nodes[last].len = nodes[p].len + 1;
+        nodes[last].own = 1;
+        first[last] = pos;
+        for (; p != -1 && next(p, c) == 0; p = nodes[p].link){
+            setNext(p, c, last);  // Jumps which add new suffixes
+        }
+        if (p == -1){         // This is the first occurrence of c
+            nodes[last].link = 0;
+            return;
+        }
+        int q = next(p, c);
+        if (nodes[q].len == nodes[p].len + 1){
+            nodes[last].link = q;
+            return;
+        }
+        nodes[last].link = split(p, q, c);
+    }
+
+    const Node& operator[](int state) const {
+        return nodes[state];
+    }
+
+    /**
+     * the state reached from state on letter c, 0 if there is no transition
+     */
+    int next(int state, int c) const {
+        if (c < dense){
+            return nodes[state].to[c];
+        }
+        for (int e = nodes[state].extra; e; e = edges[e].next){
+            if (edges[e].symbol == c){
+                return edges[e].target;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * where the strings of a state first end, counting letters from the start of the first string
+     */
+    int firstEnd(int state) const {
+        return first[state];
+    }
+
+    int size() const {
+        return sz;
+    }
+
+    /**
+     * states split off by addLetter since reset() (not known for a view)
+     */
+    int clones() const {
+        return cloneCount;
+    }
+
+    const Node* data() const {
+        return nodes;
+    }
+
+    const int* firstEnds() const {
+        return first;
+    }
+
+    /**
+     * The places a string ends are the firstpos of the states made for a letter in
+     * its state's subtree of suffix links. After separate(), a letter whose string
+     * is already known gets no state of its own; those (state, position) pairs are here.
+     */
+    const std::vector<std::pair<int, int>>& sharedEnds() const {
+        return shared;
+    }
+
+    const Edge* overflowEdges() const {
+        return edges;
+    }
+
+    int overflowSize() const {
+        return edgeCount;
+    }
+
+    /**
+     * look at a built automaton somewhere else in memory instead of the arena
+     */
+    void view(const Node* other, const int* other_first, int states, const Edge* other_edges, int other_edge_count){
+        release();
+        nodes = const_cast<Node*>(other); // never written through, addLetter sees no capacity
+        first = const_cast<int*>(other_first);
+        sz = states;
+        edges = other_edges;
+        edgeCount = other_edge_count;
+        viewing = true;
+    }
+
+private:
+    Node* nodes = nullptr;
+    int* first = nullptr;   // firstpos of each state, right after the nodes in the arena
+    size_t capacity = 0;    // states the arena has room for
+    size_t bytes = 0;
+    bool huge;
+    bool mapped = false;
+    bool viewing = false;   // nodes belong to someone else
+    int last = 0;           // State corresponding to the whole string
+    int sz = 1;             // Current amount of states
+    int letters = 0;        // Letters added since reset()
+    int cloneCount = 0;     // Clones made since reset()
+    std::vector<std::pair<int, int>> shared;    // see sharedEnds()
+    std::vector<Edge> overflow = std::vector<Edge>(1);  // transitions on the rare letters
+    const Edge* edges = overflow.data();    // overflow, or someone else's edges in a view
+    int edgeCount = 1;
+
+    void setNext(int state, int c, int target){
+        if (c < dense){
+            nodes[state].to[c] = target;
+            return;
+        }
+        for (int e = nodes[state].extra; e; e = overflow[size_t(e)].next){
+            if (overflow[size_t(e)].symbol == c){
+                overflow[size_t(e)].target = target;
+                return;
+            }
+        }
+        overflow.push_back({c, target, nodes[state].extra});
+        nodes[state].extra = edgeCount++;
+        edges = overflow.data();
+    }
+
+    /**
+     * split off a clone cl of q holding the strings up to length len(p) + 1, return cl
+     */
+    int split(int p, int q, int c){
+        int cl = sz++;
+        ++cloneCount;
+        nodes[cl] = nodes[q];
+        nodes[cl].len = nodes[p].len + 1;
+        nodes[cl].extra = 0;
+        nodes[cl].own = 0;
+        for (int e = nodes[q].extra; e; e = overflow[size_t(e)].next){ // the clone gets its own copy of the list
+            setNext(cl, overflow[size_t(e)].symbol, overflow[size_t(e)].target);
+        }
+        first[cl] = first[q];
+        nodes[q].link = cl;
+        for (; p != -1 && next(p, c) == q; p = nodes[p].link){
+            setNext(p, c, cl); // Redirect transitions where needed
+        }
+        return cl;
+    }
+
+    void allocate(size_t states){
+        bytes = states * (sizeof(Node) + sizeof(int));
+#ifdef HAVE_MMAP
+        // anonymous memory is only backed once touched, so a generous arena costs nothing
+        void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (huge){
+            size_t page = size_t(2) << 20;
+            bytes = (bytes + page - 1) / page * page;
+            p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+#endif
+        if (p == MAP_FAILED){ // no huge pages reserved, ask for transparent ones instead
+            p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (huge && p != MAP_FAILED){
+                madvise(p, bytes, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        if (p == MAP_FAILED){
+            throw std::bad_alloc();
+        }
+        nodes = static_cast<Node*>(p);
+        mapped = true;
+#else
+        nodes = static_cast<Node*>(::operator new(bytes, std::align_val_t{alignof(Node)}));
+#endif
+        first = reinterpret_cast<int*>(nodes + states);
+        capacity = states;
+    }
+
+    void release(){
+        if (viewing){
+            viewing = false;
+            nodes = nullptr;
+            first = nullptr;
+        }
+        if (nodes == nullptr){
+            return;
+        }
+#ifdef HAVE_MMAP
+        if (mapped){
+            munmap(nodes, bytes);
+        }
+#else
+        ::operator delete(nodes, std::align_val_t{alignof(Node)});
+#endif
+        nodes = nullptr;
+        first = nullptr;
+        capacity = 0;
+    }
+};
@@ -1,21 +1,18 @@
 #include <iostream>
 #include <string>
 #include <fstream>
-#include <algorithm>
+#include <vector>
+#include "../common/gzip_input.hpp"
+#include "../common/fasta_reader.hpp"
 
 // print usage
 void usage(){
     std::cout << "USAGE: toupper <input_genome> <output_genome>\n"
               << "\n"
-              << "all 2 files are required.\n"
+              << "all 2 files are required. <input_genome> may be gzip or BGZF compressed.\n"
               << "\n";
 }
 
-std::string str_toupper(std::string s) {
-    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c){ return std::toupper(c);});
-    return s;
-}
-
 int main(int argc, char *argv[]){
     // handle command line input
     if (argc != 3){
@@ -27,7 +24,7 @@ int main(int argc, char *argv[]){
 
     // open all the files needed and verify whether they are successful
     std::ofstream outfile{output_file};
-    std::ifstream infile{input_file};
+    gzip_input::File infile{input_file};
     if (!infile){
         std::cerr << "Failed to open input file " << input_file << '\n';
         std::cerr << "Exiting..." << '\n';
@@ -39,15 +36,18 @@ int main(int argc, char *argv[]){
         return -1;
     }
 
-    std::string line;
-    while(std::getline(infile, line)){
-        outfile << str_toupper(line) << '\n';
+    // upper-case the file a block at a time, headers and line breaks included
+    std::vector<char> block(1 << 20);
+    char last = '\n';
+    while(infile.read(block.data(), std::streamsize(block.size())) || infile.gcount() > 0){
+        size_t n = size_t(infile.gcount());
+        fasta::upper(block.data(), n);
+        outfile.write(block.data(), std::streamsize(n));
+        last = block[n - 1];
+    }
+    if (last != '\n'){ // every line ends in a line break
+        outfile << '\n';
     }
 
-    infile.close();
     outfile.close();
 };
-
-
-
-
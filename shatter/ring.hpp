@@ -0,0 +1,88 @@
+#pragma once
+/**
+ * The bounded ring shatter hands its batches of fragments around in.
+ *
+ * Batch n always goes in slot n % size. Each slot has a stage counter that
+ * only goes up, three steps for every batch that passes through it: filled
+ * by the digest, matched by a worker, written (and so free again) by the
+ * writer. Every side knows the value it has to wait for from the batch
+ * number alone, so there is no lock anywhere: the digest waits for the
+ * writer to free the slot, a worker for its batch to be filled and the
+ * writer for the next batch in order to be matched. Workers draw batch
+ * numbers from a shared counter, so the output stays in digest order however
+ * the batches are shared out, and the digest never runs more than size
+ * batches ahead of the writer. Waiting is C++20 atomic wait, which sleeps
+ * in the kernel rather than spinning.
+ */
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+template<class Batch>
+class Ring{
+public:
+    explicit Ring(size_t size) : slots(size){}
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    size_t size() const {
+        return slots.size();
+    }
+
+    // the digest: batch n to fill, once the writer is done with the one before it in the slot
+    Batch& fill(size_t n){
+        return await(n, 0);
+    }
+    void filled(size_t n){
+        advance(n, 1);
+    }
+
+    // a worker: the number of the next batch to match
+    size_t claim(){
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+    // batch n to match, once it is filled
+    Batch& match(size_t n){
+        return await(n, 1);
+    }
+    void matched(size_t n){
+        advance(n, 2);
+    }
+
+    // the writer: batch n to write, once it is matched
+    Batch& write(size_t n){
+        return await(n, 2);
+    }
+    void written(size_t n){
+        advance(n, 3);
+    }
+
+private:
+    struct Slot{
+        std::atomic<uint64_t> stage{0};
+        Batch batch;
+    };
+    std::vector<Slot> slots;
+    std::atomic<size_t> next{0};
+
+    // the stage value slot n % size has at step (0: free, 1: filled, 2: matched) of batch n
+    uint64_t stage(size_t n, int step) const {
+        return uint64_t(n / slots.size()) * 3 + uint64_t(step);
+    }
+
+    Batch& await(size_t n, int step){
+        Slot& slot = slots[n % slots.size()];
+        uint64_t want = stage(n, step);
+        for (uint64_t now; (now = slot.stage.load(std::memory_order_acquire)) != want;){
+            slot.stage.wait(now, std::memory_order_acquire);
+        }
+        return slot.batch;
+    }
+
+    void advance(size_t n, int step){
+        Slot& slot = slots[n % slots.size()];
+        slot.stage.store(stage(n, step), std::memory_order_release);
+        slot.stage.notify_all();
+    }
+};
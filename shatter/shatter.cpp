@@ -0,0 +1,503 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <variant>
+#include "../common/gzip_input.hpp"
+#include "../common/fasta_reader.hpp"
+#include "../common/stats.hpp"
+#include "../fragments/digest.hpp"
+#include "../matching/fragment_set.hpp"
+#include "../matching/longest_match.hpp"
+#include "../matching/reference_index.hpp"
+#include "ring.hpp"
+
+// print usage
+void usage(){
+    std::cout << "USAGE: shatter [--engine sam|fm] [--threads N] [--both-strands] [--batch L] [--stats=json]\n"
+              << "               <genome-file> <query-genome> <enzyme>[+<enzyme>...] <output-file>\n"
+              << "It digests <query-genome> with the enzymes and finds the longest common substring of every\n"
+              << "fragment with <genome-file>, in one run: the fragments go straight from the digest to the\n"
+              << "matching threads and on to <output-file>, with no fragments file in between, so digesting,\n"
+              << "matching and writing all go on at once.\n"
+              << "\n"
+              << "<output-file> is what\n"
+              << "  digestFragment <query-genome> <enzyme>[+<enzyme>...] fragments.csv\n"
+              << "  match --whole-genome [--both-strands] <genome-file> fragments.csv <output-file>\n"
+              << "would write, one NUM,MATCH,CHRONOSOME,START,END[,STRAND] line per fragment, numbered from 1 in\n"
+              << "every header of <query-genome>. Enter \"match\" and \"digestFragment\" for the details.\n"
+              << "\n"
+              << "<genome-file> is a FASTA file (it may be gzip compressed), made into one automaton (or\n"
+              << "FM-index) over the whole genome, or a reference index written by match index, which is\n"
+              << "mapped as it is.\n"
+              << "<query-genome> is a FASTA file as well (it may be gzip compressed).\n"
+              << "Several enzymes can be given at once for a multi-digest, e.g. EcoRI+BamHI (',' works too).\n"
+              << "\n"
+              << "--engine fm matches with an FM-index instead of the suffix automaton (--engine sam, the default).\n"
+              << "--threads N matches on N threads (all the cores by default). The digest and the writing\n"
+              << "  have a thread each on top of those.\n"
+              << "--both-strands also matches the reverse complement of every fragment, adding a STRAND column.\n"
+              << "--batch L hands the fragments on to the matching threads about L letters at a time (1048576).\n"
+              << "  At most 2 batches per thread are in flight, which bounds the memory the fragments take.\n"
+              << "--stats=json writes statistics of the run to stderr as one JSON object once it is done: the\n"
+              << "  seconds each stage was busy and waiting, the fragments and batches, suffix links followed\n"
+              << "  per fragment letter (search steps for fm), bytes read and written, and the peak resident set.\n\n";
+}
+
+/**
+ * global variables (for the sake of speed & simplicity)
+ */
+const fasta::Alphabet alphabet{letters}; // letters of either case -> symbol codes
+bool both_strands = false;
+size_t batch_letters = 1 << 20;         // --batch L
+
+// --stats=json
+stats::Phases phases;
+std::atomic<uint64_t> queried{0}, fallbacks{0}; // fragment letters matched and suffix links (or FM-index steps) taken
+
+/**
+ * What goes round the ring: the fragments of a stretch of the digest, then their output lines
+ */
+struct Batch{
+    FragmentSet fragments;
+    std::string text;       // the lines, once matched
+    bool last = false;      // the digest is over, the worker that draws this stops
+
+    void clear(){
+        fragments.codes.clear();
+        fragments.offsets.assign(1, 0);
+        fragments.ids.clear();
+        text.clear();
+        last = false;
+    }
+};
+
+/**
+ * What the fragments are matched against: one automaton or FM-index over the whole
+ * genome, or the automata of a reference index, one per chromosome or one for all
+ */
+struct Reference{
+    std::string engine;
+    SuffixAutomaton sam;
+    FMIndex fm;
+    reference_index::Index index;
+    bool indexed = false;
+    std::vector<reference_index::Chromosome> chroms;
+};
+
+/**
+ * read a FASTA genome into the reference, every chromosome after the first a string of its own
+ * input : the genome file, opened
+ * output: none, exits on a letter that is not IUPAC
+ */
+void buildReference(std::istream& ref, Reference& reference){
+    std::vector<unsigned char> genome;
+    std::vector<size_t> cuts;   // where chromosomes after the first start
+    auto& chroms = reference.chroms;
+    auto header = [&](std::string_view name){ // the name is the first word, like the FASTA id
+        if (!chroms.empty()){
+            chroms.back().length = genome.size() - chroms.back().start;
+            if (!genome.empty()){
+                cuts.push_back(genome.size());
+            }
+        }
+        chroms.push_back({std::string(name.substr(0, name.find_first_of(" \t"))), genome.size(), 0});
+    };
+    fasta::Reader{ref, &alphabet}.run(header, [&](std::basic_string_view<unsigned char> codes){
+        if (chroms.empty()){ // sequence before the first header
+            header("");
+        }
+        genome.insert(genome.end(), codes.begin(), codes.end());
+    }, badLetter);
+    if (chroms.empty()){
+        header("");
+    }
+    chroms.back().length = genome.size() - chroms.back().start;
+    if (reference.engine == "fm"){
+        reference.fm.build(genome, cuts);
+    }else{
+        build(reference.sam, genome, cuts);
+    }
+}
+
+/**
+ * Hands the fragments of the digest on to the matching threads: numbered the way
+ * digestFragment numbers its lines, turned into symbol codes and gathered into
+ * batches of about batch_letters letters, which go into the ring in order.
+ */
+class Batcher : public Sink{
+public:
+    explicit Batcher(Ring<Batch>& ring) : ring(ring){
+        batch = &ring.fill(0);
+        batch->clear();
+    }
+
+    void header(std::string_view name) override {
+        close();
+        chrom = name;
+        open = true;
+        index = 0; // a new segment, reset index
+        batch->fragments.add(++index);
+    }
+    void bases(std::string_view bases) override {
+        if (!open){ // sequence before the first header
+            header("");
+        }
+        auto& codes = batch->fragments.codes;
+        for (char ch : bases){
+            unsigned char code = alphabet((unsigned char)ch);
+            if (code == 0xFF){
+                std::cout << "[query genome]\n"
+                          << "Header: " << chrom << ", fragment " << index << '\n';
+                error(ch);
+            }
+            codes.push_back(code);
+        }
+    }
+    void cut(int) override {
+        if (!open){
+            header("");
+        }
+        full();
+        batch->fragments.add(++index);
+    }
+    void close() override {
+        if (open){
+            full();
+        }
+        open = false;
+    }
+
+    /**
+     * hand on what is left, then one batch marked last for each of the workers
+     */
+    void finish(int workers){
+        close();
+        if (batch->fragments.size() > 0){
+            publish(true);
+        }
+        for (int w = 0; w < workers; ++w){
+            batch->last = true;
+            publish(w + 1 < workers);
+        }
+    }
+
+    size_t batches = 0, fragments = 0, letters = 0;
+    double waiting = 0; // seconds the ring was full
+
+private:
+    Ring<Batch>& ring;
+    Batch* batch = nullptr;
+    size_t number = 0;  // of the batch being filled
+    std::string chrom;
+    int index = 0;
+    bool open = false;  // whether a fragment has been started
+
+    // the current fragment is complete: hand the batch on if it is big enough
+    void full(){
+        if (batch->fragments.codes.size() >= batch_letters){
+            publish(true);
+        }
+    }
+
+    void publish(bool more){
+        batch->fragments.done();
+        if (!batch->last){
+            ++batches;
+            fragments += batch->fragments.size();
+            letters += batch->fragments.codes.size();
+        }
+        ring.filled(number++);
+        if (more){
+            auto start = stats::Clock::now();
+            batch = &ring.fill(number);
+            waiting += stats::seconds(start, stats::Clock::now());
+            batch->clear();
+        }
+    }
+};
+
+/**
+ * the best match of every fragment of a batch, written into its text as
+ * NUM,MATCH,CHRONOSOME,START,END[,STRAND] lines. Every automaton is a unit of its
+ * own, like in match: a later one only replaces a match if it finds a longer one.
+ * input : the reference, the batch, and a view and a buffer the worker keeps
+ */
+void matchBatch(const Reference& reference, Batch& batch, SuffixAutomaton& view, std::vector<unsigned char>& rc){
+    const auto& fragments = batch.fragments;
+    std::vector<Best> best(fragments.size());
+    uint64_t letters_matched = 0, steps = 0;
+    auto solve = [&](const auto& engine, size_t base){
+        for (size_t i = 0; i < fragments.size(); ++i){
+            matchStrands(fragments, i, both_strands, rc, best[i], [&](Fragment fragment){
+                Found found = bestMatch(engine, fragment, base);
+                letters_matched += fragment.size();
+                steps += found.steps;
+                return found;
+            });
+        }
+    };
+    if (reference.indexed){
+        for (size_t a = 0; a < reference.index.automata.size(); ++a){
+            reference.index.view(a, view);
+            solve(view, reference.index.automata[a].base);
+        }
+    }else if (reference.engine == "fm"){
+        solve(reference.fm, 0);
+    }else{
+        solve(reference.sam, 0);
+    }
+    queried += letters_matched;
+    fallbacks += steps;
+
+    for (size_t i = 0; i < fragments.size(); ++i){
+        appendAnswer(batch.text, fragments, i, best[i], reference.chroms, both_strands);
+    }
+}
+
+/**
+ * --stats=json: write what the run took as one JSON object
+ * input : the stream, the run's settings, the batcher and the seconds each stage waited
+ * output: the object, in out
+ */
+void writeStats(std::ostream& out, const std::string& engine, int threads, const std::vector<std::string>& chosen,
+                const Batcher& batcher, double query_waiting, double write_waiting, double total,
+                uint64_t bytes_read, uint64_t bytes_written){
+    stats::Json json{out};
+    json.object()
+        .field("tool", "shatter").field("engine", engine).field("threads", threads)
+        .field("both_strands", both_strands);
+    json.key("enzymes").array();
+    for (const auto& enzyme : chosen){
+        json.value(enzyme);
+    }
+    json.end();
+    json.field("batches", batcher.batches).field("fragments", batcher.fragments).field("fragment_letters", batcher.letters);
+    json.key("phases").object();
+    for (const auto& [phase, seconds] : phases.list()){
+        json.field(phase, seconds);
+    }
+    json.end();
+    json.key("waiting").object() // the digest for a free slot, the matchers for batches, the writer for the next one
+        .field("digest", batcher.waiting).field("query", query_waiting).field("write", write_waiting)
+        .end();
+    json.field("total_seconds", total);
+    uint64_t letters_matched = queried, steps = fallbacks;
+    json.key("query").object()
+        .field("letters", letters_matched)
+        .field(engine == "fm" ? "search_steps" : "fallbacks", steps)
+        .field(engine == "fm" ? "search_steps_per_letter" : "fallbacks_per_letter",
+               letters_matched ? double(steps) / double(letters_matched) : 0.0)
+        .end();
+    json.field("bytes_read", bytes_read).field("bytes_written", bytes_written).field("peak_rss_kb", stats::peakRssKb());
+    json.end();
+}
+
+int main(int argc, char* argv[]){
+    // handle command line input
+    std::vector<std::string> args;
+    std::string engine = "sam";
+    int threads = int(std::max(1u, std::thread::hardware_concurrency()));
+    bool want_stats = false;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg.starts_with("--engine")){
+            engine = arg.size() > 8 && arg[8] == '=' ? arg.substr(9) : (i + 1 < argc ? argv[++i] : "");
+            if (engine != "sam" && engine != "fm"){
+                usage();
+                return -1;
+            }
+        }else if (arg.starts_with("--threads")){
+            std::string num = arg.size() > 9 && arg[9] == '=' ? arg.substr(10) : (i + 1 < argc ? argv[++i] : "");
+            threads = std::atoi(num.c_str());
+            if (threads < 1){
+                usage();
+                return -1;
+            }
+        }else if (arg.starts_with("--batch")){
+            std::string num = arg.size() > 7 && arg[7] == '=' ? arg.substr(8) : (i + 1 < argc ? argv[++i] : "");
+            batch_letters = size_t(std::max(0, std::atoi(num.c_str())));
+            if (batch_letters < 1){
+                usage();
+                return -1;
+            }
+        }else if (arg.starts_with("--stats")){
+            std::string format = arg.size() > 7 && arg[7] == '=' ? arg.substr(8) : (i + 1 < argc ? argv[++i] : "");
+            if (format != "json"){
+                usage();
+                return -1;
+            }
+            want_stats = true;
+        }else if (arg == "--both-strands"){
+            both_strands = true;
+        }else{
+            args.push_back(arg);
+        }
+    }
+    if (args.size() != 4){
+        usage();
+        return -1;
+    }
+    std::string ref_genome_file   = args[0];
+    std::string query_genome_file = args[1];
+    std::vector<std::string> chosen = splitEnzymes(args[2]);
+    std::string output_file       = args[3];
+    if (chosen.empty()){
+        usage();
+        return -1;
+    }
+    for (const auto& enzyme : chosen){
+        if (enzymes.count(enzyme) == 0){
+            std::cerr << "Unknown enzyme " << enzyme << " (enter digestFragment for the ones it knows)\n";
+            std::cerr << "Exiting..." << '\n';
+            return -1;
+        }
+    }
+
+    // open all the files needed and verify whether they are successful
+    auto started = stats::Clock::now();
+    std::ofstream outfile{output_file};
+    gzip_input::File query{query_genome_file};
+    Reference reference;
+    reference.engine = engine;
+    reference.indexed = reference_index::isIndexFile(ref_genome_file);
+    gzip_input::File ref{ref_genome_file};
+    if (reference.indexed && engine != "sam"){
+        std::cerr << ref_genome_file << " is a reference index of suffix automata, it cannot be used with --engine " << engine << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    if (!ref){
+        std::cerr << "Failed to open input file " << ref_genome_file << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    if (!query){
+        std::cerr << "Failed to open input file " << query_genome_file << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    if (!outfile){
+        std::cerr << "Failed to create output file (maybe it already exists) " << output_file << '\n';
+        std::cerr << "Exiting..." << '\n';
+        return -1;
+    }
+    if (reference.indexed){
+        std::string problem = reference.index.load(ref_genome_file);
+        if (!problem.empty()){
+            std::cerr << "Failed to read reference index " << ref_genome_file << ": " << problem << '\n';
+            std::cerr << "Exiting..." << '\n';
+            return -1;
+        }
+        reference.chroms = reference.index.chroms;
+    }
+
+    // the digest starts right away and fills the ring while the reference is built
+    std::vector<std::string> sites;
+    for (const auto& enzyme : chosen){
+        sites.push_back(enzymes[enzyme].first);
+    }
+    int total = 0;
+    for (const auto& site : sites){
+        total += int(site.size());
+    }
+    Digest::Matcher matcher = total <= ShiftAnd::maxBits
+        ? Digest::Matcher{std::in_place_type<ShiftAnd>, sites}
+        : Digest::Matcher{std::in_place_type<AhoCorasick>, sites};
+    Ring<Batch> ring{size_t(threads) * 2 + 2};
+    Batcher batcher{ring};
+    double digest_busy = 0;
+    std::thread digesting([&]{
+        auto start = stats::Clock::now();
+        Digest digest{matcher, chosen, batcher};
+        fasta::Reader{query, nullptr, size_t(1) << 16}.run(
+            [&](std::string_view name){ digest.header(name); },
+            [&](std::basic_string_view<unsigned char> bases){
+                digest.feed(std::string_view(reinterpret_cast<const char*>(bases.data()), bases.size()));
+            },
+            [](char, size_t){});
+        digest.finish();
+        batcher.finish(threads);
+        digest_busy = stats::seconds(start, stats::Clock::now()) - batcher.waiting;
+    });
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    if (!reference.indexed){
+        buildReference(ref, reference);
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    double building = std::chrono::duration<double>(t2 - t1).count();
+    std::cout << "reference loaded in " << std::chrono::duration_cast<std::chrono::milliseconds>(t2-t1).count() << " ms\n";
+
+    // the workers match batches in whatever order they get them, the writer writes them in order
+    std::vector<double> busy(size_t(threads), 0), idle(size_t(threads), 0);
+    auto worker = [&](size_t w){
+        SuffixAutomaton view;
+        std::vector<unsigned char> rc;
+        while(true){
+            size_t n = ring.claim();
+            auto start = stats::Clock::now();
+            Batch& batch = ring.match(n);
+            auto matching = stats::Clock::now();
+            idle[w] += stats::seconds(start, matching);
+            if (batch.last){
+                ring.matched(n);
+                return;
+            }
+            matchBatch(reference, batch, view, rc);
+            ring.matched(n);
+            busy[w] += stats::seconds(matching, stats::Clock::now());
+        }
+    };
+    double write_busy = 0, write_idle = 0;
+    std::thread writing([&]{
+        for (size_t n = 0;; ++n){
+            auto start = stats::Clock::now();
+            Batch& batch = ring.write(n);
+            auto writes = stats::Clock::now();
+            write_idle += stats::seconds(start, writes);
+            if (batch.last){
+                break;
+            }
+            outfile.write(batch.text.data(), std::streamsize(batch.text.size()));
+            ring.written(n);
+            write_busy += stats::seconds(writes, stats::Clock::now());
+        }
+        outfile.flush();
+    });
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t){
+        pool.emplace_back(worker, size_t(t));
+    }
+    worker(0);
+    for (auto& th : pool){
+        th.join();
+    }
+    digesting.join();
+    writing.join();
+
+    double query_busy = 0, query_idle = 0;
+    for (int t = 0; t < threads; ++t){
+        query_busy += busy[size_t(t)];
+        query_idle += idle[size_t(t)];
+    }
+    phases.add("build", building); // the digest ran in the meantime
+    phases.add("digest", digest_busy);
+    phases.add("query", query_busy);
+    phases.add("write", write_busy);
+    auto t3 = std::chrono::high_resolution_clock::now();
+    std::cout << "Done! " << batcher.fragments << " fragments in " << batcher.batches << " batches are matched in " << output_file << '\n';
+    std::cout << "Total time taken = " << std::chrono::duration_cast<std::chrono::milliseconds>(t3-t1).count() << '\n';
+    if (want_stats){
+        uint64_t bytes_read = stats::fileSize(ref_genome_file) + stats::fileSize(query_genome_file);
+        writeStats(std::cerr, engine, threads, chosen, batcher, query_idle, write_idle, stats::seconds(started, stats::Clock::now()),
+                   bytes_read, uint64_t(std::max<std::streamoff>(0, outfile.tellp())));
+    }
+    outfile.close();
+    return 0;
+}